@@ -1,11 +1,38 @@
 #include <iostream>
 #include <vector>
+#include <deque>
+#include <unordered_map>
 #include <thread>
 #include <future>
 #include <mutex>
+#include <condition_variable>
 #include <memory>
 #include <functional>
 #include <csignal>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <algorithm>
+#include <type_traits>
+#include <cmath>
+#include <climits>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 using namespace std::chrono;
@@ -23,19 +50,27 @@ public:
   HashTree* m_left;
   HashTree* m_right;
 
-  HashTree(K key, V val) : m_key(key), m_val(val), m_left(nullptr), m_right(nullptr) {}
+  HashTree(K key, V val) : m_key(key), m_val(move(val)), m_left(nullptr), m_right(nullptr) {}
 
   /**
    * BST insertion - O(log n)
    *
    */
   static HashTree* insertNode(HashTree* root, const K& key, const V& val) {
+    return insertNode(root, new HashTree(key, val));
+  }
+
+  /**
+   * BST insertion of a node the caller allocated - O(log n)
+   *
+   */
+  static HashTree* insertNode(HashTree* root, HashTree* node) {
     if (root == nullptr) {
-      root = new HashTree(key, val);
-    } else if (root->m_key >= key) {
-      root->m_left = insertNode(root->m_left, key, val);
+      root = node;
+    } else if (root->m_key >= node->m_key) {
+      root->m_left = insertNode(root->m_left, node);
     } else {
-      root->m_right = insertNode(root->m_right, key, val);
+      root->m_right = insertNode(root->m_right, node);
     }
 
     return root;
@@ -62,6 +97,19 @@ public:
     }
   }
 
+  /**
+   * BST node lookup - O(log n)
+   * Returns the node holding key, or nullptr
+   *
+   */
+  static HashTree* findNode(HashTree* root, const K& key) {
+    while (root && !(root->m_key == key)) {
+      root = (root->m_key > key) ? root->m_left : root->m_right;
+    }
+
+    return root;
+  }
+
   /**
    * Get smallest node - O(n)
    *
@@ -80,30 +128,39 @@ public:
    *
    */
   static HashTree* remove(HashTree* root, const K& key) {
+    HashTree* unlinked = nullptr;
+    root = remove(root, key, unlinked);
+    delete unlinked;
+    return root;
+  }
+
+  /**
+   * BST removal that hands the unlinked node to the caller instead of deleting it - O(log n)
+   *
+   */
+  static HashTree* remove(HashTree* root, const K& key, HashTree*& unlinked) {
     if (root == nullptr) {
       return nullptr;
     }
 
     if (root->m_key > key) {
-      root->m_left = remove(root->m_left, key);
+      root->m_left = remove(root->m_left, key, unlinked);
     } else if (root->m_key < key) {
-      root->m_right = remove(root->m_right, key);
+      root->m_right = remove(root->m_right, key, unlinked);
     } else {
       if (root->m_left == nullptr) {
-        HashTree* temp = root->m_right;
-        delete root;
-        return temp;
+        unlinked = root;
+        return root->m_right;
       } else if (root->m_right == nullptr) {
-        HashTree* temp = root->m_left;
-        delete root;
-        return temp;
+        unlinked = root;
+        return root->m_left;
       }
 
       // Find smallest node in the right tree
       HashTree* inOrderSuccessor = getSmallestNode(root->m_right);
       root->m_key = inOrderSuccessor->m_key;
       root->m_val = inOrderSuccessor->m_val;
-      root->m_right = remove(root->m_right, inOrderSuccessor->m_key);
+      root->m_right = remove(root->m_right, inOrderSuccessor->m_key, unlinked);
     }
 
     return root;
@@ -126,256 +183,9143 @@ public:
     return comparator(comparator(left, right), root);
   }
 };
+
 /**
- * Cache implementation
- * Designed to support O(1) insertion, O(1) lookup, O(1) update, O(n) deletion
+ * Bump allocator for bucket nodes, owned by a Cache
+ * Memory comes from mmap'd chunks of doubling size and is only returned when the arena
+ * is destroyed - buckets keep their own free lists for reuse - so dropping every node
+ * of a cache costs one munmap per chunk. Allocation is lock free until a chunk fills up
+ *
+ * An arena that is not shared, for single threaded owners, bumps with a plain load and store
+ * and takes no lock for a new chunk
  *
  */
-template <typename K, typename V>
-class Cache {
-protected:
-  /**
-   * Partitions in the cache - Not necesarrily same as number of elements
-   * Increase to have a better average case insertion/lookup performance
-   *
-   */
-  static const long NUM_BUCKETS = 1024;
+class NodeArena {
+  static constexpr size_t FIRST_CHUNK = 64 << 10;
+  static constexpr size_t MAX_CHUNK = 64 << 20;
+  static constexpr size_t ALIGN = alignof(max_align_t);
 
-  /**
-   * Maximum number of elements supported by the cache
-   *
-   */
-  static const long CACHE_SIZE = 1024;
+  struct Chunk {
+    Chunk* m_prev;
+    size_t m_size;
+    atomic<size_t> m_used;
+  };
 
-  /**
-   * Cache partitions - Same as number of slots in the cache if NUM_BUCKETS = CACHE_SIZE
-   *
-   */
-  HashTree<K, pair<V, long>>* buckets[NUM_BUCKETS];
+  atomic<Chunk*> m_current;
+  mutex m_lock;
+  bool m_shared;
 
-  /**
-   * Locks to protect access to a partition
-   *
-   */
-  mutex bucketLocks[NUM_BUCKETS];
+  static constexpr size_t HEADER = (sizeof(Chunk) + ALIGN - 1) & ~(ALIGN - 1);
 
-  /**
-   * Actual number of elements in the cache
-   *
-   */
-  atomic<long> cacheSize;
+  static void* mapChunk(size_t size) {
+#ifdef __linux__
+    void* mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+      throw bad_alloc();
+    }
+    return mem;
+#else
+    return ::operator new(size);
+#endif
+  }
 
-  int hashFunc(const K& key) {
-    hash<K> hashVal;
-    return (hashVal(key) % NUM_BUCKETS);
+  static void unmapChunk(Chunk* chunk) {
+#ifdef __linux__
+    munmap(chunk, chunk->m_size);
+#else
+    ::operator delete(chunk);
+#endif
   }
 
-public:
-  Cache() {
-    for (int i = 0; i < NUM_BUCKETS; i++) {
-      buckets[i] = nullptr;
+  void addChunk(Chunk* full, size_t need) {
+    unique_lock<mutex> lock(m_lock, defer_lock);
+    if (m_shared) {
+      lock.lock();
+    }
+    if (m_current.load(memory_order_relaxed) != full) {
+      // Another thread already replaced it
+      return;
     }
-    cacheSize = 0;
-  }
 
-  bool get(const K& key, V& val) {
-    int hashVal = hashFunc(key);
-    // Acquire bucket lock
-    scoped_lock<mutex> lock(bucketLocks[hashVal]);
-    HashTree<K, pair<V, long>>* bucket = buckets[hashVal];
+    size_t size = full ? min(full->m_size * 2, MAX_CHUNK) : FIRST_CHUNK;
+    size = max(size, HEADER + need);
+
+    Chunk* chunk = (Chunk*) mapChunk(size);
+    chunk->m_prev = full;
+    chunk->m_size = size;
+    new (&chunk->m_used) atomic<size_t>(HEADER);
+    m_current.store(chunk, memory_order_release);
+  }
 
-    pair<V, long> valWrapper;
+public:
+  explicit NodeArena(bool shared = true) : m_current(nullptr), m_shared(shared) {}
 
-    bool ret = HashTree<K, pair<V, long>>::getVal(bucket, key, valWrapper);
-    val = valWrapper.first;
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
 
-    return ret;
+  ~NodeArena() {
+    Chunk* chunk = m_current.load(memory_order_relaxed);
+    while (chunk) {
+      Chunk* prev = chunk->m_prev;
+      unmapChunk(chunk);
+      chunk = prev;
+    }
   }
 
-  bool put(const K& key, const V& val) {
+  void* allocate(size_t size) {
+    size = (size + ALIGN - 1) & ~(ALIGN - 1);
+    for (;;) {
+      Chunk* chunk = m_current.load(memory_order_acquire);
+      if (chunk && !m_shared) {
+        size_t offset = chunk->m_used.load(memory_order_relaxed);
+        if (offset + size <= chunk->m_size) {
+          chunk->m_used.store(offset + size, memory_order_relaxed);
+          return (char*) chunk + offset;
+        }
+      } else if (chunk) {
+        size_t offset = chunk->m_used.fetch_add(size, memory_order_relaxed);
+        if (offset + size <= chunk->m_size) {
+          return (char*) chunk + offset;
+        }
+      }
 
-    if (cacheSize.fetch_add(1) >= CACHE_SIZE) {
-      removeLRU();
+      // The tail of a full chunk is abandoned
+      addChunk(chunk, size);
     }
+  }
+};
 
-    int hashVal = hashFunc(key);
-    // Acquire bucket lock
-    scoped_lock<mutex> lock(bucketLocks[hashVal]);
-    HashTree<K, pair<V, long>>* bucket = buckets[hashVal];
+/**
+ * Bucket backed by a HashTree
+ * Every bucket type used by Cache exposes find/insert/remove/forEach
+ *
+ * Nodes come from the owning Cache's NodeArena once setArena is called, removed nodes are
+ * kept on a free list for the next insert. Without an arena nodes are new'd and deleted
+ *
+ */
+template <typename K, typename V>
+class TreeBucket {
+  typedef HashTree<K, V> Node;
+
+  Node* m_root;
+  NodeArena* m_arena;
+  // Destroyed nodes waiting for reuse, linked through m_left
+  Node* m_free;
 
-    long currentTimeMillis = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+  Node* allocNode(const K& key, V&& val) {
+    if (!m_arena) {
+      return new Node(key, move(val));
+    }
 
-    if (cacheSize.load() == 1) {
-      cout << "First element timestamp " << currentTimeMillis << endl;
+    void* mem = m_free;
+    if (m_free) {
+      m_free = m_free->m_left;
+    } else {
+      mem = m_arena->allocate(sizeof(Node));
     }
+    return new (mem) Node(key, move(val));
+  }
 
-    buckets[hashVal] = HashTree<K, pair<V, long>>::insertNode(bucket, key, pair<V, long>(val, currentTimeMillis));
+  void freeNode(Node* node) {
+    if (!m_arena) {
+      delete node;
+      return;
+    }
 
-    return true;
+    node->~Node();
+    node->m_left = m_free;
+    m_free = node;
   }
 
-  bool remove(const K& key) {
-    int hashVal = hashFunc(key);
-    // Acquire bucket lock
-    scoped_lock<mutex> lock(bucketLocks[hashVal]);
-    HashTree<K, pair<V, long>>* bucket = buckets[hashVal];
+public:
+  TreeBucket() : m_root(nullptr), m_arena(nullptr), m_free(nullptr) {}
 
-    buckets[hashVal] = HashTree<K, pair<V, long>>::remove(bucket, key);
+  TreeBucket(const TreeBucket&) = delete;
+  TreeBucket& operator=(const TreeBucket&) = delete;
 
-    cacheSize.fetch_sub(1);
+  /**
+   * Arena nodes holding trivially destructible entries are left to the arena - O(1)
+   * Otherwise every node is destroyed - O(n), iterative so deep trees cannot overflow the stack
+   *
+   */
+  ~TreeBucket() {
+    if (m_arena && is_trivially_destructible<K>::value && is_trivially_destructible<V>::value) {
+      return;
+    }
+
+    Node* node = m_root;
+    while (node) {
+      // Rotate left children up until the node has none, then drop it
+      if (node->m_left) {
+        Node* left = node->m_left;
+        node->m_left = left->m_right;
+        left->m_right = node;
+        node = left;
+      } else {
+        Node* right = node->m_right;
+        if (m_arena) {
+          node->~Node();
+        } else {
+          delete node;
+        }
+        node = right;
+      }
+    }
+  }
+
+  /**
+   * Called by Cache before the first insert
+   *
+   */
+  void setArena(NodeArena* arena) {
+    m_arena = arena;
+  }
+
+  V* find(const K& key) {
+    Node* node = Node::findNode(m_root, key);
+    return node ? &node->m_val : nullptr;
+  }
+
+  /**
+   * Insert or update - O(log n)
+   * Returns true if a new entry was added
+   *
+   */
+  bool insert(const K& key, V val) {
+    if (V* existing = find(key)) {
+      *existing = move(val);
+      return false;
+    }
 
+    m_root = Node::insertNode(m_root, allocNode(key, move(val)));
     return true;
   }
 
-  bool removeLRU() {
-    // Search each bucket for oldest -> O(n)
-    // Get key for oldest -> O(1)
-    // Remove key -> O(log n)
-    function<HashTree<K, pair<V, long>>* (HashTree<K, pair<V, long>>*, HashTree<K, pair<V, long>>*)> func =
-    [](HashTree<K, pair<V, long>>* left, HashTree<K, pair<V, long>>* right) {
-      if (left == nullptr) {
-        return right; // Could also be null
-      }
+  bool remove(const K& key) {
+    if (!Node::findNode(m_root, key)) {
+      return false;
+    }
 
-      if (right == nullptr) {
-        return left; // Could also be null
-      }
-      // If both are null, we would return null anyway
-      // Else return older of the two
-      return (left->m_val.second < right->m_val.second ? left : right);
-    };
+    Node* unlinked = nullptr;
+    m_root = Node::remove(m_root, key, unlinked);
+    freeNode(unlinked);
+    return true;
+  }
+
+  template <typename F>
+  void forEach(F&& func) {
+    forEach(m_root, func);
+  }
 
-    HashTree<K, pair<V, long>>* oldest = nullptr;
+private:
+  template <typename F>
+  static void forEach(Node* root, F& func) {
+    if (root == nullptr) {
+      return;
+    }
 
-    for (int i = 0; i < NUM_BUCKETS; i++) {
-      HashTree<K, pair<V, long>>* currentOldest;
-      scoped_lock<mutex> lock(bucketLocks[i]);
-      HashTree<K, pair<V, long>>* bucket = buckets[i];
-      currentOldest = HashTree<K, pair<V, long>>::seekWithComparator(bucket, func);
+    forEach(root->m_left, func);
+    func(root->m_key, root->m_val);
+    forEach(root->m_right, func);
+  }
+};
 
-      if (!currentOldest) {
-        continue;
-      }
+/**
+ * 64 bit finalizer from MurmurHash3 - spreads every input bit over the output
+ *
+ */
+static inline uint64_t mix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
 
-      if (!oldest) {
-        oldest = currentOldest;
-        continue;
-      }
+/**
+ * Hash of a byte run - 32 byte blocks go through four independent multiply-rotate lanes
+ * (the xxHash64 round), so long values hash several times faster than with hash<string>
+ *
+ */
+static uint64_t hashBytes(const char* data, size_t n) {
+  static constexpr uint64_t PRIME1 = 0x9e3779b185ebca87ULL;
+  static constexpr uint64_t PRIME2 = 0xc2b2ae3d27d4eb4fULL;
+  auto round = [](uint64_t acc, uint64_t word) {
+    acc += word * PRIME2;
+    return ((acc << 31) | (acc >> 33)) * PRIME1;
+  };
 
-      if (currentOldest->m_val.second < oldest->m_val.second) {
-        oldest = currentOldest;
+  uint64_t h = n * PRIME1;
+  size_t i = 0;
+  if (n >= 32) {
+    uint64_t lanes[4] = {PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1};
+    for (; i + 32 <= n; i += 32) {
+      for (int lane = 0; lane < 4; lane++) {
+        uint64_t word;
+        memcpy(&word, data + i + lane * 8, 8);
+        lanes[lane] = round(lanes[lane], word);
       }
     }
+    for (int lane = 0; lane < 4; lane++) {
+      h = round(h, lanes[lane]);
+    }
+  }
 
-    cout << "Removing oldest element " << oldest->m_key << " w/ timestamp " << oldest->m_val.second << endl;
-    remove(oldest->m_key);
+  for (; i + 8 <= n; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    h = round(h, word);
   }
-};
 
-// TEST PROGRAM
+  if (i < n) {
+    uint64_t word = 0;
+    memcpy(&word, data + i, n - i);
+    h = round(h, word);
+  }
 
-#define MAX_ELEMENTS        1024
-#define MAX_THREADS         4
-#define ELEMENTS_PER_THREAD MAX_ELEMENTS/MAX_THREADS
+  return mix64(h);
+}
 
-struct Element {
-  int val1;
-  char val2;
-  int val3;
+/**
+ * Bucket backed by an open addressed Robin Hood table
+ * Deletion shifts the following run back by one slot instead of leaving a tombstone,
+ * so probe lengths do not degrade under delete-heavy workloads and no cleanup rehash is needed
+ *
+ */
+template <typename K, typename V>
+class RobinHoodBucket {
+  struct Slot {
+    K m_key;
+    V m_val;
+    // Probe distance from the home slot plus one, 0 marks an empty slot
+    unsigned m_dist;
 
-  Element () : val1(0), val2('\0'), val3(0) {}
-  Element (int in_val1, char in_val2, int in_val3) : val1(in_val1), val2(in_val2), val3(in_val3) {}
-};
+    Slot() : m_key(), m_val(), m_dist(0) {}
+  };
 
-int main (int argc, char** argv) {
-  Cache<long, shared_ptr<Element>>* cache = new Cache<long, shared_ptr<Element>>();
-  vector<int> keys(MAX_ELEMENTS);
+  static constexpr size_t MIN_CAPACITY = 4;
+
+  vector<Slot> m_slots;
+  size_t m_size;
 
   /**
-   * Populates cache with MAX_ELEMENTS
+   * Cache::hashFunc already consumed the low bits of hash<K>, so remix before masking
    *
    */
-  auto insertFunc = [&](int tid) {
-    for (int i = (tid * ELEMENTS_PER_THREAD); i < ((tid * ELEMENTS_PER_THREAD) + ELEMENTS_PER_THREAD); i++) {
-      if (i >= MAX_ELEMENTS) {
-        break;
+  static size_t homeSlot(const K& key, size_t mask) {
+    return mix64(hash<K>()(key)) & mask;
+  }
+
+  long findSlot(const K& key) {
+    if (m_size == 0) {
+      return -1;
+    }
+
+    size_t mask = m_slots.size() - 1;
+    size_t i = homeSlot(key, mask);
+    for (unsigned dist = 1; ; dist++, i = (i + 1) & mask) {
+      // An entry closer to its home than we are to ours means key is absent
+      if (m_slots[i].m_dist < dist) {
+        return -1;
       }
-      int randKey = rand();
-      keys[i] = randKey;
-      if (!cache->put(randKey, make_shared<Element>(i, '\0', randKey))) {
-        cout << "Cache full! ERROR!" << endl;
-        break;
+
+      if (m_slots[i].m_key == key) {
+        return i;
       }
     }
-  };
+  }
 
-  /**
-   * Multi-threaded insert into the cache
-   *
-   */
-  vector<future<void>> futures;
+  void place(Slot&& slot) {
+    size_t mask = m_slots.size() - 1;
+    size_t i = homeSlot(slot.m_key, mask);
+    slot.m_dist = 1;
+    for (; ; slot.m_dist++, i = (i + 1) & mask) {
+      if (m_slots[i].m_dist == 0) {
+        m_slots[i] = move(slot);
+        return;
+      }
 
-  for (int i = 0; i < MAX_THREADS; i++) {
-    futures.push_back(async(insertFunc, i));
+      // Take from the rich: displace entries closer to their home slot
+      if (m_slots[i].m_dist < slot.m_dist) {
+        swap(m_slots[i], slot);
+      }
+    }
   }
 
-  for (auto& future : futures) {
-    future.get();
+  void grow() {
+    vector<Slot> old(max(MIN_CAPACITY, m_slots.size() * 2));
+    old.swap(m_slots);
+    for (auto& slot : old) {
+      if (slot.m_dist != 0) {
+        place(move(slot));
+      }
+    }
   }
 
-  futures.clear();
+public:
+  RobinHoodBucket() : m_size(0) {}
+
+  V* find(const K& key) {
+    long i = findSlot(key);
+    return i < 0 ? nullptr : &m_slots[i].m_val;
+  }
+
+  bool insert(const K& key, V val) {
+    if (V* existing = find(key)) {
+      *existing = move(val);
+      return false;
+    }
+
+    // Keep load factor at or below 7/8
+    if ((m_size + 1) * 8 > m_slots.size() * 7) {
+      grow();
+    }
+
+    Slot slot;
+    slot.m_key = key;
+    slot.m_val = move(val);
+    place(move(slot));
+    m_size++;
+    return true;
+  }
 
   /**
-   * Retrieves from cache and updates element field
+   * Backward shift deletion - O(probe length)
    *
    */
-  auto updateFunc = [&](int tid) {
-    for (const auto& key : keys) {
-      shared_ptr<Element> element;
-      if (cache->get(key, element)) {
-        element->val3 = rand();
-      } else {
-        cout << "[UPDATE] ERROR! Element " << key << " not found in cache. Possibly evicted?" << endl;
+  bool remove(const K& key) {
+    long found = findSlot(key);
+    if (found < 0) {
+      return false;
+    }
+
+    size_t mask = m_slots.size() - 1;
+    size_t i = found;
+    size_t next = (i + 1) & mask;
+    while (m_slots[next].m_dist > 1) {
+      m_slots[i] = move(m_slots[next]);
+      m_slots[i].m_dist--;
+      i = next;
+      next = (next + 1) & mask;
+    }
+
+    m_slots[i] = Slot();
+    m_size--;
+    return true;
+  }
+
+  template <typename F>
+  void forEach(F&& func) {
+    for (auto& slot : m_slots) {
+      if (slot.m_dist != 0) {
+        func(slot.m_key, slot.m_val);
       }
     }
+  }
+};
+
+/**
+ * Robin Hood bucket with entries split into hot and cold arrays
+ * Probes read only the dense control words (probe distance and an 8 bit hash tag) and,
+ * on a tag match, the key array - values are touched once the key has matched
+ *
+ */
+template <typename K, typename V>
+class SplitBucket {
+  struct Ctrl {
+    // Probe distance from the home slot plus one, 0 marks an empty slot
+    uint32_t m_dist : 24;
+    // Top byte of the remixed hash, filters key comparisons
+    uint32_t m_tag : 8;
   };
 
-  for (int i = 0; i < MAX_THREADS; i++) {
-    futures.push_back(async(updateFunc, i));
-  }
+  static constexpr size_t MIN_CAPACITY = 4;
 
-  for (auto& future : futures) {
-    future.get();
+  // Hot - read by every probe
+  vector<Ctrl> m_ctrl;
+  vector<K> m_keys;
+
+  // Cold - read on a hit
+  vector<V> m_vals;
+
+  size_t m_size;
+
+  static uint64_t hashOf(const K& key) {
+    return mix64(hash<K>()(key));
   }
 
-  futures.clear();
+  long findSlot(const K& key) {
+    if (m_size == 0) {
+      return -1;
+    }
 
-  /**
-   * Removes element from cache
-   *
-   */
-  auto deleteFunc = [&](int tid) {
-    for (const auto& key : keys) {
-      if (!cache->remove(key)) {
-        cout << "[DELETE] ERROR! Element " << key << " not found in cache. Possibly evicted?" << endl;
+    uint64_t h = hashOf(key);
+    uint32_t tag = h >> 56;
+    size_t mask = m_ctrl.size() - 1;
+    size_t i = h & mask;
+    for (uint32_t dist = 1; ; dist++, i = (i + 1) & mask) {
+      // An entry closer to its home than we are to ours means key is absent
+      if (m_ctrl[i].m_dist < dist) {
+        return -1;
+      }
+
+      if (m_ctrl[i].m_tag == tag && m_keys[i] == key) {
+        return i;
       }
     }
-  };
+  }
 
-  // UNCOMMENT BELOW TO TEST SIMULTANEOUS UPDATES & DELETES  
-  /*for (int i = 0; i < MAX_THREADS; i++) {
-    futures.push_back(async(deleteFunc, i));
+  void place(K&& key, V&& val) {
+    uint64_t h = hashOf(key);
+    size_t mask = m_ctrl.size() - 1;
+    size_t i = h & mask;
+    Ctrl ctrl = {1, (uint32_t) (h >> 56)};
+    for (; ; ctrl.m_dist++, i = (i + 1) & mask) {
+      if (m_ctrl[i].m_dist == 0) {
+        m_ctrl[i] = ctrl;
+        m_keys[i] = move(key);
+        m_vals[i] = move(val);
+        return;
+      }
+
+      // Take from the rich: displace entries closer to their home slot
+      if (m_ctrl[i].m_dist < ctrl.m_dist) {
+        swap(m_ctrl[i], ctrl);
+        swap(m_keys[i], key);
+        swap(m_vals[i], val);
+      }
+    }
   }
 
-  for (int i = 0; i < MAX_THREADS; i++) {
-    futures.push_back(async(updateFunc, i));
+  void grow() {
+    size_t capacity = max(MIN_CAPACITY, m_ctrl.size() * 2);
+    vector<Ctrl> oldCtrl(capacity, Ctrl{0, 0});
+    vector<K> oldKeys(capacity);
+    vector<V> oldVals(capacity);
+    oldCtrl.swap(m_ctrl);
+    oldKeys.swap(m_keys);
+    oldVals.swap(m_vals);
+
+    for (size_t i = 0; i < oldCtrl.size(); i++) {
+      if (oldCtrl[i].m_dist != 0) {
+        place(move(oldKeys[i]), move(oldVals[i]));
+      }
+    }
   }
 
-  for (auto& future : futures) {
-    future.get();
+public:
+  SplitBucket() : m_size(0) {}
+
+  V* find(const K& key) {
+    long i = findSlot(key);
+    return i < 0 ? nullptr : &m_vals[i];
   }
 
-  futures.clear();*/
+  bool insert(const K& key, V val) {
+    if (V* existing = find(key)) {
+      *existing = move(val);
+      return false;
+    }
+
+    // Keep load factor at or below 7/8
+    if ((m_size + 1) * 8 > m_ctrl.size() * 7) {
+      grow();
+    }
+
+    place(K(key), move(val));
+    m_size++;
+    return true;
+  }
+
+  /**
+   * Backward shift deletion - O(probe length)
+   *
+   */
+  bool remove(const K& key) {
+    long found = findSlot(key);
+    if (found < 0) {
+      return false;
+    }
+
+    size_t mask = m_ctrl.size() - 1;
+    size_t i = found;
+    size_t next = (i + 1) & mask;
+    while (m_ctrl[next].m_dist > 1) {
+      m_ctrl[i] = m_ctrl[next];
+      m_ctrl[i].m_dist--;
+      m_keys[i] = move(m_keys[next]);
+      m_vals[i] = move(m_vals[next]);
+      i = next;
+      next = (next + 1) & mask;
+    }
+
+    m_ctrl[i] = Ctrl{0, 0};
+    m_keys[i] = K();
+    m_vals[i] = V();
+    m_size--;
+    return true;
+  }
+
+  template <typename F>
+  void forEach(F&& func) {
+    for (size_t i = 0; i < m_ctrl.size(); i++) {
+      if (m_ctrl[i].m_dist != 0) {
+        func(m_keys[i], m_vals[i]);
+      }
+    }
+  }
+};
+
+/**
+ * Bucket backed by an AVL tree - stays balanced whatever the insertion order
+ *
+ */
+template <typename K, typename V>
+class AvlBucket {
+  struct Node {
+    K m_key;
+    V m_val;
+    Node* m_left;
+    Node* m_right;
+    int m_height;
+
+    Node(const K& key, V&& val) : m_key(key), m_val(move(val)), m_left(nullptr), m_right(nullptr), m_height(1) {}
+  };
+
+  Node* m_root;
+  size_t m_size;
+
+  static int height(Node* node) {
+    return node ? node->m_height : 0;
+  }
+
+  static void update(Node* node) {
+    node->m_height = 1 + max(height(node->m_left), height(node->m_right));
+  }
+
+  static Node* rotateRight(Node* node) {
+    Node* left = node->m_left;
+    node->m_left = left->m_right;
+    left->m_right = node;
+    update(node);
+    update(left);
+    return left;
+  }
+
+  static Node* rotateLeft(Node* node) {
+    Node* right = node->m_right;
+    node->m_right = right->m_left;
+    right->m_left = node;
+    update(node);
+    update(right);
+    return right;
+  }
+
+  static Node* rebalance(Node* node) {
+    update(node);
+    int balance = height(node->m_left) - height(node->m_right);
+
+    if (balance > 1) {
+      if (height(node->m_left->m_left) < height(node->m_left->m_right)) {
+        node->m_left = rotateLeft(node->m_left);
+      }
+      return rotateRight(node);
+    }
+
+    if (balance < -1) {
+      if (height(node->m_right->m_right) < height(node->m_right->m_left)) {
+        node->m_right = rotateRight(node->m_right);
+      }
+      return rotateLeft(node);
+    }
+
+    return node;
+  }
+
+  static Node* insertAt(Node* node, const K& key, V&& val, bool& added) {
+    if (node == nullptr) {
+      added = true;
+      return new Node(key, move(val));
+    }
+
+    if (key < node->m_key) {
+      node->m_left = insertAt(node->m_left, key, move(val), added);
+    } else if (node->m_key < key) {
+      node->m_right = insertAt(node->m_right, key, move(val), added);
+    } else {
+      node->m_val = move(val);
+      return node;
+    }
+
+    return rebalance(node);
+  }
+
+  /**
+   * Detaches the smallest node of the subtree into smallest
+   *
+   */
+  static Node* removeSmallest(Node* node, Node*& smallest) {
+    if (node->m_left == nullptr) {
+      smallest = node;
+      return node->m_right;
+    }
+
+    node->m_left = removeSmallest(node->m_left, smallest);
+    return rebalance(node);
+  }
+
+  static Node* removeAt(Node* node, const K& key, bool& removed) {
+    if (node == nullptr) {
+      return nullptr;
+    }
+
+    if (key < node->m_key) {
+      node->m_left = removeAt(node->m_left, key, removed);
+    } else if (node->m_key < key) {
+      node->m_right = removeAt(node->m_right, key, removed);
+    } else {
+      removed = true;
+      Node* left = node->m_left;
+      Node* right = node->m_right;
+      delete node;
+
+      if (right == nullptr) {
+        return left;
+      }
+
+      // Splice the in order successor into the removed node's place
+      Node* successor;
+      right = removeSmallest(right, successor);
+      successor->m_left = left;
+      successor->m_right = right;
+      return rebalance(successor);
+    }
+
+    return rebalance(node);
+  }
+
+  template <typename F>
+  static void forEach(Node* node, F& func) {
+    if (node == nullptr) {
+      return;
+    }
+
+    forEach(node->m_left, func);
+    func(node->m_key, node->m_val);
+    forEach(node->m_right, func);
+  }
+
+  static void destroy(Node* node) {
+    if (node) {
+      destroy(node->m_left);
+      destroy(node->m_right);
+      delete node;
+    }
+  }
+
+public:
+  AvlBucket() : m_root(nullptr), m_size(0) {}
+
+  AvlBucket(const AvlBucket&) = delete;
+  AvlBucket& operator=(const AvlBucket&) = delete;
+
+  ~AvlBucket() {
+    destroy(m_root);
+  }
+
+  size_t size() const {
+    return m_size;
+  }
+
+  V* find(const K& key) {
+    Node* node = m_root;
+    while (node) {
+      if (key < node->m_key) {
+        node = node->m_left;
+      } else if (node->m_key < key) {
+        node = node->m_right;
+      } else {
+        return &node->m_val;
+      }
+    }
+
+    return nullptr;
+  }
+
+  bool insert(const K& key, V val) {
+    bool added = false;
+    m_root = insertAt(m_root, key, move(val), added);
+    m_size += added;
+    return added;
+  }
+
+  bool remove(const K& key) {
+    bool removed = false;
+    m_root = removeAt(m_root, key, removed);
+    m_size -= removed;
+    return removed;
+  }
+
+  template <typename F>
+  void forEach(F&& func) {
+    forEach(m_root, func);
+  }
+};
+
+/**
+ * Bucket that starts as a small sorted array inline in the bucket header, so the common
+ * 0-4 entry bucket is a single scan with no pointer chasing. Past INLINE_CAPACITY it
+ * converts to an AvlBucket, and converts back once it shrinks to UNTREEIFY_SIZE
+ *
+ */
+template <typename K, typename V>
+class HybridBucket {
+  static constexpr int INLINE_CAPACITY = 4;
+
+  /**
+   * Below the inline capacity so a bucket hovering at the threshold does not flip every put
+   *
+   */
+  static constexpr size_t UNTREEIFY_SIZE = 2;
+
+  int m_count;
+  K m_keys[INLINE_CAPACITY];
+  V m_vals[INLINE_CAPACITY];
+  unique_ptr<AvlBucket<K, V>> m_tree;
+
+  int position(const K& key) const {
+    int i = 0;
+    while (i < m_count && m_keys[i] < key) {
+      i++;
+    }
+
+    return i;
+  }
+
+  void treeify() {
+    m_tree.reset(new AvlBucket<K, V>());
+    for (int i = 0; i < m_count; i++) {
+      m_tree->insert(m_keys[i], move(m_vals[i]));
+      m_keys[i] = K();
+      m_vals[i] = V();
+    }
+    m_count = 0;
+  }
+
+  void untreeify() {
+    m_count = 0;
+    m_tree->forEach([&](const K& key, V& val) {
+      m_keys[m_count] = key;
+      m_vals[m_count] = move(val);
+      m_count++;
+    });
+    m_tree.reset();
+  }
+
+public:
+  HybridBucket() : m_count(0), m_keys(), m_vals() {}
+
+  V* find(const K& key) {
+    if (m_tree) {
+      return m_tree->find(key);
+    }
+
+    for (int i = 0; i < m_count; i++) {
+      if (m_keys[i] == key) {
+        return &m_vals[i];
+      }
+    }
+
+    return nullptr;
+  }
+
+  bool insert(const K& key, V val) {
+    if (m_tree) {
+      return m_tree->insert(key, move(val));
+    }
+
+    int pos = position(key);
+    if (pos < m_count && m_keys[pos] == key) {
+      m_vals[pos] = move(val);
+      return false;
+    }
+
+    if (m_count == INLINE_CAPACITY) {
+      treeify();
+      return m_tree->insert(key, move(val));
+    }
+
+    for (int i = m_count; i > pos; i--) {
+      m_keys[i] = move(m_keys[i - 1]);
+      m_vals[i] = move(m_vals[i - 1]);
+    }
+    m_keys[pos] = key;
+    m_vals[pos] = move(val);
+    m_count++;
+    return true;
+  }
+
+  bool remove(const K& key) {
+    if (m_tree) {
+      if (!m_tree->remove(key)) {
+        return false;
+      }
+
+      if (m_tree->size() <= UNTREEIFY_SIZE) {
+        untreeify();
+      }
+      return true;
+    }
+
+    int pos = position(key);
+    if (pos == m_count || !(m_keys[pos] == key)) {
+      return false;
+    }
+
+    for (int i = pos; i < m_count - 1; i++) {
+      m_keys[i] = move(m_keys[i + 1]);
+      m_vals[i] = move(m_vals[i + 1]);
+    }
+    m_count--;
+    // Release the vacated slot's value now rather than on the next overwrite
+    m_keys[m_count] = K();
+    m_vals[m_count] = V();
+    return true;
+  }
+
+  template <typename F>
+  void forEach(F&& func) {
+    if (m_tree) {
+      m_tree->forEach(func);
+      return;
+    }
+
+    for (int i = 0; i < m_count; i++) {
+      func(m_keys[i], m_vals[i]);
+    }
+  }
+};
+
+/**
+ * Bucket backed by a top-down splay tree - opt in for skewed per-bucket access
+ * A hit is only splayed to the root when it sits SPLAY_DEPTH or more levels down
+ * and was already hit within the last SPLAY_WINDOW deep hits, so shallow and
+ * one-off hits stay plain reads. Splaying restructures the tree, which the
+ * bucket lock already serialises. It still trails TreeBucket on benchZipf
+ * (Zipf 0.99) by about a tenth - the red-black tree is already shallow there and
+ * a splay tree is not balanced between splays - so prefer TreeBucket unless the
+ * hot keys of a bucket shift faster than that
+ *
+ */
+template <typename K, typename V>
+class SplayBucket {
+  struct Node {
+    K m_key;
+    V m_val;
+    Node* m_left;
+    Node* m_right;
+    uint32_t m_lastHit = 0x80000000u; // m_deepHits at its last deep hit
+
+    Node(const K& key, V&& val) : m_key(key), m_val(move(val)), m_left(nullptr), m_right(nullptr) {}
+  };
+
+  /**
+   * Hits shallower than this are left in place
+   *
+   */
+  static constexpr int SPLAY_DEPTH = 6;
+
+  /**
+   * A deep hit is splayed only if the same node had a deep hit this recently
+   *
+   */
+  static constexpr uint32_t SPLAY_WINDOW = 8;
+
+  Node* m_root;
+  uint32_t m_deepHits = 0;
+
+  /**
+   * Brings key, or the last node on its search path, to the root - amortised O(log n)
+   *
+   */
+  static Node* splay(Node* root, const K& key) {
+    if (root == nullptr) {
+      return nullptr;
+    }
+
+    // Nodes known to be smaller hang off leftHook, larger ones off rightHook
+    Node* leftTree = nullptr;
+    Node* rightTree = nullptr;
+    Node** leftHook = &leftTree;
+    Node** rightHook = &rightTree;
+
+    while (true) {
+      if (key < root->m_key) {
+        if (root->m_left == nullptr) {
+          break;
+        }
+
+        if (key < root->m_left->m_key) {
+          // Zig-zig - rotate right
+          Node* left = root->m_left;
+          root->m_left = left->m_right;
+          left->m_right = root;
+          root = left;
+          if (root->m_left == nullptr) {
+            break;
+          }
+        }
+
+        *rightHook = root;
+        rightHook = &root->m_left;
+        root = root->m_left;
+      } else if (root->m_key < key) {
+        if (root->m_right == nullptr) {
+          break;
+        }
+
+        if (root->m_right->m_key < key) {
+          // Zag-zag - rotate left
+          Node* right = root->m_right;
+          root->m_right = right->m_left;
+          right->m_left = root;
+          root = right;
+          if (root->m_right == nullptr) {
+            break;
+          }
+        }
+
+        *leftHook = root;
+        leftHook = &root->m_right;
+        root = root->m_right;
+      } else {
+        break;
+      }
+    }
+
+    *leftHook = root->m_left;
+    *rightHook = root->m_right;
+    root->m_left = leftTree;
+    root->m_right = rightTree;
+    return root;
+  }
+
+  /**
+   * In order walk with an explicit stack - splay trees can be deep between lookups
+   *
+   */
+  template <typename F>
+  static void forEach(Node* node, F& func) {
+    vector<Node*> stack;
+    while (node || !stack.empty()) {
+      while (node) {
+        stack.push_back(node);
+        node = node->m_left;
+      }
+
+      node = stack.back();
+      stack.pop_back();
+      func(node->m_key, node->m_val);
+      node = node->m_right;
+    }
+  }
+
+public:
+  SplayBucket() : m_root(nullptr) {}
+
+  SplayBucket(const SplayBucket&) = delete;
+  SplayBucket& operator=(const SplayBucket&) = delete;
+
+  ~SplayBucket() {
+    vector<Node*> stack;
+    if (m_root) {
+      stack.push_back(m_root);
+    }
+
+    while (!stack.empty()) {
+      Node* node = stack.back();
+      stack.pop_back();
+      if (node->m_left) {
+        stack.push_back(node->m_left);
+      }
+      if (node->m_right) {
+        stack.push_back(node->m_right);
+      }
+      delete node;
+    }
+  }
+
+  V* find(const K& key) {
+    Node* node = m_root;
+    int depth = 0;
+    while (node && !(node->m_key == key)) {
+      node = key < node->m_key ? node->m_left : node->m_right;
+      depth++;
+    }
+    if (node == nullptr || depth < SPLAY_DEPTH) {
+      return node ? &node->m_val : nullptr;
+    }
+
+    uint32_t hit = ++m_deepHits;
+    bool recent = hit - node->m_lastHit < SPLAY_WINDOW;
+    node->m_lastHit = hit;
+    if (!recent) {
+      return &node->m_val;
+    }
+
+    m_root = splay(m_root, key);
+    return &m_root->m_val;
+  }
+
+  bool insert(const K& key, V val) {
+    m_root = splay(m_root, key);
+    if (m_root && m_root->m_key == key) {
+      m_root->m_val = move(val);
+      return false;
+    }
+
+    // The old root becomes a child of the new node
+    Node* node = new Node(key, move(val));
+    if (m_root && key < m_root->m_key) {
+      node->m_left = m_root->m_left;
+      node->m_right = m_root;
+      m_root->m_left = nullptr;
+    } else if (m_root) {
+      node->m_right = m_root->m_right;
+      node->m_left = m_root;
+      m_root->m_right = nullptr;
+    }
+
+    m_root = node;
+    return true;
+  }
+
+  bool remove(const K& key) {
+    m_root = splay(m_root, key);
+    if (m_root == nullptr || !(m_root->m_key == key)) {
+      return false;
+    }
+
+    Node* removed = m_root;
+    if (removed->m_left == nullptr) {
+      m_root = removed->m_right;
+    } else {
+      // Splaying the left subtree for key brings its largest node up with no right child
+      m_root = splay(removed->m_left, key);
+      m_root->m_right = removed->m_right;
+    }
+
+    delete removed;
+    return true;
+  }
+
+  template <typename F>
+  void forEach(F&& func) {
+    forEach(m_root, func);
+  }
+};
+
+/**
+ * Bucket for read-mostly caches - entries are frozen into an Eytzinger (BFS) ordered
+ * array searched without branches or pointer chasing. New keys go to a small sorted
+ * delta, removed frozen keys are marked dead, and both are merged back into a fresh
+ * frozen array once they pass DELTA_MIN or an eighth of the frozen size
+ *
+ */
+template <typename K, typename V>
+class FrozenBucket {
+  static constexpr size_t DELTA_MIN = 8;
+
+  // Eytzinger layout, index 0 unused, children of i at 2i and 2i + 1
+  vector<K> m_keys;
+  vector<V> m_vals;
+  vector<char> m_dead;
+  size_t m_deadCount;
+
+  // Sorted by key
+  vector<pair<K, V>> m_delta;
+
+  size_t frozenSize() const {
+    return m_keys.empty() ? 0 : m_keys.size() - 1;
+  }
+
+  /**
+   * Branchless descent - O(log n), prefetching the grandchildren four levels down
+   * Returns the Eytzinger index of key, or 0
+   *
+   */
+  size_t search(const K& key) const {
+    size_t n = frozenSize();
+    const K* keys = m_keys.data();
+    size_t i = 1;
+    while (i <= n) {
+      __builtin_prefetch(keys + 16 * i);
+      i = 2 * i + (keys[i] < key);
+    }
+
+    // Undo the trailing right turns plus one to land on the lower bound
+    i >>= __builtin_ffsll(~i);
+    return (i != 0 && keys[i] == key) ? i : 0;
+  }
+
+  typename vector<pair<K, V>>::iterator deltaPosition(const K& key) {
+    return lower_bound(m_delta.begin(), m_delta.end(), key, [](const pair<K, V>& entry, const K& k) {
+      return entry.first < k;
+    });
+  }
+
+  static size_t layout(vector<pair<K, V>>& sorted, vector<K>& keys, vector<V>& vals, size_t next, size_t i) {
+    if (i < keys.size()) {
+      next = layout(sorted, keys, vals, next, 2 * i);
+      keys[i] = move(sorted[next].first);
+      vals[i] = move(sorted[next].second);
+      next = layout(sorted, keys, vals, next + 1, 2 * i + 1);
+    }
+
+    return next;
+  }
+
+  /**
+   * Rebuilds the frozen array from the live frozen entries and the delta - O(n log n)
+   *
+   */
+  void merge() {
+    vector<pair<K, V>> sorted;
+    sorted.reserve(frozenSize() - m_deadCount + m_delta.size());
+    for (size_t i = 1; i <= frozenSize(); i++) {
+      if (!m_dead[i]) {
+        sorted.emplace_back(move(m_keys[i]), move(m_vals[i]));
+      }
+    }
+    for (auto& entry : m_delta) {
+      sorted.push_back(move(entry));
+    }
+    sort(sorted.begin(), sorted.end(), [](const pair<K, V>& left, const pair<K, V>& right) {
+      return left.first < right.first;
+    });
+
+    vector<K> keys(sorted.empty() ? 0 : sorted.size() + 1);
+    vector<V> vals(keys.size());
+    layout(sorted, keys, vals, 0, 1);
+
+    m_keys.swap(keys);
+    m_vals.swap(vals);
+    m_dead.assign(m_keys.size(), 0);
+    m_deadCount = 0;
+    m_delta.clear();
+  }
+
+  void mergeIfNeeded() {
+    if (m_delta.size() + m_deadCount > max(DELTA_MIN, frozenSize() / 8)) {
+      merge();
+    }
+  }
+
+public:
+  FrozenBucket() : m_deadCount(0) {}
+
+  V* find(const K& key) {
+    size_t i = search(key);
+    if (i != 0) {
+      return m_dead[i] ? nullptr : &m_vals[i];
+    }
+
+    auto it = deltaPosition(key);
+    return (it != m_delta.end() && it->first == key) ? &it->second : nullptr;
+  }
+
+  bool insert(const K& key, V val) {
+    size_t i = search(key);
+    if (i != 0) {
+      // Updates and revivals stay in place
+      bool revived = m_dead[i];
+      m_vals[i] = move(val);
+      m_dead[i] = 0;
+      m_deadCount -= revived;
+      return revived;
+    }
+
+    auto it = deltaPosition(key);
+    if (it != m_delta.end() && it->first == key) {
+      it->second = move(val);
+      return false;
+    }
+
+    m_delta.insert(it, pair<K, V>(key, move(val)));
+    mergeIfNeeded();
+    return true;
+  }
+
+  bool remove(const K& key) {
+    size_t i = search(key);
+    if (i != 0) {
+      if (m_dead[i]) {
+        return false;
+      }
+
+      m_dead[i] = 1;
+      m_deadCount++;
+      // Release the value now, the slot itself goes at the next merge
+      m_vals[i] = V();
+      mergeIfNeeded();
+      return true;
+    }
+
+    auto it = deltaPosition(key);
+    if (it == m_delta.end() || !(it->first == key)) {
+      return false;
+    }
+
+    m_delta.erase(it);
+    return true;
+  }
+
+  template <typename F>
+  void forEach(F&& func) {
+    for (size_t i = 1; i <= frozenSize(); i++) {
+      if (!m_dead[i]) {
+        func(m_keys[i], m_vals[i]);
+      }
+    }
+
+    for (auto& entry : m_delta) {
+      func(entry.first, entry.second);
+    }
+  }
+};
+
+/**
+ * Order preserving byte encoding of keys for ArtBucket
+ * Encodings must be prefix free - no key's bytes may be a prefix of another key's
+ *
+ */
+template <typename K, typename Enable = void>
+struct ArtKey;
+
+template <typename K>
+struct ArtKey<K, typename enable_if<is_integral<K>::value>::type> {
+  static void encode(const K& key, string& out) {
+    typedef typename make_unsigned<K>::type U;
+    U bits = (U) key;
+    // Flip the sign bit so negative values sort first
+    if (is_signed<K>::value) {
+      bits ^= (U) 1 << (sizeof(K) * 8 - 1);
+    }
+    for (int shift = (sizeof(K) - 1) * 8; shift >= 0; shift -= 8) {
+      out.push_back((char) (bits >> shift));
+    }
+  }
+};
+
+/**
+ * Strings escape each 0 byte as 0 0xff and end with 0 0 - the terminator cannot appear
+ * inside an encoding, and a shorter string still sorts before its extensions
+ *
+ */
+template <>
+struct ArtKey<string> {
+  static void encode(const string& key, string& out) {
+    size_t start = 0;
+    for (size_t zero = key.find('\0'); zero != string::npos; zero = key.find('\0', start)) {
+      out.append(key, start, zero - start);
+      out.push_back('\0');
+      out.push_back('\xff');
+      start = zero + 1;
+    }
+    out.append(key, start, string::npos);
+    out.push_back('\0');
+    out.push_back('\0');
+  }
+};
+
+template <typename A, typename B>
+struct ArtKey<pair<A, B>> {
+  static void encode(const pair<A, B>& key, string& out) {
+    ArtKey<A>::encode(key.first, out);
+    ArtKey<B>::encode(key.second, out);
+  }
+};
+
+/**
+ * Bucket backed by an Adaptive Radix Tree
+ * Inner nodes grow and shrink between 4/16/48/256 child layouts, single child paths are
+ * compressed into a node prefix, and entries are visited in key order without hashing
+ *
+ */
+template <typename K, typename V>
+class ArtBucket {
+  /**
+   * Prefix bytes stored inline - longer prefixes are recovered from a leaf below the node
+   *
+   */
+  static constexpr size_t MAX_PREFIX = 8;
+
+  enum NodeType : uint8_t { LEAF, NODE4, NODE16, NODE48, NODE256 };
+
+  struct Node {
+    NodeType m_type;
+
+    Node(NodeType type) : m_type(type) {}
+  };
+
+  struct Leaf : Node {
+    string m_bytes;
+    K m_key;
+    V m_val;
+
+    Leaf(const string& bytes, const K& key, V&& val) : Node(LEAF), m_bytes(bytes), m_key(key), m_val(move(val)) {}
+  };
+
+  struct Inner : Node {
+    uint16_t m_count;
+    uint32_t m_prefixLen;
+    uint8_t m_prefix[MAX_PREFIX];
+
+    Inner(NodeType type) : Node(type), m_count(0), m_prefixLen(0) {}
+  };
+
+  struct Node4 : Inner {
+    uint8_t m_keys[4];
+    Node* m_children[4];
+
+    Node4() : Inner(NODE4) {}
+  };
+
+  struct Node16 : Inner {
+    uint8_t m_keys[16];
+    Node* m_children[16];
+
+    Node16() : Inner(NODE16) {}
+  };
+
+  struct Node48 : Inner {
+    // Child slot plus one for each key byte, 0 when absent
+    uint8_t m_index[256];
+    Node* m_children[48];
+
+    Node48() : Inner(NODE48) {
+      memset(m_index, 0, sizeof(m_index));
+      memset(m_children, 0, sizeof(m_children));
+    }
+  };
+
+  struct Node256 : Inner {
+    Node* m_children[256];
+
+    Node256() : Inner(NODE256) {
+      memset(m_children, 0, sizeof(m_children));
+    }
+  };
+
+  Node* m_root;
+
+  static Node** findChild(Inner* node, uint8_t c) {
+    switch (node->m_type) {
+      case NODE4: {
+        Node4* n = (Node4*) node;
+        for (int i = 0; i < n->m_count; i++) {
+          if (n->m_keys[i] == c) {
+            return &n->m_children[i];
+          }
+        }
+        return nullptr;
+      }
+      case NODE16: {
+        Node16* n = (Node16*) node;
+#ifdef __SSE2__
+        // Compare all 16 key bytes at once
+        __m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char) c), _mm_loadu_si128((__m128i*) n->m_keys));
+        int mask = _mm_movemask_epi8(cmp) & ((1 << n->m_count) - 1);
+        return mask ? &n->m_children[__builtin_ctz(mask)] : nullptr;
+#else
+        for (int i = 0; i < n->m_count; i++) {
+          if (n->m_keys[i] == c) {
+            return &n->m_children[i];
+          }
+        }
+        return nullptr;
+#endif
+      }
+      case NODE48: {
+        Node48* n = (Node48*) node;
+        return n->m_index[c] ? &n->m_children[n->m_index[c] - 1] : nullptr;
+      }
+      default: {
+        Node256* n = (Node256*) node;
+        return n->m_children[c] ? &n->m_children[c] : nullptr;
+      }
+    }
+  }
+
+  /**
+   * Visits children in key byte order until func returns false
+   *
+   */
+  template <typename F>
+  static bool forEachChild(Inner* node, F&& func) {
+    switch (node->m_type) {
+      case NODE4: {
+        Node4* n = (Node4*) node;
+        for (int i = 0; i < n->m_count; i++) {
+          if (!func(n->m_keys[i], n->m_children[i])) {
+            return false;
+          }
+        }
+        return true;
+      }
+      case NODE16: {
+        Node16* n = (Node16*) node;
+        for (int i = 0; i < n->m_count; i++) {
+          if (!func(n->m_keys[i], n->m_children[i])) {
+            return false;
+          }
+        }
+        return true;
+      }
+      case NODE48: {
+        Node48* n = (Node48*) node;
+        for (int c = 0; c < 256; c++) {
+          if (n->m_index[c] && !func((uint8_t) c, n->m_children[n->m_index[c] - 1])) {
+            return false;
+          }
+        }
+        return true;
+      }
+      default: {
+        Node256* n = (Node256*) node;
+        for (int c = 0; c < 256; c++) {
+          if (n->m_children[c] && !func((uint8_t) c, n->m_children[c])) {
+            return false;
+          }
+        }
+        return true;
+      }
+    }
+  }
+
+  static Leaf* minimum(Node* node) {
+    while (node->m_type != LEAF) {
+      Node* first = nullptr;
+      forEachChild((Inner*) node, [&](uint8_t, Node* child) {
+        first = child;
+        return false;
+      });
+      node = first;
+    }
+
+    return (Leaf*) node;
+  }
+
+  /**
+   * Matching bytes against the inline part of the prefix only - leaves verify the rest
+   *
+   */
+  static size_t checkPrefix(const Inner* node, const string& bytes, size_t depth) {
+    size_t maxCmp = min(min((size_t) node->m_prefixLen, MAX_PREFIX), bytes.size() - depth);
+    size_t i = 0;
+    while (i < maxCmp && node->m_prefix[i] == (uint8_t) bytes[depth + i]) {
+      i++;
+    }
+
+    return i;
+  }
+
+  /**
+   * Matching bytes against the full prefix
+   *
+   */
+  static size_t prefixMismatch(Inner* node, const string& bytes, size_t depth) {
+    size_t i = checkPrefix(node, bytes, depth);
+    if (i < MAX_PREFIX || node->m_prefixLen <= MAX_PREFIX) {
+      return i;
+    }
+
+    Leaf* leaf = minimum(node);
+    size_t maxCmp = min((size_t) node->m_prefixLen, min(leaf->m_bytes.size(), bytes.size()) - depth);
+    while (i < maxCmp && leaf->m_bytes[depth + i] == bytes[depth + i]) {
+      i++;
+    }
+
+    return i;
+  }
+
+  static void copyHeader(Inner* to, const Inner* from) {
+    to->m_count = from->m_count;
+    to->m_prefixLen = from->m_prefixLen;
+    memcpy(to->m_prefix, from->m_prefix, MAX_PREFIX);
+  }
+
+  /**
+   * Sorted insert into a Node4 or Node16 with room left
+   *
+   */
+  template <typename N>
+  static void addSorted(N* n, uint8_t c, Node* child) {
+    int pos = 0;
+    while (pos < n->m_count && n->m_keys[pos] < c) {
+      pos++;
+    }
+
+    memmove(n->m_keys + pos + 1, n->m_keys + pos, n->m_count - pos);
+    memmove(n->m_children + pos + 1, n->m_children + pos, (n->m_count - pos) * sizeof(Node*));
+    n->m_keys[pos] = c;
+    n->m_children[pos] = child;
+    n->m_count++;
+  }
+
+  static void add48(Node48* n, uint8_t c, Node* child) {
+    int pos = 0;
+    while (n->m_children[pos]) {
+      pos++;
+    }
+
+    n->m_children[pos] = child;
+    n->m_index[c] = pos + 1;
+    n->m_count++;
+  }
+
+  static void add256(Node256* n, uint8_t c, Node* child) {
+    n->m_children[c] = child;
+    n->m_count++;
+  }
+
+  /**
+   * Adds a child under byte c, growing the node into the next layout when full
+   *
+   */
+  static void addChild(Node** ref, Inner* node, uint8_t c, Node* child) {
+    switch (node->m_type) {
+      case NODE4: {
+        Node4* n = (Node4*) node;
+        if (n->m_count < 4) {
+          addSorted(n, c, child);
+          return;
+        }
+
+        Node16* grown = new Node16();
+        copyHeader(grown, n);
+        memcpy(grown->m_keys, n->m_keys, 4);
+        memcpy(grown->m_children, n->m_children, 4 * sizeof(Node*));
+        addSorted(grown, c, child);
+        *ref = grown;
+        delete n;
+        return;
+      }
+      case NODE16: {
+        Node16* n = (Node16*) node;
+        if (n->m_count < 16) {
+          addSorted(n, c, child);
+          return;
+        }
+
+        Node48* grown = new Node48();
+        copyHeader(grown, n);
+        for (int i = 0; i < 16; i++) {
+          grown->m_index[n->m_keys[i]] = i + 1;
+          grown->m_children[i] = n->m_children[i];
+        }
+        add48(grown, c, child);
+        *ref = grown;
+        delete n;
+        return;
+      }
+      case NODE48: {
+        Node48* n = (Node48*) node;
+        if (n->m_count < 48) {
+          add48(n, c, child);
+          return;
+        }
+
+        Node256* grown = new Node256();
+        copyHeader(grown, n);
+        for (int i = 0; i < 256; i++) {
+          if (n->m_index[i]) {
+            grown->m_children[i] = n->m_children[n->m_index[i] - 1];
+          }
+        }
+        add256(grown, c, child);
+        *ref = grown;
+        delete n;
+        return;
+      }
+      default:
+        add256((Node256*) node, c, child);
+        return;
+    }
+  }
+
+  /**
+   * Removes the child under byte c, shrinking the node into the previous layout when sparse
+   *
+   */
+  static void removeChild(Node** ref, Inner* node, uint8_t c, Node** slot) {
+    switch (node->m_type) {
+      case NODE4: {
+        Node4* n = (Node4*) node;
+        int pos = slot - n->m_children;
+        memmove(n->m_keys + pos, n->m_keys + pos + 1, n->m_count - pos - 1);
+        memmove(n->m_children + pos, n->m_children + pos + 1, (n->m_count - pos - 1) * sizeof(Node*));
+        n->m_count--;
+        if (n->m_count > 1) {
+          return;
+        }
+
+        // Collapse the single child path into the child's prefix
+        Node* only = n->m_children[0];
+        if (only->m_type != LEAF) {
+          Inner* child = (Inner*) only;
+          uint8_t prefix[MAX_PREFIX];
+          size_t len = min((size_t) n->m_prefixLen, MAX_PREFIX);
+          memcpy(prefix, n->m_prefix, len);
+          if (len < MAX_PREFIX) {
+            prefix[len++] = n->m_keys[0];
+          }
+          if (len < MAX_PREFIX) {
+            size_t childLen = min((size_t) child->m_prefixLen, MAX_PREFIX - len);
+            memcpy(prefix + len, child->m_prefix, childLen);
+            len += childLen;
+          }
+          memcpy(child->m_prefix, prefix, len);
+          child->m_prefixLen += n->m_prefixLen + 1;
+        }
+        *ref = only;
+        delete n;
+        return;
+      }
+      case NODE16: {
+        Node16* n = (Node16*) node;
+        int pos = slot - n->m_children;
+        memmove(n->m_keys + pos, n->m_keys + pos + 1, n->m_count - pos - 1);
+        memmove(n->m_children + pos, n->m_children + pos + 1, (n->m_count - pos - 1) * sizeof(Node*));
+        n->m_count--;
+        if (n->m_count > 3) {
+          return;
+        }
+
+        Node4* shrunk = new Node4();
+        copyHeader(shrunk, n);
+        memcpy(shrunk->m_keys, n->m_keys, n->m_count);
+        memcpy(shrunk->m_children, n->m_children, n->m_count * sizeof(Node*));
+        *ref = shrunk;
+        delete n;
+        return;
+      }
+      case NODE48: {
+        Node48* n = (Node48*) node;
+        n->m_children[n->m_index[c] - 1] = nullptr;
+        n->m_index[c] = 0;
+        n->m_count--;
+        if (n->m_count > 12) {
+          return;
+        }
+
+        Node16* shrunk = new Node16();
+        copyHeader(shrunk, n);
+        int pos = 0;
+        for (int i = 0; i < 256; i++) {
+          if (n->m_index[i]) {
+            shrunk->m_keys[pos] = i;
+            shrunk->m_children[pos++] = n->m_children[n->m_index[i] - 1];
+          }
+        }
+        *ref = shrunk;
+        delete n;
+        return;
+      }
+      default: {
+        Node256* n = (Node256*) node;
+        n->m_children[c] = nullptr;
+        n->m_count--;
+        if (n->m_count > 37) {
+          return;
+        }
+
+        Node48* shrunk = new Node48();
+        copyHeader(shrunk, n);
+        int pos = 0;
+        for (int i = 0; i < 256; i++) {
+          if (n->m_children[i]) {
+            shrunk->m_index[i] = pos + 1;
+            shrunk->m_children[pos++] = n->m_children[i];
+          }
+        }
+        *ref = shrunk;
+        delete n;
+        return;
+      }
+    }
+  }
+
+  /**
+   * Fills a freshly split Node4 with its two diverging children
+   *
+   */
+  static void setSplitChildren(Node4* split, uint8_t c1, Node* n1, uint8_t c2, Node* n2) {
+    if (c1 > c2) {
+      swap(c1, c2);
+      swap(n1, n2);
+    }
+
+    split->m_keys[0] = c1;
+    split->m_children[0] = n1;
+    split->m_keys[1] = c2;
+    split->m_children[1] = n2;
+    split->m_count = 2;
+  }
+
+  static bool insertAt(Node** ref, const string& bytes, const K& key, V&& val, size_t depth) {
+    Node* node = *ref;
+    if (node == nullptr) {
+      *ref = new Leaf(bytes, key, move(val));
+      return true;
+    }
+
+    if (node->m_type == LEAF) {
+      Leaf* leaf = (Leaf*) node;
+      if (leaf->m_key == key) {
+        leaf->m_val = move(val);
+        return false;
+      }
+
+      // Split the leaf into a Node4 holding the common prefix
+      size_t end = depth;
+      while (leaf->m_bytes[end] == bytes[end]) {
+        end++;
+      }
+
+      Node4* split = new Node4();
+      split->m_prefixLen = end - depth;
+      memcpy(split->m_prefix, bytes.data() + depth, min((size_t) split->m_prefixLen, MAX_PREFIX));
+      setSplitChildren(split, leaf->m_bytes[end], leaf, bytes[end], new Leaf(bytes, key, move(val)));
+      *ref = split;
+      return true;
+    }
+
+    Inner* inner = (Inner*) node;
+    if (inner->m_prefixLen) {
+      size_t mismatch = prefixMismatch(inner, bytes, depth);
+      if (mismatch < inner->m_prefixLen) {
+        // Split the prefix at the first differing byte
+        Node4* split = new Node4();
+        split->m_prefixLen = mismatch;
+        memcpy(split->m_prefix, inner->m_prefix, min(mismatch, MAX_PREFIX));
+
+        uint8_t existing;
+        if (inner->m_prefixLen <= MAX_PREFIX) {
+          existing = inner->m_prefix[mismatch];
+          inner->m_prefixLen -= mismatch + 1;
+          memmove(inner->m_prefix, inner->m_prefix + mismatch + 1, min((size_t) inner->m_prefixLen, MAX_PREFIX));
+        } else {
+          Leaf* leaf = minimum(inner);
+          existing = leaf->m_bytes[depth + mismatch];
+          inner->m_prefixLen -= mismatch + 1;
+          memcpy(inner->m_prefix, leaf->m_bytes.data() + depth + mismatch + 1, min((size_t) inner->m_prefixLen, MAX_PREFIX));
+        }
+
+        setSplitChildren(split, existing, inner, bytes[depth + mismatch], new Leaf(bytes, key, move(val)));
+        *ref = split;
+        return true;
+      }
+
+      depth += inner->m_prefixLen;
+    }
+
+    Node** child = findChild(inner, bytes[depth]);
+    if (child) {
+      return insertAt(child, bytes, key, move(val), depth + 1);
+    }
+
+    addChild(ref, inner, bytes[depth], new Leaf(bytes, key, move(val)));
+    return true;
+  }
+
+  static bool removeAt(Node** ref, const string& bytes, const K& key, size_t depth) {
+    Node* node = *ref;
+    if (node == nullptr) {
+      return false;
+    }
+
+    if (node->m_type == LEAF) {
+      // Only reached for a leaf at the root
+      if (!(((Leaf*) node)->m_key == key)) {
+        return false;
+      }
+
+      delete (Leaf*) node;
+      *ref = nullptr;
+      return true;
+    }
+
+    Inner* inner = (Inner*) node;
+    if (inner->m_prefixLen) {
+      if (checkPrefix(inner, bytes, depth) != min((size_t) inner->m_prefixLen, MAX_PREFIX)) {
+        return false;
+      }
+
+      depth += inner->m_prefixLen;
+    }
+
+    if (depth >= bytes.size()) {
+      return false;
+    }
+
+    Node** child = findChild(inner, bytes[depth]);
+    if (child == nullptr) {
+      return false;
+    }
+
+    if ((*child)->m_type != LEAF) {
+      return removeAt(child, bytes, key, depth + 1);
+    }
+
+    Leaf* leaf = (Leaf*) *child;
+    if (!(leaf->m_key == key)) {
+      return false;
+    }
+
+    removeChild(ref, inner, bytes[depth], child);
+    delete leaf;
+    return true;
+  }
+
+  /**
+   * In-order traversal from the lower bound, stops once a key past the upper bound is seen
+   *
+   */
+  template <typename F>
+  static bool scan(Node* node, size_t depth, const string& from, bool bounded, const string& to, F& func) {
+    if (node->m_type == LEAF) {
+      Leaf* leaf = (Leaf*) node;
+      if (bounded && leaf->m_bytes < from) {
+        return true;
+      }
+
+      if (leaf->m_bytes > to) {
+        return false;
+      }
+
+      func(leaf->m_key, leaf->m_val);
+      return true;
+    }
+
+    Inner* inner = (Inner*) node;
+    if (bounded && inner->m_prefixLen) {
+      const uint8_t* prefix = inner->m_prefix;
+      if (inner->m_prefixLen > MAX_PREFIX) {
+        prefix = (const uint8_t*) minimum(inner)->m_bytes.data() + depth;
+      }
+
+      for (size_t i = 0; i < inner->m_prefixLen; i++) {
+        // An exhausted bound sorts before everything below this node
+        if (depth + i >= from.size() || prefix[i] > (uint8_t) from[depth + i]) {
+          bounded = false;
+          break;
+        }
+
+        if (prefix[i] < (uint8_t) from[depth + i]) {
+          return true;
+        }
+      }
+    }
+
+    depth += inner->m_prefixLen;
+    return forEachChild(inner, [&](uint8_t c, Node* child) {
+      bool childBounded = bounded;
+      if (bounded && depth < from.size()) {
+        if (c < (uint8_t) from[depth]) {
+          return true;
+        }
+        childBounded = (c == (uint8_t) from[depth]);
+      }
+
+      return scan(child, depth + 1, from, childBounded, to, func);
+    });
+  }
+
+  static void destroy(Node* node) {
+    if (node->m_type == LEAF) {
+      delete (Leaf*) node;
+      return;
+    }
+
+    forEachChild((Inner*) node, [](uint8_t, Node* child) {
+      destroy(child);
+      return true;
+    });
+
+    switch (node->m_type) {
+      case NODE4: delete (Node4*) node; break;
+      case NODE16: delete (Node16*) node; break;
+      case NODE48: delete (Node48*) node; break;
+      default: delete (Node256*) node; break;
+    }
+  }
+
+public:
+  ArtBucket() : m_root(nullptr) {}
+
+  ArtBucket(const ArtBucket&) = delete;
+  ArtBucket& operator=(const ArtBucket&) = delete;
+
+  ~ArtBucket() {
+    if (m_root) {
+      destroy(m_root);
+    }
+  }
+
+  V* find(const K& key) {
+    string bytes;
+    ArtKey<K>::encode(key, bytes);
+
+    Node* node = m_root;
+    size_t depth = 0;
+    while (node) {
+      if (node->m_type == LEAF) {
+        Leaf* leaf = (Leaf*) node;
+        return leaf->m_key == key ? &leaf->m_val : nullptr;
+      }
+
+      Inner* inner = (Inner*) node;
+      if (inner->m_prefixLen) {
+        if (checkPrefix(inner, bytes, depth) != min((size_t) inner->m_prefixLen, MAX_PREFIX)) {
+          return nullptr;
+        }
+        depth += inner->m_prefixLen;
+      }
+
+      if (depth >= bytes.size()) {
+        return nullptr;
+      }
+
+      Node** child = findChild(inner, bytes[depth++]);
+      node = child ? *child : nullptr;
+    }
+
+    return nullptr;
+  }
+
+  bool insert(const K& key, V val) {
+    string bytes;
+    ArtKey<K>::encode(key, bytes);
+    return insertAt(&m_root, bytes, key, move(val), 0);
+  }
+
+  bool remove(const K& key) {
+    string bytes;
+    ArtKey<K>::encode(key, bytes);
+    return removeAt(&m_root, bytes, key, 0);
+  }
+
+  template <typename F>
+  void forEach(F&& func) {
+    if (m_root) {
+      forEachNode(m_root, func);
+    }
+  }
+
+  /**
+   * Visits entries with from <= key <= to in key order - O(log n + matches)
+   *
+   */
+  template <typename F>
+  void forEachInRange(const K& from, const K& to, F&& func) {
+    if (m_root == nullptr) {
+      return;
+    }
+
+    string fromBytes;
+    string toBytes;
+    ArtKey<K>::encode(from, fromBytes);
+    ArtKey<K>::encode(to, toBytes);
+    scan(m_root, 0, fromBytes, true, toBytes, func);
+  }
+
+private:
+  template <typename F>
+  static void forEachNode(Node* node, F& func) {
+    if (node->m_type == LEAF) {
+      Leaf* leaf = (Leaf*) node;
+      func(leaf->m_key, leaf->m_val);
+      return;
+    }
+
+    forEachChild((Inner*) node, [&](uint8_t, Node* child) {
+      forEachNode(child, func);
+      return true;
+    });
+  }
+};
+
+/**
+ * Eviction policy - evicts the entry with the oldest put timestamp
+ *
+ */
+struct TimestampLRU {
+  typedef long Meta;
+
+  template <typename K>
+  Meta onInsert(const K&) {
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+  }
+
+  void onUpdate(Meta& meta) {
+    meta = duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+  }
+
+  void onAccess(Meta&) {}
+
+  void onRemove(Meta&) {}
+
+  /**
+   * Put or promoted at least age ago
+   *
+   */
+  bool isCold(Meta& meta, milliseconds age) {
+    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count() - meta >= age.count();
+  }
+
+  /**
+   * Search each bucket for oldest - O(n)
+   * visitBucket(i, func) calls func(key, meta) for every entry of bucket i under its lock
+   *
+   */
+  template <typename K, typename Visit>
+  bool selectVictim(long numBuckets, Visit&& visitBucket, K& victim) {
+    bool found = false;
+    long oldestTime = 0;
+
+    for (long i = 0; i < numBuckets; i++) {
+      visitBucket(i, [&](const K& key, Meta& meta) {
+        // Keep the older of the two
+        if (!found || meta < oldestTime) {
+          found = true;
+          victim = key;
+          oldestTime = meta;
+        }
+      });
+    }
+
+    return found;
+  }
+};
+
+/**
+ * Eviction policy - CLOCK second chance over the buckets
+ * Lookups only set a reference bit, which suits read-mostly caches
+ *
+ */
+class ClockEviction {
+  /**
+   * Next bucket to sweep - a racy hand only means two evictors may sweep the same bucket
+   *
+   */
+  atomic<long> m_hand;
+
+public:
+  typedef bool Meta;
+
+  ClockEviction() : m_hand(0) {}
+
+  template <typename K>
+  Meta onInsert(const K&) {
+    return false;
+  }
+
+  void onUpdate(Meta& meta) {
+    meta = true;
+  }
+
+  void onAccess(Meta& meta) {
+    // Avoid dirtying the line when the bit is already set
+    if (!meta) {
+      meta = true;
+    }
+  }
+
+  void onRemove(Meta&) {}
+
+  /**
+   * Not looked up since the previous call - clears the bit like the hand does, so age is
+   * the interval between calls
+   *
+   */
+  bool isCold(Meta& meta, milliseconds) {
+    if (meta) {
+      meta = false;
+      return false;
+    }
+    return true;
+  }
+
+  /**
+   * Sweep from the hand clearing reference bits until an unreferenced entry is found
+   * At most two passes - the first pass clears every bit it does not stop at
+   *
+   */
+  template <typename K, typename Visit>
+  bool selectVictim(long numBuckets, Visit&& visitBucket, K& victim) {
+    bool found = false;
+
+    for (long swept = 0; swept < 2 * numBuckets && !found; swept++) {
+      long hand = m_hand.load(memory_order_relaxed);
+      m_hand.store((hand + 1) % numBuckets, memory_order_relaxed);
+
+      visitBucket(hand, [&](const K& key, Meta& meta) {
+        if (found) {
+          return;
+        }
+
+        if (meta) {
+          meta = false;
+        } else {
+          found = true;
+          victim = key;
+        }
+      });
+    }
+
+    return found;
+  }
+};
+
+/**
+ * Whether the running CPU has AVX2 / AVX-512F - the binary itself is built for the baseline ISA
+ *
+ */
+static inline bool cpuHasAvx2() {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool avx2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+  return avx2;
+#else
+  return false;
+#endif
+}
+
+static inline bool cpuHasAvx512() {
+#if defined(__x86_64__) || defined(__i386__)
+  static const bool avx512 = (__builtin_cpu_init(), __builtin_cpu_supports("avx512f"));
+  return avx512;
+#else
+  return false;
+#endif
+}
+
+/**
+ * Bit i of masks[i / 32] set when freq[i] is zero
+ * n must be a multiple of 32
+ *
+ */
+static void unprotectedMasksScalar(const uint8_t* freq, uint32_t n, uint32_t* masks) {
+  for (uint32_t b = 0; b < n; b += 32) {
+    uint32_t mask = 0;
+    for (uint32_t i = 0; i < 32; i++) {
+      mask |= (uint32_t) (freq[b + i] == 0) << i;
+    }
+    masks[b / 32] = mask;
+  }
+}
+
+static uint8_t minFrequencyScalar(const uint8_t* freq, uint32_t n) {
+  uint8_t least = UINT8_MAX;
+  for (uint32_t i = 0; i < n; i++) {
+    least = min(least, freq[i]);
+  }
+  return least;
+}
+
+/**
+ * Shift every frequency right so protection decays - UINT8_MAX marks a free slot and stays
+ *
+ */
+static void ageFrequenciesScalar(uint8_t* freq, uint32_t n, int shift) {
+  for (uint32_t i = 0; i < n; i++) {
+    if (freq[i] != UINT8_MAX) {
+      freq[i] >>= shift;
+    }
+  }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static void unprotectedMasksAvx2(const uint8_t* freq, uint32_t n, uint32_t* masks) {
+  const __m256i zero = _mm256_setzero_si256();
+  for (uint32_t i = 0; i < n; i += 32) {
+    __m256i unprotected = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) (freq + i)), zero);
+    masks[i / 32] = _mm256_movemask_epi8(unprotected);
+  }
+}
+
+__attribute__((target("avx2"))) static uint8_t minFrequencyAvx2(const uint8_t* freq, uint32_t n) {
+  __m256i least = _mm256_set1_epi8(-1);
+  for (uint32_t i = 0; i < n; i += 32) {
+    least = _mm256_min_epu8(least, _mm256_loadu_si256((const __m256i*) (freq + i)));
+  }
+
+  __m128i lanes = _mm_min_epu8(_mm256_castsi256_si128(least), _mm256_extracti128_si256(least, 1));
+  lanes = _mm_min_epu8(lanes, _mm_srli_si128(lanes, 8));
+  lanes = _mm_min_epu8(lanes, _mm_srli_si128(lanes, 4));
+  lanes = _mm_min_epu8(lanes, _mm_srli_si128(lanes, 2));
+  lanes = _mm_min_epu8(lanes, _mm_srli_si128(lanes, 1));
+  return (uint8_t) _mm_cvtsi128_si32(lanes);
+}
+
+__attribute__((target("avx2"))) static void ageFrequenciesAvx2(uint8_t* freq, uint32_t n, int shift) {
+  // No 8 bit shift - shift 16 bit lanes and drop the bits carried in from the neighbour
+  const __m256i kept = _mm256_set1_epi8((char) (0xff >> shift));
+  const __m256i free = _mm256_set1_epi8(-1);
+  const __m128i count = _mm_cvtsi32_si128(shift);
+  for (uint32_t i = 0; i < n; i += 32) {
+    __m256i f = _mm256_loadu_si256((const __m256i*) (freq + i));
+    __m256i aged = _mm256_and_si256(_mm256_srl_epi16(f, count), kept);
+    _mm256_storeu_si256((__m256i*) (freq + i), _mm256_or_si256(aged, _mm256_cmpeq_epi8(f, free)));
+  }
+}
+#endif
+
+static void unprotectedMasks(const uint8_t* freq, uint32_t n, uint32_t* masks) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (cpuHasAvx2()) {
+    unprotectedMasksAvx2(freq, n, masks);
+    return;
+  }
+#endif
+  unprotectedMasksScalar(freq, n, masks);
+}
+
+static uint8_t minFrequency(const uint8_t* freq, uint32_t n) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (cpuHasAvx2()) {
+    return minFrequencyAvx2(freq, n);
+  }
+#endif
+  return minFrequencyScalar(freq, n);
+}
+
+static void ageFrequencies(uint8_t* freq, uint32_t n, int shift) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (cpuHasAvx2()) {
+    ageFrequenciesAvx2(freq, n, shift);
+    return;
+  }
+#endif
+  ageFrequenciesScalar(freq, n, shift);
+}
+
+/**
+ * Eviction policy - LRU that spares recently hot entries, over structure-of-arrays metadata
+ * Meta is a slot in dense recency stamp and frequency arrays owned by the policy, so victim
+ * selection and aging are passes over contiguous memory (AVX2 when the CPU has it) instead
+ * of walks over every bucket
+ *
+ * The victim is the least recent entry with zero frequency. When every entry has a frequency
+ * all of them are shifted right by the bit width of the smallest, as many halvings as it
+ * takes for one to reach zero, and the search repeats. One scan yields a batch of victims,
+ * taken oldest first by later evictions while they stay untouched
+ *
+ * Stamps come from a logical clock that ticks once per insert and are compared by age, so
+ * the clock may wrap - an entry left untouched for 2^32 inserts would look new
+ *
+ */
+template <typename K>
+class SoaEviction {
+  static constexpr uint32_t CHUNK_SLOTS = 1024;
+  static constexpr uint32_t FREQ_WORDS = CHUNK_SLOTS / 8;
+  static constexpr uint32_t BLOCKS = CHUNK_SLOTS / 32;
+  static constexpr uint32_t FIRST_DIRECTORY = 16;
+  static constexpr size_t VICTIM_BATCH = 16;
+  static constexpr uint8_t MAX_FREQ = UINT8_MAX - 1;
+
+  // Frequency of a free slot - never zero and kept through aging
+  static constexpr uint8_t FREE_FREQ = UINT8_MAX;
+
+  /**
+   * Slots are added a chunk at a time and never move, so bucket lock holders can update
+   * their entry's stamp while another thread grows the arrays
+   * Bucket lock holders write stamps and frequencies while m_lock holders scan and age
+   * them, so both are atomics. Frequencies are packed eight to a word - scans copy the
+   * words out with relaxed loads and run their vector passes over the copy, and every
+   * change to a slot's byte is a read-modify-write that leaves its neighbours intact
+   *
+   */
+  struct Chunk {
+    alignas(64) atomic<uint32_t> m_stamps[CHUNK_SLOTS];
+    alignas(64) atomic<uint64_t> m_freq[FREQ_WORDS];
+
+    // Cold - only read once a victim is chosen
+    K m_keys[CHUNK_SLOTS];
+
+    uint8_t freq(uint32_t i) const {
+      return m_freq[i / 8].load(memory_order_relaxed) >> (i % 8 * 8);
+    }
+  };
+
+  /**
+   * Chunk directory, read by bucket lock holders without m_lock. A full one is replaced by
+   * a copy twice its size. Old ones may still be read, so they are kept until destruction -
+   * together no larger than the current one
+   *
+   */
+  atomic<Chunk**> m_directory;
+  uint32_t m_directorySize;
+  vector<unique_ptr<Chunk*[]>> m_directories;
+  vector<unique_ptr<Chunk>> m_chunks;
+
+  vector<uint32_t> m_free;
+
+  atomic<uint32_t> m_clock;
+
+  struct Candidate {
+    uint32_t m_slot;
+    uint32_t m_stamp;
+  };
+
+  // Victims found by the last scan, oldest last
+  vector<Candidate> m_batch;
+
+  // Scratch for scans - frequency snapshot, unprotected masks and ages per 32 slot block
+  vector<uint64_t> m_snapshot;
+  vector<uint32_t> m_masks;
+  vector<uint32_t> m_blockOldest;
+  vector<uint32_t> m_ranked;
+  vector<uint32_t> m_candidates;
+
+  // Guards slot allocation, keys, the directory, scans and the batch
+  mutex m_lock;
+
+  Chunk& chunkOf(uint32_t slot) {
+    return *m_directory.load(memory_order_acquire)[slot / CHUNK_SLOTS];
+  }
+
+  uint32_t numChunks() const {
+    return m_chunks.size();
+  }
+
+  void grow() {
+    uint32_t count = numChunks();
+    if (count == UINT32_MAX / CHUNK_SLOTS) {
+      throw bad_alloc();
+    }
+
+    if (count == m_directorySize) {
+      m_directorySize = max(FIRST_DIRECTORY, m_directorySize * 2);
+      unique_ptr<Chunk*[]> directory(new Chunk*[m_directorySize]());
+      for (uint32_t c = 0; c < count; c++) {
+        directory[c] = m_chunks[c].get();
+      }
+      m_directories.push_back(move(directory));
+    }
+
+    Chunk* chunk = new Chunk();
+    m_chunks.emplace_back(chunk);
+    for (auto& word : chunk->m_freq) {
+      word.store(UINT64_MAX, memory_order_relaxed);
+    }
+    m_directories.back()[count] = chunk;
+    m_directory.store(m_directories.back().get(), memory_order_release);
+
+    uint32_t base = count * CHUNK_SLOTS;
+    for (uint32_t i = CHUNK_SLOTS; i > 0; i--) {
+      m_free.push_back(base + i - 1);
+    }
+  }
+
+  /**
+   * Relaxed copy of every frequency word, and from it the unprotected slots of each block
+   *
+   */
+  void snapshot() {
+    m_snapshot.resize(numChunks() * FREQ_WORDS);
+    m_masks.resize(numChunks() * BLOCKS);
+    for (uint32_t c = 0; c < numChunks(); c++) {
+      for (uint32_t w = 0; w < FREQ_WORDS; w++) {
+        m_snapshot[c * FREQ_WORDS + w] = m_chunks[c]->m_freq[w].load(memory_order_relaxed);
+      }
+    }
+    unprotectedMasks((const uint8_t*) m_snapshot.data(), numChunks() * CHUNK_SLOTS, m_masks.data());
+  }
+
+  uint32_t stampOf(uint32_t slot) {
+    return m_chunks[slot / CHUNK_SLOTS]->m_stamps[slot % CHUNK_SLOTS].load(memory_order_relaxed);
+  }
+
+  /**
+   * Fills m_batch with the VICTIM_BATCH oldest unprotected slots, oldest last
+   * Takes the oldest age in every 32 slot block - only unprotected slots have their stamp
+   * read. At least VICTIM_BATCH slots are as old as the VICTIM_BATCH-th oldest block, and
+   * only blocks that old can hold them, so just those are collected from and sorted
+   *
+   */
+  void refill(uint32_t now) {
+    snapshot();
+    m_blockOldest.resize(m_masks.size());
+    for (uint32_t b = 0; b < m_masks.size(); b++) {
+      uint32_t oldest = 0;
+      for (uint32_t bits = m_masks[b]; bits; bits &= bits - 1) {
+        oldest = max(oldest, now + 1 - stampOf(b * 32 + __builtin_ctz(bits)));
+      }
+      m_blockOldest[b] = oldest;
+    }
+
+    m_ranked = m_blockOldest;
+    if (m_ranked.empty()) {
+      // No slot block yet - nothing to evict
+      return;
+    }
+    size_t rank = min<size_t>(VICTIM_BATCH, m_ranked.size()) - 1;
+    nth_element(m_ranked.begin(), m_ranked.begin() + rank, m_ranked.end(), greater<uint32_t>());
+    uint32_t threshold = max(m_ranked[rank], 1u);
+
+    m_candidates.clear();
+    for (uint32_t b = 0; b < m_masks.size(); b++) {
+      if (m_blockOldest[b] < threshold) {
+        continue;
+      }
+      for (uint32_t bits = m_masks[b]; bits; bits &= bits - 1) {
+        uint32_t slot = b * 32 + __builtin_ctz(bits);
+        if (now + 1 - stampOf(slot) >= threshold) {
+          m_candidates.push_back(slot);
+        }
+      }
+    }
+
+    size_t keep = min(m_candidates.size(), VICTIM_BATCH);
+    partial_sort(m_candidates.begin(), m_candidates.begin() + keep, m_candidates.end(),
+                 [&](uint32_t a, uint32_t b) { return now - stampOf(a) > now - stampOf(b); });
+    for (size_t k = keep; k > 0; k--) {
+      m_batch.push_back({m_candidates[k - 1], stampOf(m_candidates[k - 1])});
+    }
+  }
+
+  /**
+   * Oldest batched slot that is still unprotected and untouched since it was collected -
+   * a slot that was accessed, freed or reused has a new stamp or a frequency
+   *
+   */
+  bool takeBatched(uint32_t now, K& victim) {
+    while (!m_batch.empty()) {
+      Candidate candidate = m_batch.back();
+      m_batch.pop_back();
+
+      Chunk& chunk = chunkOf(candidate.m_slot);
+      uint32_t i = candidate.m_slot % CHUNK_SLOTS;
+      if (chunk.freq(i) == 0 && chunk.m_stamps[i].load(memory_order_relaxed) == candidate.m_stamp) {
+        victim = chunk.m_keys[i];
+        // Looks recent until it is removed, so concurrent evictors pick another entry
+        chunk.m_stamps[i].store(now, memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Shift every live frequency right - computed on the snapshot, stored back word by word
+   * with a CAS so increments that landed since are aged rather than lost
+   *
+   */
+  void age(int shift) {
+    vector<uint64_t> aged(m_snapshot);
+    ageFrequencies((uint8_t*) aged.data(), aged.size() * 8, shift);
+    for (uint32_t c = 0; c < numChunks(); c++) {
+      for (uint32_t w = 0; w < FREQ_WORDS; w++) {
+        uint64_t expected = m_snapshot[c * FREQ_WORDS + w];
+        uint64_t desired = aged[c * FREQ_WORDS + w];
+        while (!m_chunks[c]->m_freq[w].compare_exchange_weak(expected, desired, memory_order_relaxed)) {
+          desired = expected;
+          ageFrequenciesScalar((uint8_t*) &desired, 8, shift);
+        }
+      }
+    }
+  }
+
+public:
+  typedef uint32_t Meta;
+
+  SoaEviction() : m_directory(nullptr), m_directorySize(0), m_clock(0) {}
+
+  Meta onInsert(const K& key) {
+    scoped_lock<mutex> lock(m_lock);
+    if (m_free.empty()) {
+      grow();
+    }
+
+    uint32_t slot = m_free.back();
+    m_free.pop_back();
+
+    Chunk& chunk = chunkOf(slot);
+    uint32_t i = slot % CHUNK_SLOTS;
+    uint32_t now = m_clock.load(memory_order_relaxed) + 1;
+    m_clock.store(now, memory_order_relaxed);
+    chunk.m_keys[i] = key;
+    chunk.m_stamps[i].store(now, memory_order_relaxed);
+    chunk.m_freq[i / 8].fetch_and(~(0xffull << (i % 8 * 8)), memory_order_relaxed);
+
+    return slot;
+  }
+
+  void onUpdate(Meta& meta) {
+    onAccess(meta);
+  }
+
+  void onAccess(Meta& meta) {
+    Chunk& chunk = chunkOf(meta);
+    uint32_t i = meta % CHUNK_SLOTS;
+
+    // Avoid dirtying the lines when nothing changes
+    uint32_t now = m_clock.load(memory_order_relaxed);
+    if (chunk.m_stamps[i].load(memory_order_relaxed) != now) {
+      chunk.m_stamps[i].store(now, memory_order_relaxed);
+    }
+    // Only this entry's bucket lock holder raises its byte, and aging only lowers it, so
+    // the add never carries into the neighbour
+    if (chunk.freq(i) < MAX_FREQ) {
+      chunk.m_freq[i / 8].fetch_add(1ull << (i % 8 * 8), memory_order_relaxed);
+    }
+  }
+
+  void onRemove(Meta& meta) {
+    scoped_lock<mutex> lock(m_lock);
+    Chunk& chunk = chunkOf(meta);
+    uint32_t i = meta % CHUNK_SLOTS;
+    chunk.m_freq[i / 8].fetch_or(0xffull << (i % 8 * 8), memory_order_relaxed);
+    chunk.m_keys[i] = K();
+    m_free.push_back(meta);
+  }
+
+  /**
+   * Not accessed during the last turnover - as many inserts as there are live entries
+   * The clock counts inserts, so age is unused
+   *
+   */
+  bool isCold(Meta& meta, milliseconds) {
+    scoped_lock<mutex> lock(m_lock);
+    uint32_t live = numChunks() * CHUNK_SLOTS - m_free.size();
+    return m_clock.load(memory_order_relaxed) - chunkOf(meta).m_stamps[meta % CHUNK_SLOTS].load(memory_order_relaxed) >= live;
+  }
+
+  /**
+   * Served from a batch of the oldest slots, refilled by scans of the arrays
+   * Buckets are never visited
+   *
+   */
+  template <typename Visit>
+  bool selectVictim(long, Visit&&, K& victim) {
+    scoped_lock<mutex> lock(m_lock);
+    uint32_t now = m_clock.load(memory_order_relaxed);
+    if (takeBatched(now, victim)) {
+      return true;
+    }
+
+    refill(now);
+    if (takeBatched(now, victim)) {
+      return true;
+    }
+
+    // Every entry is protected - age them in one pass as far as repeated halving would
+    uint8_t least = minFrequency((const uint8_t*) m_snapshot.data(), m_snapshot.size() * 8);
+    if (least == FREE_FREQ) {
+      return false;
+    }
+    if (least) {
+      age(32 - __builtin_clz(least));
+    }
+
+    refill(now);
+    return takeBatched(now, victim);
+  }
+};
+
+/**
+ * Counter with the atomic interface Cache uses, for single threaded instances
+ * Memory orders are accepted and ignored
+ *
+ */
+template <typename T>
+class PlainCounter {
+  T m_val;
+
+public:
+  PlainCounter() : m_val() {}
+
+  PlainCounter(T val) : m_val(val) {}
+
+  PlainCounter& operator=(T val) {
+    m_val = val;
+    return *this;
+  }
+
+  T load(memory_order = memory_order_seq_cst) const {
+    return m_val;
+  }
+
+  void store(T val, memory_order = memory_order_seq_cst) {
+    m_val = val;
+  }
+
+  T fetch_add(T delta, memory_order = memory_order_seq_cst) {
+    T old = m_val;
+    m_val += delta;
+    return old;
+  }
+
+  T fetch_sub(T delta, memory_order = memory_order_seq_cst) {
+    T old = m_val;
+    m_val -= delta;
+    return old;
+  }
+};
+
+/**
+ * Spin loop hint
+ *
+ */
+static inline void cpuRelax() {
+#ifdef __SSE2__
+  _mm_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * Lock for short critical sections - spins briefly with a pause, then parks on a futex
+ * State 0 is unlocked, 1 locked, 2 locked with possible sleepers
+ *
+ */
+class SpinParkLock {
+  static constexpr int SPIN_LIMIT = 128;
+
+  atomic<int> m_state;
+
+  void park() {
+#ifdef __linux__
+    syscall(SYS_futex, (int*) &m_state, FUTEX_WAIT_PRIVATE, 2, nullptr, nullptr, 0);
+#else
+    this_thread::yield();
+#endif
+  }
+
+  void wakeOne() {
+#ifdef __linux__
+    syscall(SYS_futex, (int*) &m_state, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#endif
+  }
+
+public:
+  SpinParkLock() : m_state(0) {}
+
+  bool try_lock() {
+    int expected = 0;
+    return m_state.compare_exchange_strong(expected, 1, memory_order_acquire);
+  }
+
+  void lock() {
+    for (int i = 0; i < SPIN_LIMIT; i++) {
+      if (m_state.load(memory_order_relaxed) == 0 && try_lock()) {
+        return;
+      }
+      cpuRelax();
+    }
+
+    // Mark the lock contended and sleep until it is released
+    while (m_state.exchange(2, memory_order_acquire) != 0) {
+      park();
+    }
+  }
+
+  void unlock() {
+    if (m_state.exchange(0, memory_order_release) == 2) {
+      wakeOne();
+    }
+  }
+};
+
+/**
+ * MCS queue lock - waiters spin on their own node and are served in arrival order
+ * Nodes come from a small per-thread pool and go back to it on unlock in any order,
+ * a thread holding more than MAX_HELD at once gets the extra nodes from the heap
+ *
+ */
+class McsLock {
+  struct alignas(64) Node {
+    atomic<Node*> m_next;
+    atomic<bool> m_locked;
+  };
+
+  // Nodes each thread keeps inline, holding more McsLocks at once takes nodes from the heap
+  static constexpr int MAX_HELD = 8;
+  static constexpr int SPIN_LIMIT = 1024;
+
+  struct NodePool {
+    Node m_nodes[MAX_HELD];
+    // Bit i is set while m_nodes[i] is free
+    uint32_t m_free = (1u << MAX_HELD) - 1;
+  };
+
+  static NodePool& nodes() {
+    static thread_local NodePool pool;
+    return pool;
+  }
+
+  atomic<Node*> m_tail;
+
+  // Node of the current holder, only touched while holding the lock
+  Node* m_holder;
+
+  static Node* acquireNode() {
+    NodePool& pool = nodes();
+    Node* node;
+    if (pool.m_free) {
+      node = &pool.m_nodes[__builtin_ctz(pool.m_free)];
+      pool.m_free &= pool.m_free - 1;
+    } else {
+      node = new Node();
+    }
+
+    node->m_next.store(nullptr, memory_order_relaxed);
+    node->m_locked.store(true, memory_order_relaxed);
+    return node;
+  }
+
+  /**
+   * Gives back the given node rather than the last one taken, locks may be released in
+   * any order
+   *
+   */
+  static void releaseNode(Node* node) {
+    NodePool& pool = nodes();
+    uintptr_t offset = (uintptr_t) node - (uintptr_t) pool.m_nodes;
+    if (offset < sizeof(pool.m_nodes)) {
+      pool.m_free |= 1u << (offset / sizeof(Node));
+    } else {
+      delete node;
+    }
+  }
+
+public:
+  McsLock() : m_tail(nullptr), m_holder(nullptr) {}
+
+  bool try_lock() {
+    Node* node = acquireNode();
+    Node* expected = nullptr;
+    if (!m_tail.compare_exchange_strong(expected, node, memory_order_acq_rel)) {
+      releaseNode(node);
+      return false;
+    }
+
+    m_holder = node;
+    return true;
+  }
+
+  void lock() {
+    Node* node = acquireNode();
+    Node* pred = m_tail.exchange(node, memory_order_acq_rel);
+    if (pred) {
+      pred->m_next.store(node, memory_order_release);
+      for (int spins = 0; node->m_locked.load(memory_order_acquire); spins++) {
+        if (spins < SPIN_LIMIT) {
+          cpuRelax();
+        } else {
+          this_thread::yield();
+        }
+      }
+    }
+
+    m_holder = node;
+  }
+
+  void unlock() {
+    Node* node = m_holder;
+    Node* next = node->m_next.load(memory_order_acquire);
+    if (next == nullptr) {
+      Node* expected = node;
+      if (m_tail.compare_exchange_strong(expected, nullptr, memory_order_acq_rel)) {
+        releaseNode(node);
+        return;
+      }
+
+      // A successor is between swapping the tail and linking itself in
+      while ((next = node->m_next.load(memory_order_acquire)) == nullptr) {
+        cpuRelax();
+      }
+    }
+
+    next->m_locked.store(false, memory_order_release);
+    releaseNode(node);
+  }
+};
+
+/**
+ * Lock padded out to its own cache line so neighbouring stripes never false share
+ *
+ */
+template <typename Mutex>
+struct alignas(64) CacheLinePadded : Mutex {};
+
+/**
+ * Locking policy - striped locks of type Mutex, each on its own cache line, and an atomic size
+ * Mutex may be mutex, SpinParkLock or McsLock
+ *
+ */
+template <typename Mutex>
+struct StripedLocking {
+  typedef CacheLinePadded<Mutex> Lock;
+
+  static const long STRIPES = 1024;
+
+  template <typename T>
+  using Counter = atomic<T>;
+};
+
+typedef StripedLocking<mutex> MutexLocking;
+
+/**
+ * Locking policy - striped mutexes packed back to back
+ * Smaller, but adjacent stripes share cache lines and false share under writes
+ *
+ */
+struct PackedMutexLocking {
+  typedef mutex Lock;
+
+  static const long STRIPES = 1024;
+
+  template <typename T>
+  using Counter = atomic<T>;
+};
+
+/**
+ * Locking policy - no synchronisation, for instances owned by a single thread
+ *
+ */
+struct NoLocking {
+  struct Lock {
+    void lock() {}
+    void unlock() {}
+    bool try_lock() { return true; }
+  };
+
+  static const long STRIPES = 1;
+
+  template <typename T>
+  using Counter = PlainCounter<T>;
+};
+
+/**
+ * Hashing policy - std::hash modulo the bucket count
+ *
+ */
+template <typename K>
+struct StdHasher {
+  size_t operator()(const K& key, size_t numBuckets) const {
+    return hash<K>()(key) % numBuckets;
+  }
+
+  void hashBatch(const K* keys, size_t n, size_t numBuckets, long* buckets) const {
+    for (size_t i = 0; i < n; i++) {
+      buckets[i] = (*this)(keys[i], numBuckets);
+    }
+  }
+};
+
+/**
+ * Hashing policy - Fibonacci hashing, takes the top bits of a multiplicative hash
+ * Bucket count must be a power of two, avoids the division and spreads sequential keys
+ *
+ */
+template <typename K>
+struct FibonacciHasher {
+  static constexpr bool POWER_OF_TWO_BUCKETS = true;
+
+  size_t operator()(const K& key, size_t numBuckets) const {
+    uint64_t h = hash<K>()(key) * 0x9e3779b97f4a7c15ULL;
+    // Split shift - one bucket takes 64 bits off and gives 0 instead of shifting by 64
+    return (h >> 1) >> (63 - __builtin_ctzll(numBuckets));
+  }
+
+  void hashBatch(const K* keys, size_t n, size_t numBuckets, long* buckets) const {
+    for (size_t i = 0; i < n; i++) {
+      buckets[i] = (*this)(keys[i], numBuckets);
+    }
+  }
+};
+
+/**
+ * Hashing policies that only accept power of two bucket counts declare POWER_OF_TWO_BUCKETS
+ *
+ */
+template <typename H, typename = void>
+struct NeedsPowerOfTwoBuckets : false_type {};
+
+template <typename H>
+struct NeedsPowerOfTwoBuckets<H, void_t<decltype(H::POWER_OF_TWO_BUCKETS)>> : bool_constant<H::POWER_OF_TWO_BUCKETS> {};
+
+/**
+ * Hashing policy - every key goes to bucket 0 without being hashed
+ * For a Cache of one ordered bucket, e.g. a single ArtBucket tree that scan() walks directly
+ *
+ */
+template <typename K>
+struct SingleBucketHasher {
+  size_t operator()(const K&, size_t) const {
+    return 0;
+  }
+
+  void hashBatch(const K*, size_t n, size_t, long* buckets) const {
+    fill(buckets, buckets + n, 0);
+  }
+};
+
+/**
+ * Multiply-xorshift mix for 64 bit keys - multipliers fit in 32 bits so SIMD lanes can use
+ * the 32x32->64 multiplies of AVX2 and AVX-512F, and every path gives the same result
+ *
+ */
+static constexpr uint64_t MULSHIFT_C1 = 0x9e3779b1u;
+static constexpr uint64_t MULSHIFT_C2 = 0x85ebca77u;
+
+/**
+ * Bucket of a mixed hash - multiply-high of the top 32 bits, valid for numBuckets < 2^32
+ *
+ */
+static inline long mulShiftBucket(uint64_t x, uint64_t numBuckets) {
+  x ^= x >> 32;
+  x *= MULSHIFT_C1;
+  x ^= x >> 29;
+  x *= MULSHIFT_C2;
+  return ((x >> 32) * numBuckets) >> 32;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2"))) static inline __m256i mulShiftLanes(__m256i x, __m256i c) {
+  // 64x32 multiply mod 2^64 from two 32x32->64 multiplies
+  __m256i lo = _mm256_mul_epu32(x, c);
+  __m256i hi = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), c);
+  return _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+}
+
+__attribute__((target("avx2"))) static void mulShiftBucketsAvx2(const uint64_t* keys,
+                                                                 size_t n,
+                                                                 uint64_t numBuckets,
+                                                                 long* buckets) {
+  const __m256i c1 = _mm256_set1_epi64x(MULSHIFT_C1);
+  const __m256i c2 = _mm256_set1_epi64x(MULSHIFT_C2);
+  const __m256i range = _mm256_set1_epi64x(numBuckets);
+
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*) (keys + i));
+    x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 32));
+    x = mulShiftLanes(x, c1);
+    x = _mm256_xor_si256(x, _mm256_srli_epi64(x, 29));
+    x = mulShiftLanes(x, c2);
+    x = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(x, 32), range), 32);
+    _mm256_storeu_si256((__m256i*) (buckets + i), x);
+  }
+
+  for (; i < n; i++) {
+    buckets[i] = mulShiftBucket(keys[i], numBuckets);
+  }
+}
+
+// GCC flags the undefined passthrough operand of the AVX-512 intrinsics
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+__attribute__((target("avx512f"))) static inline __m512i mulShiftLanes(__m512i x, __m512i c) {
+  __m512i lo = _mm512_mul_epu32(x, c);
+  __m512i hi = _mm512_mul_epu32(_mm512_srli_epi64(x, 32), c);
+  return _mm512_add_epi64(lo, _mm512_slli_epi64(hi, 32));
+}
+
+__attribute__((target("avx512f"))) static void mulShiftBucketsAvx512(const uint64_t* keys,
+                                                                     size_t n,
+                                                                     uint64_t numBuckets,
+                                                                     long* buckets) {
+  const __m512i c1 = _mm512_set1_epi64(MULSHIFT_C1);
+  const __m512i c2 = _mm512_set1_epi64(MULSHIFT_C2);
+  const __m512i range = _mm512_set1_epi64(numBuckets);
+
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i x = _mm512_loadu_si512(keys + i);
+    x = _mm512_xor_si512(x, _mm512_srli_epi64(x, 32));
+    x = mulShiftLanes(x, c1);
+    x = _mm512_xor_si512(x, _mm512_srli_epi64(x, 29));
+    x = mulShiftLanes(x, c2);
+    x = _mm512_srli_epi64(_mm512_mul_epu32(_mm512_srli_epi64(x, 32), range), 32);
+    _mm512_storeu_si512(buckets + i, x);
+  }
+
+  for (; i < n; i++) {
+    buckets[i] = mulShiftBucket(keys[i], numBuckets);
+  }
+}
+#pragma GCC diagnostic pop
+#endif
+
+static void mulShiftBuckets(const uint64_t* keys, size_t n, uint64_t numBuckets, long* buckets) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (cpuHasAvx512()) {
+    mulShiftBucketsAvx512(keys, n, numBuckets, buckets);
+    return;
+  }
+  if (cpuHasAvx2()) {
+    mulShiftBucketsAvx2(keys, n, numBuckets, buckets);
+    return;
+  }
+#endif
+  for (size_t i = 0; i < n; i++) {
+    buckets[i] = mulShiftBucket(keys[i], numBuckets);
+  }
+}
+
+/**
+ * Hashing policy - multiply-xorshift for 64 bit integer keys, any bucket count below 2^32
+ * hashBatch does 8 keys per instruction with AVX-512F, 4 with AVX2
+ *
+ */
+template <typename K>
+struct MultiplyShiftHasher {
+  static_assert(is_integral<K>::value && sizeof(K) == 8, "MultiplyShiftHasher needs 64 bit integer keys");
+
+  size_t operator()(const K& key, size_t numBuckets) const {
+    return mulShiftBucket(key, numBuckets);
+  }
+
+  void hashBatch(const K* keys, size_t n, size_t numBuckets, long* buckets) const {
+    mulShiftBuckets((const uint64_t*) keys, n, numBuckets, buckets);
+  }
+};
+
+/**
+ * Bounded multi producer multi consumer ring buffer (Vyukov)
+ * Each cell carries a sequence number telling producers and consumers whose turn it is,
+ * so pushes and pops are a single CAS on their index when uncontended
+ *
+ */
+template <typename T>
+class MpmcQueue {
+  static constexpr size_t CACHE_LINE = 64;
+
+  struct Cell {
+    atomic<size_t> m_seq;
+    T m_val;
+  };
+
+  unique_ptr<Cell[]> m_cells;
+  size_t m_mask;
+
+  // Consumer side
+  alignas(CACHE_LINE) atomic<size_t> m_head;
+
+  // Producer side
+  alignas(CACHE_LINE) atomic<size_t> m_tail;
+
+public:
+  /**
+   * Capacity is rounded up to a power of two
+   *
+   */
+  explicit MpmcQueue(size_t capacity) : m_head(0), m_tail(0) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    m_cells.reset(new Cell[size]);
+    m_mask = size - 1;
+    for (size_t i = 0; i < size; i++) {
+      m_cells[i].m_seq.store(i, memory_order_relaxed);
+    }
+  }
+
+  /**
+   * Moves from item only when it returns true
+   *
+   */
+  bool tryPush(T&& item) {
+    size_t tail = m_tail.load(memory_order_relaxed);
+    for (;;) {
+      Cell& cell = m_cells[tail & m_mask];
+      long lag = (long) (cell.m_seq.load(memory_order_acquire) - tail);
+      if (lag == 0) {
+        if (m_tail.compare_exchange_weak(tail, tail + 1, memory_order_relaxed)) {
+          cell.m_val = move(item);
+          cell.m_seq.store(tail + 1, memory_order_release);
+          return true;
+        }
+      } else if (lag < 0) {
+        // Cell still holds the item from one lap ago - full
+        return false;
+      } else {
+        tail = m_tail.load(memory_order_relaxed);
+      }
+    }
+  }
+
+  /**
+   * Consumer side only
+   *
+   */
+  bool empty() const {
+    return m_head.load(memory_order_relaxed) == m_tail.load(memory_order_acquire);
+  }
+
+  bool tryPop(T& item) {
+    size_t head = m_head.load(memory_order_relaxed);
+    for (;;) {
+      Cell& cell = m_cells[head & m_mask];
+      long lag = (long) (cell.m_seq.load(memory_order_acquire) - (head + 1));
+      if (lag == 0) {
+        if (m_head.compare_exchange_weak(head, head + 1, memory_order_relaxed)) {
+          item = move(cell.m_val);
+          cell.m_seq.store(head + m_mask + 1, memory_order_release);
+          return true;
+        }
+      } else if (lag < 0) {
+        return false;
+      } else {
+        head = m_head.load(memory_order_relaxed);
+      }
+    }
+  }
+};
+
+/**
+ * Parking spot for a consumer thread that would otherwise poll an empty queue
+ * Producers call ring() after every push and only take the lock while the consumer is
+ * parked. park() rechecks the queue after raising m_asleep, and a seq_cst fence on each
+ * side makes sure one of the two sees the other - no wakeup is lost
+ *
+ */
+class alignas(64) Doorbell {
+  atomic<bool> m_asleep;
+  mutex m_lock;
+  condition_variable m_wake;
+
+  /**
+   * Slow half of ring() - kept out of line so ring() inlines into push paths
+   *
+   */
+  __attribute__((noinline)) void unpark() {
+    {
+      scoped_lock<mutex> lock(m_lock);
+      m_asleep.store(false, memory_order_relaxed);
+    }
+    m_wake.notify_one();
+  }
+
+public:
+  Doorbell() : m_asleep(false) {}
+
+  /**
+   * Blocks until ring() or wake() unless idle() turns false - stopped() is checked on wakeup
+   *
+   */
+  template <typename Idle, typename Stopped>
+  void park(Idle&& idle, Stopped&& stopped) {
+    unique_lock<mutex> lock(m_lock);
+    m_asleep.store(true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    if (idle()) {
+      m_wake.wait(lock, [&]() {
+        return !m_asleep.load(memory_order_relaxed) || stopped();
+      });
+    }
+    m_asleep.store(false, memory_order_relaxed);
+  }
+
+  void ring() {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (m_asleep.load(memory_order_relaxed)) {
+      unpark();
+    }
+  }
+
+  /**
+   * Wakes a parked consumer after its stop flag was set
+   *
+   */
+  void wake() {
+    {
+      scoped_lock<mutex> lock(m_lock);
+    }
+    m_wake.notify_all();
+  }
+};
+
+/**
+ * Destroys retired values on a background thread
+ * Values queue up to the backlog, past it retire() destroys them in the caller - which
+ * Cache only does after dropping the bucket lock. Can be shared by many caches, and
+ * must outlive all of them. Parks on a Doorbell while there is nothing to destroy
+ *
+ */
+template <typename V>
+class Reclaimer {
+  static constexpr int SPIN_LIMIT = 64;
+
+  MpmcQueue<V> m_queue;
+  atomic<bool> m_stop;
+  Doorbell m_bell;
+
+  atomic<long> m_deferred;
+  atomic<long> m_inline;
+
+  thread m_thread;
+
+  void run() {
+    V val;
+    int idle = 0;
+    while (true) {
+      bool stop = m_stop.load(memory_order_acquire);
+      if (m_queue.tryPop(val)) {
+        val = V();
+        idle = 0;
+      } else if (stop && m_queue.empty()) {
+        return;
+      } else if (++idle < SPIN_LIMIT) {
+        this_thread::yield();
+      } else {
+        m_bell.park([&]() { return m_queue.empty(); }, [&]() { return m_stop.load(memory_order_relaxed); });
+        idle = 0;
+      }
+    }
+  }
+
+public:
+  explicit Reclaimer(size_t backlog = 4096)
+      : m_queue(backlog), m_stop(false), m_deferred(0), m_inline(0), m_thread(&Reclaimer::run, this) {}
+
+  ~Reclaimer() {
+    m_stop.store(true, memory_order_release);
+    m_bell.wake();
+    m_thread.join();
+  }
+
+  void retire(V&& val) {
+    if (m_queue.tryPush(move(val))) {
+      m_deferred.fetch_add(1, memory_order_relaxed);
+      m_bell.ring();
+      return;
+    }
+
+    // Backlog full - destroy here rather than wait
+    m_inline.fetch_add(1, memory_order_relaxed);
+    val = V();
+  }
+
+  long deferredCount() const {
+    return m_deferred.load(memory_order_relaxed);
+  }
+
+  long inlineCount() const {
+    return m_inline.load(memory_order_relaxed);
+  }
+};
+
+/**
+ * Whether a bucket type allocates its nodes from a NodeArena (has setArena)
+ *
+ */
+template <typename B, typename = void>
+struct TakesArena : false_type {};
+
+template <typename B>
+struct TakesArena<B, void_t<decltype(declval<B&>().setArena(nullptr))>> : true_type {};
+
+/**
+ * LZ77 block compression in the LZ4 block layout, no entropy coding
+ * Each sequence is a token - literal count in the high nibble, match length - 4 in the low,
+ * 15 meaning more length bytes follow - then the literals, a 16 bit offset and the extra
+ * match length. The last sequence is literals only
+ * Matches are found through a hash table of 4 byte sequences - O(n)
+ *
+ */
+static void lzCompress(const char* src, size_t n, string& out) {
+  static constexpr size_t HASH_BITS = 12;
+  static constexpr size_t MIN_MATCH = 4;
+  static constexpr size_t MAX_OFFSET = 65535;
+
+  // Position + 1 of the last sequence with each hash, 0 when empty
+  uint32_t table[1 << HASH_BITS] = {};
+
+  auto writeLength = [&out](size_t length) {
+    for (; length >= 255; length -= 255) {
+      out.push_back((char) 255);
+    }
+    out.push_back((char) length);
+  };
+
+  out.clear();
+  out.reserve(n + n / 255 + 16);
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + MIN_MATCH <= n) {
+    uint32_t seq;
+    memcpy(&seq, src + pos, MIN_MATCH);
+    uint32_t& slot = table[(seq * 2654435761u) >> (32 - HASH_BITS)];
+    size_t candidate = slot;
+    slot = pos + 1;
+    if (!candidate || pos - (candidate - 1) > MAX_OFFSET || memcmp(src + candidate - 1, src + pos, MIN_MATCH)) {
+      pos++;
+      continue;
+    }
+    candidate--;
+
+    size_t length = MIN_MATCH;
+    while (pos + length < n && src[candidate + length] == src[pos + length]) {
+      length++;
+    }
+
+    size_t literals = pos - anchor;
+    size_t extra = length - MIN_MATCH;
+    out.push_back((char) ((min<size_t>(literals, 15) << 4) | min<size_t>(extra, 15)));
+    if (literals >= 15) {
+      writeLength(literals - 15);
+    }
+    out.append(src + anchor, literals);
+    size_t offset = pos - candidate;
+    out.push_back((char) (offset & 0xff));
+    out.push_back((char) (offset >> 8));
+    if (extra >= 15) {
+      writeLength(extra - 15);
+    }
+
+    pos += length;
+    anchor = pos;
+  }
+
+  size_t literals = n - anchor;
+  out.push_back((char) (min<size_t>(literals, 15) << 4));
+  if (literals >= 15) {
+    writeLength(literals - 15);
+  }
+  out.append(src + anchor, literals);
+}
+
+/**
+ * Inverse of lzCompress into dst of exactly rawSize bytes - false if src is malformed
+ *
+ */
+static bool lzDecompress(const char* src, size_t n, char* dst, size_t rawSize) {
+  size_t in = 0;
+  size_t out = 0;
+  auto readLength = [&](size_t& length) {
+    uint8_t byte;
+    do {
+      if (in >= n) {
+        return false;
+      }
+      byte = src[in++];
+      length += byte;
+    } while (byte == 255);
+    return true;
+  };
+
+  while (in < n) {
+    uint8_t token = src[in++];
+    size_t literals = token >> 4;
+    if ((literals == 15 && !readLength(literals)) || literals > n - in || literals > rawSize - out) {
+      return false;
+    }
+    if (literals <= 16 && n - in >= 16 && rawSize - out >= 16) {
+      // Fixed size copy with room to spare - cheaper than a variable one for short runs
+      memcpy(dst + out, src + in, 16);
+    } else {
+      memcpy(dst + out, src + in, literals);
+    }
+    in += literals;
+    out += literals;
+    if (in == n) {
+      break;
+    }
+
+    if (n - in < 2) {
+      return false;
+    }
+    size_t offset = (uint8_t) src[in] | ((uint8_t) src[in + 1] << 8);
+    in += 2;
+    size_t length = token & 15;
+    if (length == 15 && !readLength(length)) {
+      return false;
+    }
+    length += 4;
+    if (offset == 0 || offset > out || length > rawSize - out) {
+      return false;
+    }
+
+    if (offset >= 8 && rawSize - out >= length + 8) {
+      // 8 bytes at a time, overrunning into space later sequences overwrite
+      for (size_t i = 0; i < length; i += 8) {
+        memcpy(dst + out + i, dst + out - offset + i, 8);
+      }
+    } else if (offset >= length) {
+      memcpy(dst + out, dst + out - offset, length);
+    } else {
+      // Overlapping - byte at a time repeats the last offset bytes
+      for (size_t i = 0; i < length; i++) {
+        dst[out + i] = dst[out - offset + i];
+      }
+    }
+    out += length;
+  }
+
+  return out == rawSize;
+}
+
+/**
+ * String value stored raw or LZ compressed
+ * A Cache holding TieredValues can compress entries its eviction policy finds cold with
+ * compressCold(), and expands them again when they are looked up
+ *
+ */
+class TieredValue {
+  enum : uint8_t { RAW, INCOMPRESSIBLE, COMPRESSED };
+
+  string m_bytes;
+  uint32_t m_rawSize;
+  uint8_t m_state;
+
+public:
+  // Smaller values are never worth compressing
+  static constexpr size_t MIN_BYTES = 128;
+
+  TieredValue() : m_rawSize(0), m_state(RAW) {}
+
+  TieredValue(string raw) : m_bytes(move(raw)), m_rawSize(0), m_state(RAW) {}
+
+  bool compressed() const {
+    return m_state == COMPRESSED;
+  }
+
+  /**
+   * Raw, big enough and not already found incompressible
+   *
+   */
+  bool compressible() const {
+    return m_state == RAW && m_bytes.size() >= MIN_BYTES;
+  }
+
+  /**
+   * Keeps the compressed form only if it saves an eighth, else remembers not to try again
+   *
+   */
+  void compress() {
+    if (!compressible()) {
+      return;
+    }
+
+    string packed;
+    lzCompress(m_bytes.data(), m_bytes.size(), packed);
+    if (packed.size() > m_bytes.size() - m_bytes.size() / 8) {
+      m_state = INCOMPRESSIBLE;
+      return;
+    }
+
+    m_rawSize = m_bytes.size();
+    packed.shrink_to_fit();
+    m_bytes.swap(packed);
+    m_state = COMPRESSED;
+  }
+
+  void expand() {
+    if (!compressed()) {
+      return;
+    }
+
+    string raw(m_rawSize, '\0');
+    if (!lzDecompress(m_bytes.data(), m_bytes.size(), &raw[0], m_rawSize)) {
+      throw runtime_error("corrupt compressed value");
+    }
+    m_bytes.swap(raw);
+    m_state = RAW;
+  }
+
+  /**
+   * The value - only valid while not compressed, as after a Cache lookup
+   *
+   */
+  const string& str() const {
+    return m_bytes;
+  }
+
+  /**
+   * Bytes held, compressed or not
+   *
+   */
+  const string& stored() const {
+    return m_bytes;
+  }
+
+  bool operator==(const TieredValue& other) const {
+    return m_state == other.m_state && m_bytes == other.m_bytes;
+  }
+};
+
+/**
+ * Whether a value type can be compressed in place (has expand)
+ *
+ */
+template <typename V, typename = void>
+struct IsTiered : false_type {};
+
+template <typename V>
+struct IsTiered<V, void_t<decltype(declval<V&>().expand())>> : true_type {};
+
+/**
+ * Handle to a T whose reference count lives in the same block, in place of shared_ptr
+ * Blocks come from a Pool - a NodeArena with a free list - so a Cache of Counted values
+ * allocates them from its own pool with make():
+ *
+ *   Cache<long, Counted<Element>> cache;
+ *   cache.put(key, cache.make(1, 'a', 2));
+ *
+ * Copying a handle, as get() does, is one relaxed increment. The count is the Locking
+ * policy's Counter, so Counted<T, NoLocking> counts without atomics for single threaded
+ * use. Handles must be released before the pool they came from is destroyed
+ *
+ */
+template <typename T, typename Locking = MutexLocking>
+class Counted {
+public:
+  class Pool;
+
+private:
+  struct Block {
+    typename Locking::template Counter<uint32_t> m_refs;
+    Pool* m_pool;
+    T m_val;
+
+    template <typename... Args>
+    Block(Pool* pool, Args&&... args) : m_pool(pool), m_val(forward<Args>(args)...) {
+      m_refs = 1;
+    }
+  };
+
+  Block* m_block;
+
+  explicit Counted(Block* block) : m_block(block) {}
+
+  void release() {
+    // Acquire too, so the last holder sees every other holder's writes before destroying
+    if (m_block && m_block->m_refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+      m_block->m_pool->free(m_block);
+    }
+  }
+
+public:
+  static constexpr bool ATOMIC = !is_same<typename Locking::template Counter<uint32_t>, PlainCounter<uint32_t>>::value;
+
+  /**
+   * Blocks are carved from a NodeArena and recycled through a free list, so memory is only
+   * unmapped with the pool
+   *
+   * When counts are atomic, each thread keeps up to MAGAZINE_SLOTS free slots of the last
+   * pool it made a value from. make() and the release of a handle's last reference then
+   * take no lock. Slots move between a magazine and the pool's shared free list in batches
+   * of MAGAZINE_SLOTS / 2. A thread that switches pools, or exits, gives its slots back
+   *
+   */
+  class Pool {
+    friend class Counted;
+
+    union Slot {
+      Slot* m_next;
+      alignas(Block) char m_block[sizeof(Block)];
+    };
+
+    static_assert(alignof(Block) <= alignof(max_align_t), "NodeArena does not over-align");
+
+    static constexpr long MAGAZINE_SLOTS = 64;
+
+    // Held for a few pointer swaps, so a spin lock unless single threaded
+    typedef conditional_t<ATOMIC, SpinParkLock, NoLocking::Lock> Lock;
+
+    /**
+     * Free slots a thread keeps for one pool. Pools are told apart by serial rather than
+     * address, so a magazine left over from a destroyed pool is dropped unread
+     *
+     */
+    struct Magazine {
+      uint64_t m_serial = 0;
+      Slot* m_head = nullptr;
+      long m_count = 0;
+
+      ~Magazine() {
+        giveBack();
+      }
+
+      /**
+       * Empties the magazine into its pool's free list if that pool still exists
+       *
+       */
+      void giveBack() {
+        if (m_count) {
+          scoped_lock<mutex> lock(s_poolsLock);
+          auto found = s_pools.find(m_serial);
+          if (found != s_pools.end()) {
+            found->second->pushList(m_head, m_count);
+          }
+        }
+        m_head = nullptr;
+        m_count = 0;
+      }
+    };
+
+    // Pools alive with atomic counts, by serial - held while a magazine gives slots back
+    static inline mutex s_poolsLock;
+    static inline unordered_map<uint64_t, Pool*> s_pools;
+    static inline atomic<uint64_t> s_nextSerial{1};
+
+    NodeArena m_arena;
+    Lock m_lock;
+    Slot* m_free;
+    long m_slots;
+    long m_freeSlots;
+    uint64_t m_serial;
+
+    static Magazine& magazine() {
+      static thread_local Magazine mag;
+      return mag;
+    }
+
+    /**
+     * Puts count slots linked from head on the shared free list
+     *
+     */
+    void pushList(Slot* head, long count) {
+      Slot* tail = head;
+      for (long i = 1; i < count; i++) {
+        tail = tail->m_next;
+      }
+
+      scoped_lock<Lock> lock(m_lock);
+      tail->m_next = m_free;
+      m_free = head;
+      m_freeSlots += count;
+    }
+
+    /**
+     * Moves MAGAZINE_SLOTS / 2 slots into an empty magazine - from the free list, or new
+     * ones carved from the arena in one piece when it has none
+     *
+     */
+    void refill(Magazine& mag) {
+      long taken = 0;
+      {
+        scoped_lock<Lock> lock(m_lock);
+        while (m_free && taken < MAGAZINE_SLOTS / 2) {
+          Slot* slot = m_free;
+          m_free = slot->m_next;
+          slot->m_next = mag.m_head;
+          mag.m_head = slot;
+          taken++;
+        }
+        m_freeSlots -= taken;
+        if (!taken) {
+          m_slots += MAGAZINE_SLOTS / 2;
+        }
+      }
+
+      if (!taken) {
+        Slot* run = (Slot*) m_arena.allocate(sizeof(Slot) * (MAGAZINE_SLOTS / 2));
+        for (taken = 0; taken < MAGAZINE_SLOTS / 2; taken++) {
+          run[taken].m_next = mag.m_head;
+          mag.m_head = &run[taken];
+        }
+      }
+      mag.m_count += taken;
+    }
+
+    Slot* take() {
+      if constexpr (ATOMIC) {
+        Magazine& mag = magazine();
+        if (mag.m_serial != m_serial) {
+          mag.giveBack();
+          mag.m_serial = m_serial;
+        }
+        if (!mag.m_head) {
+          refill(mag);
+        }
+        Slot* slot = mag.m_head;
+        mag.m_head = slot->m_next;
+        mag.m_count--;
+        return slot;
+      }
+
+      scoped_lock<Lock> lock(m_lock);
+      Slot* slot = m_free;
+      if (slot) {
+        m_free = slot->m_next;
+        m_freeSlots--;
+        return slot;
+      }
+      m_slots++;
+      return (Slot*) m_arena.allocate(sizeof(Slot));
+    }
+
+    void push(Slot* slot) {
+      if constexpr (ATOMIC) {
+        Magazine& mag = magazine();
+        if (mag.m_serial == m_serial) {
+          slot->m_next = mag.m_head;
+          mag.m_head = slot;
+          if (++mag.m_count > MAGAZINE_SLOTS) {
+            // Keep the newest half, hand the rest back
+            Slot* last = mag.m_head;
+            for (long i = 1; i < MAGAZINE_SLOTS / 2; i++) {
+              last = last->m_next;
+            }
+            pushList(last->m_next, mag.m_count - MAGAZINE_SLOTS / 2);
+            last->m_next = nullptr;
+            mag.m_count = MAGAZINE_SLOTS / 2;
+          }
+          return;
+        }
+      }
+
+      slot->m_next = nullptr;
+      pushList(slot, 1);
+    }
+
+    void free(Block* block) {
+      block->~Block();
+      push((Slot*) block);
+    }
+
+  public:
+    Pool() : m_arena(ATOMIC), m_free(nullptr), m_slots(0), m_freeSlots(0), m_serial(0) {
+      if constexpr (ATOMIC) {
+        m_serial = s_nextSerial.fetch_add(1, memory_order_relaxed);
+        scoped_lock<mutex> lock(s_poolsLock);
+        s_pools[m_serial] = this;
+      }
+    }
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    ~Pool() {
+      if constexpr (ATOMIC) {
+        scoped_lock<mutex> lock(s_poolsLock);
+        s_pools.erase(m_serial);
+      }
+    }
+
+    template <typename... Args>
+    Counted make(Args&&... args) {
+      Slot* slot = take();
+      try {
+        return Counted(new (slot) Block(this, forward<Args>(args)...));
+      } catch (...) {
+        push(slot);
+        throw;
+      }
+    }
+
+    /**
+     * Slots not on the shared free list - values with at least one handle, and free slots
+     * threads keep in their magazines
+     *
+     */
+    long liveCount() {
+      scoped_lock<Lock> lock(m_lock);
+      return m_slots - m_freeSlots;
+    }
+  };
+
+  Counted() : m_block(nullptr) {}
+
+  Counted(const Counted& other) : m_block(other.m_block) {
+    if (m_block) {
+      m_block->m_refs.fetch_add(1, memory_order_relaxed);
+    }
+  }
+
+  Counted(Counted&& other) noexcept : m_block(other.m_block) {
+    other.m_block = nullptr;
+  }
+
+  Counted& operator=(Counted other) noexcept {
+    swap(m_block, other.m_block);
+    return *this;
+  }
+
+  ~Counted() {
+    release();
+  }
+
+  T* get() const {
+    return m_block ? &m_block->m_val : nullptr;
+  }
+
+  T& operator*() const {
+    return m_block->m_val;
+  }
+
+  T* operator->() const {
+    return &m_block->m_val;
+  }
+
+  explicit operator bool() const {
+    return m_block != nullptr;
+  }
+
+  uint32_t useCount() const {
+    return m_block ? m_block->m_refs.load(memory_order_relaxed) : 0;
+  }
+
+  bool operator==(const Counted& other) const {
+    return m_block == other.m_block;
+  }
+};
+
+/**
+ * Pool a Cache keeps for its values - Counted values get theirs, others an empty one
+ *
+ */
+template <typename V>
+struct ValuePool {
+  struct type {};
+
+  static constexpr bool ATOMIC_COUNTS = true;
+};
+
+template <typename T, typename L>
+struct ValuePool<Counted<T, L>> {
+  typedef typename Counted<T, L>::Pool type;
+
+  static constexpr bool ATOMIC_COUNTS = Counted<T, L>::ATOMIC;
+};
+
+/**
+ * Cache implementation
+ * Designed to support O(1) insertion, O(1) lookup, O(1) update, O(n) deletion
+ *
+ * Storage, eviction, locking and hashing are compile time policies:
+ *   Storage  - bucket type (TreeBucket, RobinHoodBucket, SplitBucket, ArtBucket, AvlBucket, HybridBucket,
+ *              SplayBucket, FrozenBucket)
+ *   Eviction - TimestampLRU, ClockEviction or SoaEviction<K>
+ *   Locking  - MutexLocking, StripedLocking<SpinParkLock / McsLock>, PackedMutexLocking or NoLocking
+ *   Hasher   - StdHasher, FibonacciHasher, MultiplyShiftHasher or SingleBucketHasher
+ *
+ */
+template <typename K,
+          typename V,
+          template <typename, typename> class Storage = TreeBucket,
+          typename Eviction = TimestampLRU,
+          typename Locking = MutexLocking,
+          typename Hasher = StdHasher<K>>
+class Cache {
+protected:
+  typedef typename Eviction::Meta Meta;
+  typedef pair<V, Meta> Entry;
+  typedef typename Locking::Lock Lock;
+
+  /**
+   * Whether several threads may use the instance - NoLocking also drops the atomic counters,
+   * the compact lock and the arena's atomics
+   *
+   */
+  static constexpr bool SHARED = !is_same<typename Locking::template Counter<long>, PlainCounter<long>>::value;
+
+  /**
+   * Default partitions in the cache - Not necesarrily same as number of elements
+   * Increase to have a better average case insertion/lookup performance
+   *
+   */
+  static const long NUM_BUCKETS = 1024;
+
+  /**
+   * Maximum number of elements supported by the cache
+   *
+   */
+  static const long CACHE_SIZE = 1024;
+
+  /**
+   * Fewest buckets per thread worth a parallel teardown
+   *
+   */
+  static const long TEARDOWN_BUCKETS = 4096;
+
+  /**
+   * Keys hashed together by getBatch / putBatch
+   *
+   */
+  static const long BATCH_SIZE = 32;
+
+  /**
+   * Bucket arrays up to this size are assumed to stay in cache - getBatch just loops over get
+   *
+   */
+  static const long BATCH_MIN_BYTES = 256 * 1024;
+
+  long numBuckets;
+
+  long numStripes;
+
+  /**
+   * Blocks for Counted values made with make() - declared ahead of buckets so it outlives them
+   *
+   */
+  typename ValuePool<V>::type valuePool;
+
+  /**
+   * Node memory for buckets that take an arena - declared ahead of buckets so it outlives them
+   *
+   */
+  unique_ptr<NodeArena> arena;
+
+  /**
+   * Cache partitions - Same as number of slots in the cache if numBuckets = CACHE_SIZE
+   *
+   */
+  unique_ptr<Storage<K, Entry>[]> buckets;
+
+  /**
+   * Lock stripes - stripe (bucket % numStripes) protects a bucket
+   * Lock memory is bounded by the stripe count however many buckets there are
+   *
+   */
+  unique_ptr<Lock[]> stripeLocks;
+
+  /**
+   * Actual number of elements in the cache
+   *
+   */
+  typename Locking::template Counter<long> cacheSize;
+
+  /**
+   * Effective maximum number of elements - CACHE_SIZE unless changed by setCapacity
+   *
+   */
+  typename Locking::template Counter<long> capacity;
+
+  /**
+   * Serializes compact() calls - nothing to serialize without locking
+   *
+   */
+  conditional_t<SHARED, mutex, NoLocking::Lock> compactLock;
+
+  Eviction eviction;
+
+  Hasher hasher;
+
+  long hashFunc(const K& key) {
+    return hasher(key, numBuckets);
+  }
+
+  Lock& lockFor(long bucket) {
+    return stripeLocks[bucket % numStripes];
+  }
+
+  /**
+   * Background destruction of displaced values - nullptr destroys them in the caller
+   *
+   */
+  Reclaimer<V>* reclaimer;
+
+  /**
+   * Disposes of a value displaced by put / remove - called after the bucket lock is dropped
+   *
+   */
+  void retire(optional<V>& displaced) {
+    if (displaced && reclaimer) {
+      reclaimer->retire(move(*displaced));
+    }
+    displaced.reset();
+  }
+
+  /**
+   * Put into a bucket whose stripe lock is held - cacheSize was already incremented
+   * An overwritten value is moved to displaced, if given, so it can be destroyed unlocked
+   * An rvalue val is moved into the cache
+   *
+   */
+  template <typename T>
+  bool putLocked(long bucket, const K& key, T&& val, optional<V>* displaced = nullptr) {
+    Entry* existing = buckets[bucket].find(key);
+    if (existing) {
+      if (displaced) {
+        displaced->emplace(move(existing->first));
+      }
+      existing->first = forward<T>(val);
+      eviction.onUpdate(existing->second);
+      cacheSize.fetch_sub(1);
+      return true;
+    }
+
+    buckets[bucket].insert(key, Entry(forward<T>(val), eviction.onInsert(key)));
+
+    return true;
+  }
+
+  bool getFrom(long bucket, const K& key, V& val) {
+    // Acquire bucket lock
+    scoped_lock<Lock> lock(lockFor(bucket));
+
+    Entry* entry = buckets[bucket].find(key);
+    if (!entry) {
+      return false;
+    }
+
+    if constexpr (IsTiered<V>::value) {
+      // Promote a cold entry - expanded in place and counted as freshly used
+      if (entry->first.compressed()) {
+        entry->first.expand();
+        eviction.onUpdate(entry->second);
+      }
+    }
+
+    eviction.onAccess(entry->second);
+    val = entry->first;
+    return true;
+  }
+
+  template <typename T>
+  bool putInto(long bucket, const K& key, T&& val) {
+    if (cacheSize.fetch_add(1) >= capacity.load(memory_order_relaxed)) {
+      evict();
+    }
+
+    optional<V> displaced;
+    {
+      // Acquire bucket lock
+      scoped_lock<Lock> lock(lockFor(bucket));
+      putLocked(bucket, key, forward<T>(val), &displaced);
+    }
+
+    retire(displaced);
+    return true;
+  }
+
+  /**
+   * Remove from a bucket whose stripe lock is held - the value is moved to displaced, if given
+   *
+   */
+  bool removeLocked(long bucket, const K& key, optional<V>* displaced = nullptr) {
+    Entry* entry = buckets[bucket].find(key);
+    if (!entry) {
+      return false;
+    }
+
+    if (displaced) {
+      displaced->emplace(move(entry->first));
+    }
+    eviction.onRemove(entry->second);
+    buckets[bucket].remove(key);
+
+    cacheSize.fetch_sub(1);
+
+    return true;
+  }
+
+public:
+  Cache(long bucketCount = NUM_BUCKETS, long stripeCount = Locking::STRIPES)
+      : numBuckets(bucketCount),
+        numStripes(min(stripeCount, bucketCount)),
+        arena(new NodeArena(SHARED)),
+        buckets(new Storage<K, Entry>[bucketCount]),
+        stripeLocks(new Lock[numStripes]),
+        capacity(CACHE_SIZE),
+        reclaimer(nullptr) {
+    if (NeedsPowerOfTwoBuckets<Hasher>::value && (bucketCount & (bucketCount - 1))) {
+      throw invalid_argument("bucket count must be a power of two for this hasher");
+    }
+
+    cacheSize = 0;
+    if constexpr (TakesArena<Storage<K, Entry>>::value) {
+      for (long i = 0; i < numBuckets; i++) {
+        buckets[i].setArena(arena.get());
+      }
+    }
+  }
+
+  /**
+   * Must not race with other operations
+   * Entries that need destructors are destroyed by up to hardware_concurrency threads,
+   * TEARDOWN_BUCKETS buckets or more each. Arena memory then goes in one munmap per chunk
+   *
+   */
+  ~Cache() {
+    if (is_trivially_destructible<K>::value && is_trivially_destructible<Entry>::value) {
+      return;
+    }
+
+    // Handles sharing a non atomic count must be released by one thread
+    if (!ValuePool<V>::ATOMIC_COUNTS) {
+      return;
+    }
+
+    long workers = min<long>(thread::hardware_concurrency(), numBuckets / TEARDOWN_BUCKETS);
+    if (workers < 2) {
+      return;
+    }
+
+    // Destroy each bucket in place and leave an empty one for the array destructor
+    Storage<K, Entry>* storage = buckets.get();
+    auto teardown = [storage](long from, long to) {
+      for (long i = from; i < to; i++) {
+        storage[i].~Storage<K, Entry>();
+        new (&storage[i]) Storage<K, Entry>();
+      }
+    };
+
+    vector<thread> threads;
+    long share = (numBuckets + workers - 1) / workers;
+    for (long from = share; from < numBuckets; from += share) {
+      threads.emplace_back(teardown, from, min(from + share, numBuckets));
+    }
+    teardown(0, min(share, numBuckets));
+
+    for (auto& worker : threads) {
+      worker.join();
+    }
+  }
+
+  /**
+   * Value allocated from this cache's pool - V must be a Counted
+   *
+   */
+  template <typename... Args>
+  V make(Args&&... args) {
+    return valuePool.make(forward<Args>(args)...);
+  }
+
+  bool get(const K& key, V& val) {
+    return getFrom(hashFunc(key), key, val);
+  }
+
+  bool put(const K& key, const V& val) {
+    return putInto(hashFunc(key), key, val);
+  }
+
+  /**
+   * Moves val into the cache - no copy for handles such as ValueTable refs
+   *
+   */
+  bool put(const K& key, V&& val) {
+    return putInto(hashFunc(key), key, move(val));
+  }
+
+  /**
+   * Batched lookups - hashes BATCH_SIZE keys at a time with the hasher's batch kernel and
+   * prefetches their buckets before probing any of them
+   * found[i] tells whether vals[i] was filled in, returns the number of hits
+   * Only pays off when the bucket array misses cache, so smaller tables skip the batching
+   * and loop over get (see benchBatchHashing)
+   *
+   */
+  size_t getBatch(const K* keys, size_t n, V* vals, bool* found) {
+    long bucketOf[BATCH_SIZE];
+    size_t hits = 0;
+
+    if (numBuckets * sizeof(buckets[0]) <= BATCH_MIN_BYTES) {
+      // Buckets stay cached - nothing to prefetch, the batching would be pure overhead
+      for (size_t i = 0; i < n; i++) {
+        found[i] = get(keys[i], vals[i]);
+        hits += found[i];
+      }
+      return hits;
+    }
+
+    for (size_t base = 0; base < n; base += BATCH_SIZE) {
+      size_t count = min<size_t>(BATCH_SIZE, n - base);
+      hasher.hashBatch(keys + base, count, numBuckets, bucketOf);
+      for (size_t i = 0; i < count; i++) {
+        __builtin_prefetch(&buckets[bucketOf[i]]);
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        found[base + i] = getFrom(bucketOf[i], keys[base + i], vals[base + i]);
+        hits += found[base + i];
+      }
+    }
+
+    return hits;
+  }
+
+  /**
+   * Batched puts for bulk loading - hashed and prefetched like getBatch
+   *
+   */
+  void putBatch(const K* keys, const V* vals, size_t n) {
+    long bucketOf[BATCH_SIZE];
+
+    for (size_t base = 0; base < n; base += BATCH_SIZE) {
+      size_t count = min<size_t>(BATCH_SIZE, n - base);
+      hasher.hashBatch(keys + base, count, numBuckets, bucketOf);
+      for (size_t i = 0; i < count; i++) {
+        __builtin_prefetch(&buckets[bucketOf[i]]);
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        putInto(bucketOf[i], keys[base + i], vals[base + i]);
+      }
+    }
+  }
+
+  bool remove(const K& key) {
+    long hashVal = hashFunc(key);
+    optional<V> displaced;
+    {
+      // Acquire bucket lock
+      scoped_lock<Lock> lock(lockFor(hashVal));
+      if (!removeLocked(hashVal, key, &displaced)) {
+        return false;
+      }
+    }
+
+    retire(displaced);
+    return true;
+  }
+
+  /**
+   * Hand removed, evicted and overwritten values to reclaimer instead of destroying them
+   * in the caller - nullptr goes back to destroying them in the caller, after the bucket
+   * lock is released
+   *
+   */
+  void setReclaimer(Reclaimer<V>* deferred) {
+    reclaimer = deferred;
+  }
+
+  /**
+   * Changes the number of elements kept - lowering it evicts down to the new capacity
+   *
+   */
+  void setCapacity(long entries) {
+    capacity.store(entries, memory_order_relaxed);
+    while (cacheSize.load() > entries && evict()) {
+    }
+  }
+
+  long getCapacity() const {
+    return capacity.load(memory_order_relaxed);
+  }
+
+  /**
+   * Rebuilds every bucket into fresh storage, one stripe at a time, then releases the old
+   * node arena - hands memory left behind by removals and evictions back to the system
+   * Other operations only wait for the stripe being rebuilt - O(n)
+   *
+   */
+  void compact() {
+    scoped_lock<decltype(compactLock)> serialize(compactLock);
+    unique_ptr<NodeArena> fresh(new NodeArena(SHARED));
+    vector<pair<K, Entry>> entries;
+
+    for (long stripe = 0; stripe < numStripes; stripe++) {
+      scoped_lock<Lock> lock(stripeLocks[stripe]);
+      for (long i = stripe; i < numBuckets; i += numStripes) {
+        buckets[i].forEach([&](const K& key, Entry& entry) {
+          entries.emplace_back(key, move(entry));
+        });
+
+        buckets[i].~Storage<K, Entry>();
+        new (&buckets[i]) Storage<K, Entry>();
+        if constexpr (TakesArena<Storage<K, Entry>>::value) {
+          buckets[i].setArena(fresh.get());
+        }
+
+        for (auto& entry : entries) {
+          buckets[i].insert(entry.first, move(entry.second));
+        }
+        entries.clear();
+      }
+    }
+
+    // Every bucket now allocates from fresh, the old arena is unmapped
+    arena.swap(fresh);
+  }
+
+  /**
+   * Compresses the values the eviction policy finds cold (see its isCold) - returns how many
+   * Candidates are copied out under the stripe lock and compressed without it, then stored
+   * back if the entry did not change meanwhile. Lookups expand them again
+   *
+   */
+  long compressCold(milliseconds age) {
+    static_assert(IsTiered<V>::value, "compressCold needs a tiered value type such as TieredValue");
+
+    long compressed = 0;
+    vector<pair<K, V>> cold;
+    for (long i = 0; i < numBuckets; i++) {
+      {
+        scoped_lock<Lock> lock(lockFor(i));
+        buckets[i].forEach([&](const K& key, Entry& entry) {
+          if (entry.first.compressible() && eviction.isCold(entry.second, age)) {
+            cold.emplace_back(key, entry.first);
+          }
+        });
+      }
+      if (cold.empty()) {
+        continue;
+      }
+
+      vector<V> packed;
+      for (auto& candidate : cold) {
+        packed.push_back(candidate.second);
+        packed.back().compress();
+      }
+
+      scoped_lock<Lock> lock(lockFor(i));
+      for (size_t c = 0; c < cold.size(); c++) {
+        Entry* entry = buckets[i].find(cold[c].first);
+        if (entry && entry->first == cold[c].second) {
+          entry->first = move(packed[c]);
+          compressed += entry->first.compressed();
+        }
+      }
+      cold.clear();
+    }
+
+    return compressed;
+  }
+
+  /**
+   * Removes the victim chosen by the eviction policy
+   *
+   */
+  bool evict() {
+    K victim;
+    auto visitBucket = [this](long i, auto&& func) {
+      scoped_lock<Lock> lock(lockFor(i));
+      buckets[i].forEach([&](const K& key, Entry& entry) {
+        func(key, entry.second);
+      });
+    };
+
+    if (!eviction.selectVictim(numBuckets, visitBucket, victim)) {
+      return false;
+    }
+
+    return remove(victim);
+  }
+
+  /**
+   * Ordered range scan over from <= key <= to - needs an ordered bucket such as ArtBucket
+   * Each bucket yields its matches in order, the per-bucket runs are then merged
+   * A cache of one bucket (see SingleBucketHasher) walks its tree directly with no copy or
+   * merge, and func then runs under the bucket lock - it must not call back into the cache
+   *
+   */
+  template <typename F>
+  void scan(const K& from, const K& to, F&& func) {
+    if (numBuckets == 1) {
+      scoped_lock<Lock> lock(lockFor(0));
+      buckets[0].forEachInRange(from, to, [&](const K& key, const Entry& entry) {
+        func(key, entry.first);
+      });
+      return;
+    }
+
+    vector<pair<K, V>> entries;
+    vector<size_t> runs(1, 0);
+
+    for (long i = 0; i < numBuckets; i++) {
+      scoped_lock<Lock> lock(lockFor(i));
+      buckets[i].forEachInRange(from, to, [&](const K& key, const Entry& entry) {
+        entries.emplace_back(key, entry.first);
+      });
+
+      if (entries.size() != runs.back()) {
+        runs.push_back(entries.size());
+      }
+    }
+
+    auto byKey = [](const pair<K, V>& left, const pair<K, V>& right) {
+      return left.first < right.first;
+    };
+
+    // Pairwise merge of sorted runs - O(n log buckets)
+    for (size_t width = 1; width + 1 < runs.size(); width *= 2) {
+      for (size_t i = 0; i + width + 1 < runs.size(); i += 2 * width) {
+        size_t end = min(i + 2 * width, runs.size() - 1);
+        inplace_merge(entries.begin() + runs[i], entries.begin() + runs[i + width], entries.begin() + runs[end], byKey);
+      }
+    }
+
+    for (auto& entry : entries) {
+      func(entry.first, entry.second);
+    }
+  }
+};
+
+/**
+ * Background thread running a pass every interval until stopped, for owners whose
+ * start()/stop() run maintenance in the background. The pass runs without the worker's lock
+ * held, so stop() only waits for the pass in progress. Owners stop it before tearing down
+ * what the pass touches
+ *
+ */
+class PeriodicWorker {
+  milliseconds m_interval;
+  bool m_stop;
+  mutex m_lock;
+  condition_variable m_wake;
+  thread m_thread;
+
+public:
+  PeriodicWorker() : m_interval(1000), m_stop(true) {}
+
+  PeriodicWorker(const PeriodicWorker&) = delete;
+  PeriodicWorker& operator=(const PeriodicWorker&) = delete;
+
+  ~PeriodicWorker() {
+    stop();
+  }
+
+  /**
+   * Runs pass now and then every interval, replacing any pass already running
+   *
+   */
+  void start(milliseconds interval, function<void()> pass) {
+    stop();
+    m_interval = interval;
+    m_stop = false;
+    m_thread = thread([this, pass = move(pass)]() {
+      unique_lock<mutex> lock(m_lock);
+      while (!m_stop) {
+        lock.unlock();
+        pass();
+        lock.lock();
+        m_wake.wait_for(lock, m_interval, [this]() { return m_stop; });
+      }
+    });
+  }
+
+  void stop() {
+    {
+      scoped_lock<mutex> lock(m_lock);
+      m_stop = true;
+    }
+    m_wake.notify_all();
+    if (m_thread.joinable()) {
+      m_thread.join();
+    }
+  }
+};
+
+/**
+ * Shrinks caches while the cgroup is under memory pressure and regrows them once it eases
+ * Reads cgroup v2 memory.current, memory.max and memory.pressure (PSI) from cgroupDir,
+ * which may point at fake files
+ *
+ * Pressure means usage above HIGH_WATERMARK of memory.max, or "some avg10" above
+ * PSI_THRESHOLD percent. Each poll under pressure scales every watched cache's capacity
+ * by SHRINK_FACTOR down to MIN_SCALE of what it had when watched, evicts down to it and
+ * compacts it. Polls with usage below LOW_WATERMARK and little stall time raise the scale
+ * by GROW_STEP
+ *
+ */
+class MemoryMonitor {
+  static constexpr double HIGH_WATERMARK = 0.9;
+  static constexpr double LOW_WATERMARK = 0.75;
+  static constexpr double PSI_THRESHOLD = 10.0;
+  static constexpr double SHRINK_FACTOR = 0.75;
+  static constexpr double GROW_STEP = 0.125;
+  static constexpr double MIN_SCALE = 1.0 / 16;
+
+  struct Target {
+    long m_baseCapacity;
+    function<void(long)> m_setCapacity;
+    function<void()> m_compact;
+  };
+
+  string m_cgroupDir;
+
+  mutex m_lock;
+  vector<Target> m_targets;
+  double m_scale;
+
+  PeriodicWorker m_worker;
+
+  /**
+   * First number in file, -1 if it is missing or unlimited ("max")
+   *
+   */
+  long readValue(const char* name) const {
+    ifstream in(m_cgroupDir + "/" + name);
+    long value;
+    return (in >> value) ? value : -1;
+  }
+
+  /**
+   * avg10 of the "some" line of memory.pressure, 0 if unavailable
+   *
+   */
+  double readStall() const {
+    ifstream in(m_cgroupDir + "/memory.pressure");
+    string kind;
+    string field;
+    while (in >> kind >> field) {
+      if (kind == "some" && field.compare(0, 6, "avg10=") == 0) {
+        return atof(field.c_str() + 6);
+      }
+      in.ignore(numeric_limits<streamsize>::max(), '\n');
+    }
+    return 0;
+  }
+
+  void apply(bool shrinking) {
+    for (auto& target : m_targets) {
+      target.m_setCapacity(max(1L, (long) (target.m_baseCapacity * m_scale)));
+      if (shrinking) {
+        target.m_compact();
+      }
+    }
+  }
+
+public:
+  explicit MemoryMonitor(const string& cgroupDir = "/sys/fs/cgroup") : m_cgroupDir(cgroupDir), m_scale(1) {}
+
+  ~MemoryMonitor() {
+    stop();
+  }
+
+  /**
+   * Cache must outlive the monitor. Its current capacity is the one restored once pressure is gone
+   *
+   */
+  template <typename CacheType>
+  void watch(CacheType& cache) {
+    scoped_lock<mutex> lock(m_lock);
+    m_targets.push_back({cache.getCapacity(),
+                         [&cache](long entries) { cache.setCapacity(entries); },
+                         [&cache]() { cache.compact(); }});
+  }
+
+  /**
+   * One check - returns true while under pressure
+   *
+   */
+  bool poll() {
+    long current = readValue("memory.current");
+    long limit = readValue("memory.max");
+    double stall = readStall();
+    double usage = (current >= 0 && limit > 0) ? (double) current / limit : 0;
+
+    scoped_lock<mutex> lock(m_lock);
+    if (usage > HIGH_WATERMARK || stall > PSI_THRESHOLD) {
+      if (m_scale > MIN_SCALE) {
+        m_scale = max(MIN_SCALE, m_scale * SHRINK_FACTOR);
+        apply(true);
+      }
+      return true;
+    }
+
+    if (m_scale < 1 && usage < LOW_WATERMARK && stall < PSI_THRESHOLD / 2) {
+      m_scale = min(1.0, m_scale + GROW_STEP);
+      apply(false);
+    }
+    return false;
+  }
+
+  double scale() {
+    scoped_lock<mutex> lock(m_lock);
+    return m_scale;
+  }
+
+  /**
+   * Polls every interval on a background thread until stop()
+   *
+   */
+  void start(milliseconds interval = milliseconds(1000)) {
+    m_worker.start(interval, [this]() { poll(); });
+  }
+
+  void stop() {
+    m_worker.stop();
+  }
+};
+
+/**
+ * Background pass compressing a cache's cold values (see Cache::compressCold)
+ * The cache must hold a tiered value type and outlive the compressor. With ClockEviction an
+ * entry is cold when not looked up for a whole interval, so age is the interval there
+ *
+ */
+template <typename CacheType>
+class ColdCompressor {
+  CacheType& m_cache;
+  milliseconds m_age;
+  atomic<long> m_compressed;
+
+  PeriodicWorker m_worker;
+
+public:
+  ColdCompressor(CacheType& cache, milliseconds age) : m_cache(cache), m_age(age), m_compressed(0) {}
+
+  ~ColdCompressor() {
+    stop();
+  }
+
+  /**
+   * One pass over the cache - returns values compressed
+   *
+   */
+  long poll() {
+    long compressed = m_cache.compressCold(m_age);
+    m_compressed.fetch_add(compressed, memory_order_relaxed);
+    return compressed;
+  }
+
+  long compressedCount() const {
+    return m_compressed.load(memory_order_relaxed);
+  }
+
+  /**
+   * Polls every interval on a background thread until stop()
+   *
+   */
+  void start(milliseconds interval = milliseconds(1000)) {
+    m_worker.start(interval, [this]() { poll(); });
+  }
+
+  void stop() {
+    m_worker.stop();
+  }
+};
+
+/**
+ * Cache with flat combining for writes
+ * A writer that finds its stripe lock free applies its put/remove directly. Otherwise it
+ * publishes the request in its own record, flags it in the stripe's pending mask and keeps
+ * trying the lock. Whoever holds the lock applies every flagged request for that stripe
+ * before releasing it, so a hot bucket's data stays in the combiner's cache instead of
+ * moving with each writer, and waiters do not queue on the lock
+ * Lookups take the stripe lock as usual
+ *
+ * Only worth it when several cores write to one stripe at the same time. Otherwise the
+ * record and pending mask are extra work, and it runs a few percent slower than Cache
+ * (see benchHotBucketWrites)
+ *
+ */
+template <typename K,
+          typename V,
+          template <typename, typename> class Storage = TreeBucket,
+          typename Eviction = TimestampLRU,
+          typename Locking = MutexLocking,
+          typename Hasher = StdHasher<K>>
+class FlatCombiningCache : public Cache<K, V, Storage, Eviction, Locking, Hasher> {
+  typedef Cache<K, V, Storage, Eviction, Locking, Hasher> Base;
+  typedef typename Base::Lock Lock;
+
+  /**
+   * Threads past this many at once fall back to plain locked writes - one bit per record
+   * in a pending mask
+   *
+   */
+  static constexpr int MAX_COMBINERS = 64;
+
+  static constexpr int SPIN_LIMIT = 256;
+
+  // Drains of the pending mask per lock hold, bounding how long a combiner works for others
+  static constexpr int MAX_PASSES = 4;
+
+  struct alignas(64) Record {
+    atomic<bool> m_done;
+    bool m_result;
+    long m_bucket;
+    K m_key;
+    // Value to put, empty for a remove - moved into the bucket and cleared by the combiner
+    optional<V> m_val;
+    // Retired by the publishing thread once the combiner is done
+    optional<V> m_displaced;
+
+    Record() : m_done(false), m_result(false), m_bucket(0), m_key() {}
+  };
+
+  /**
+   * Records published on a stripe - set with a release fetch_or after the record is
+   * written, taken whole by the combiner with an acquire exchange
+   *
+   */
+  struct alignas(64) PendingMask {
+    atomic<uint64_t> m_bits{0};
+  };
+
+  unique_ptr<Record[]> records;
+
+  unique_ptr<PendingMask[]> pending;
+
+  // Record slots in use, shared by every instance of this type
+  static inline atomic<bool> slotTaken[MAX_COMBINERS];
+
+  /**
+   * Record slot of the calling thread, -1 while all are taken
+   * Claimed with a CAS on its flag and given back when the thread exits, so threads that
+   * come and go do not use the slots up
+   *
+   */
+  static int threadSlot() {
+    struct Claim {
+      int m_slot = -1;
+
+      ~Claim() {
+        if (m_slot >= 0) {
+          slotTaken[m_slot].store(false, memory_order_release);
+        }
+      }
+    };
+    static thread_local Claim claim;
+
+    for (int i = 0; claim.m_slot < 0 && i < MAX_COMBINERS; i++) {
+      bool expected = false;
+      if (!slotTaken[i].load(memory_order_relaxed) &&
+          slotTaken[i].compare_exchange_strong(expected, true, memory_order_acquire)) {
+        claim.m_slot = i;
+      }
+    }
+    return claim.m_slot;
+  }
+
+  /**
+   * Put of *val, or a remove when val is null - an rvalue T is moved into the bucket
+   *
+   */
+  template <typename T>
+  bool apply(long bucket, const K& key, T* val, optional<V>* displaced) {
+    return val ? this->putLocked(bucket, key, forward<T>(*val), displaced) : this->removeLocked(bucket, key, displaced);
+  }
+
+  /**
+   * Applies the requests flagged on stripe - called with that stripe's lock held
+   * Only flagged records are visited
+   *
+   */
+  void combine(long stripe) {
+    for (int pass = 0; pass < MAX_PASSES; pass++) {
+      // A plain load first keeps the uncontended path free of another locked instruction
+      if (!pending[stripe].m_bits.load(memory_order_relaxed)) {
+        return;
+      }
+
+      uint64_t bits = pending[stripe].m_bits.exchange(0, memory_order_acquire);
+
+      for (; bits; bits &= bits - 1) {
+        Record& record = records[__builtin_ctzll(bits)];
+        record.m_result = apply(record.m_bucket, record.m_key, record.m_val ? &*record.m_val : nullptr, &record.m_displaced);
+        record.m_val.reset();
+        record.m_done.store(true, memory_order_release);
+      }
+    }
+  }
+
+  template <typename T>
+  bool publish(long bucket, const K& key, T* val) {
+    long stripe = bucket % this->numStripes;
+    Lock& lock = this->lockFor(bucket);
+    // The slot is only needed once the lock turns out to be held
+    bool locked = lock.try_lock();
+    int slot = locked ? -1 : threadSlot();
+
+    if (locked || slot < 0) {
+      optional<V> displaced;
+      bool result;
+      {
+        if (!locked) {
+          lock.lock();
+        }
+        lock_guard<Lock> guard(lock, adopt_lock);
+        result = apply(bucket, key, val, &displaced);
+        combine(stripe);
+      }
+
+      this->retire(displaced);
+      return result;
+    }
+
+    Record& record = records[slot];
+    record.m_bucket = bucket;
+    record.m_key = key;
+    if (val) {
+      record.m_val.emplace(forward<T>(*val));
+    }
+    record.m_done.store(false, memory_order_relaxed);
+    pending[stripe].m_bits.fetch_or(1ull << slot, memory_order_release);
+
+    for (int spins = 0; !record.m_done.load(memory_order_acquire); spins++) {
+      if (lock.try_lock()) {
+        combine(stripe);
+        lock.unlock();
+      } else if (spins < SPIN_LIMIT) {
+        cpuRelax();
+      } else {
+        this_thread::yield();
+      }
+    }
+
+    this->retire(record.m_displaced);
+    return record.m_result;
+  }
+
+public:
+  FlatCombiningCache(long bucketCount = Base::NUM_BUCKETS, long stripeCount = Locking::STRIPES)
+      : Base(bucketCount, stripeCount), records(new Record[MAX_COMBINERS]), pending(new PendingMask[this->numStripes]) {}
+
+  bool put(const K& key, const V& val) {
+    if (this->cacheSize.fetch_add(1) >= this->capacity.load(memory_order_relaxed)) {
+      this->evict();
+    }
+
+    return publish(this->hashFunc(key), key, &val);
+  }
+
+  bool put(const K& key, V&& val) {
+    if (this->cacheSize.fetch_add(1) >= this->capacity.load(memory_order_relaxed)) {
+      this->evict();
+    }
+
+    return publish(this->hashFunc(key), key, &val);
+  }
+
+  bool remove(const K& key) {
+    return publish(this->hashFunc(key), key, (const V*) nullptr);
+  }
+};
+
+/**
+ * Cache for instances owned by a single thread - no atomics and no locks
+ * Shares the storage, eviction and hashing policies with the concurrent Cache
+ *
+ */
+template <typename K,
+          typename V,
+          template <typename, typename> class Storage = TreeBucket,
+          typename Eviction = TimestampLRU,
+          typename Hasher = StdHasher<K>>
+using LocalCache = Cache<K, V, Storage, Eviction, NoLocking, Hasher>;
+
+/**
+ * Cache for large numbers of small instances, e.g. one per tenant
+ * One lock guards the whole instance and the bucket array is allocated on the first put,
+ * starting at MIN_BUCKETS and doubling whenever the population passes LOAD_FACTOR entries
+ * per bucket - an empty instance is a few words and costs no allocation. The bucket array
+ * never shrinks
+ *
+ * Mutex may be SpinParkLock (4 bytes) or mutex
+ *
+ */
+template <typename K,
+          typename V,
+          template <typename, typename> class Storage = TreeBucket,
+          typename Eviction = TimestampLRU,
+          typename Mutex = SpinParkLock,
+          typename Hasher = StdHasher<K>>
+class CompactCache {
+  typedef typename Eviction::Meta Meta;
+  typedef pair<V, Meta> Entry;
+
+  static constexpr long MIN_BUCKETS = 4;
+  static constexpr long LOAD_FACTOR = 4;
+
+  unique_ptr<Storage<K, Entry>[]> buckets;
+  long numBuckets;
+  long cacheSize;
+  long capacity;
+
+  Mutex lock;
+  Eviction eviction;
+  Hasher hasher;
+
+  /**
+   * Moves every entry into twice as many buckets - O(n)
+   *
+   */
+  void grow() {
+    long count = numBuckets ? numBuckets * 2 : MIN_BUCKETS;
+    unique_ptr<Storage<K, Entry>[]> grown(new Storage<K, Entry>[count]);
+    for (long i = 0; i < numBuckets; i++) {
+      buckets[i].forEach([&](const K& key, Entry& entry) {
+        grown[hasher(key, count)].insert(key, move(entry));
+      });
+    }
+
+    buckets.swap(grown);
+    numBuckets = count;
+  }
+
+  bool removeLocked(const K& key, optional<V>& displaced) {
+    if (!buckets) {
+      return false;
+    }
+
+    Storage<K, Entry>& bucket = buckets[hasher(key, numBuckets)];
+    Entry* entry = bucket.find(key);
+    if (!entry) {
+      return false;
+    }
+
+    displaced.emplace(move(entry->first));
+    eviction.onRemove(entry->second);
+    bucket.remove(key);
+    cacheSize--;
+    return true;
+  }
+
+  bool evictLocked(K& victim, optional<V>& displaced) {
+    auto visitBucket = [this](long i, auto&& func) {
+      buckets[i].forEach([&](const K& key, Entry& entry) {
+        func(key, entry.second);
+      });
+    };
+
+    if (!eviction.selectVictim(numBuckets, visitBucket, victim)) {
+      return false;
+    }
+
+    return removeLocked(victim, displaced);
+  }
+
+public:
+  explicit CompactCache(long maxEntries = 1024) : numBuckets(0), cacheSize(0), capacity(maxEntries) {}
+
+  bool get(const K& key, V& val) {
+    scoped_lock<Mutex> guard(lock);
+    if (!buckets) {
+      return false;
+    }
+
+    Entry* entry = buckets[hasher(key, numBuckets)].find(key);
+    if (!entry) {
+      return false;
+    }
+
+    eviction.onAccess(entry->second);
+    val = entry->first;
+    return true;
+  }
+
+  bool put(const K& key, const V& val) {
+    // Overwritten values are destroyed once the lock is dropped
+    optional<V> displaced;
+    return put(key, val, displaced);
+  }
+
+  /**
+   * put that hands back the overwritten value, if any
+   *
+   */
+  bool put(const K& key, const V& val, optional<V>& displaced) {
+    // Evicted values are destroyed once the lock is dropped
+    K victim;
+    optional<V> evicted;
+
+    scoped_lock<Mutex> guard(lock);
+    if (buckets) {
+      Entry* existing = buckets[hasher(key, numBuckets)].find(key);
+      if (existing) {
+        displaced.emplace(move(existing->first));
+        existing->first = val;
+        eviction.onUpdate(existing->second);
+        return true;
+      }
+    }
+
+    if (cacheSize >= capacity) {
+      evictLocked(victim, evicted);
+    }
+
+    if (cacheSize >= numBuckets * LOAD_FACTOR) {
+      grow();
+    }
+
+    buckets[hasher(key, numBuckets)].insert(key, Entry(val, eviction.onInsert(key)));
+    cacheSize++;
+    return true;
+  }
+
+  bool remove(const K& key) {
+    optional<V> displaced;
+    return remove(key, displaced);
+  }
+
+  /**
+   * remove that hands back the removed value
+   *
+   */
+  bool remove(const K& key, optional<V>& displaced) {
+    scoped_lock<Mutex> guard(lock);
+    return removeLocked(key, displaced);
+  }
+
+  bool evict() {
+    K victim;
+    optional<V> displaced;
+    return evict(victim, displaced);
+  }
+
+  /**
+   * evict that hands back the victim's key and value
+   *
+   */
+  bool evict(K& victim, optional<V>& displaced) {
+    scoped_lock<Mutex> guard(lock);
+    return buckets && evictLocked(victim, displaced);
+  }
+
+  long size() {
+    scoped_lock<Mutex> guard(lock);
+    return cacheSize;
+  }
+};
+
+/**
+ * Sizing policy - bytes charged for an entry against a CacheGroup budget
+ * Strings are charged their heap capacity as well
+ *
+ */
+struct EntryBytes {
+  template <typename T>
+  static size_t of(const T&) {
+    return sizeof(T);
+  }
+
+  static size_t of(const string& str) {
+    return sizeof(string) + str.capacity();
+  }
+
+  static size_t of(const TieredValue& val) {
+    return sizeof(TieredValue) + val.stored().capacity();
+  }
+
+  template <typename K, typename V>
+  size_t operator()(const K& key, const V& val) const {
+    return of(key) + of(val);
+  }
+};
+
+/**
+ * Group of caches sharing one byte budget
+ * Members grow freely until the group is over budget, then entries are evicted from the
+ * member whose marginal hit rate per byte is lowest, so memory flows to the members
+ * that would turn it into hits
+ *
+ * The marginal hit rate is estimated from ghost hits - misses on keys the member recently
+ * evicted, remembered as hashes in a small direct mapped table. They count the hits
+ * the member would have had with a little more memory. Counts are halved every time the
+ * victim member is re-chosen, which happens every REPICK_EVICTIONS evictions
+ *
+ */
+template <typename K,
+          typename V,
+          template <typename, typename> class Storage = TreeBucket,
+          typename Eviction = TimestampLRU,
+          typename Sizer = EntryBytes>
+class CacheGroup {
+public:
+  class Member;
+
+private:
+  static constexpr long REPICK_EVICTIONS = 32;
+
+  size_t m_budget;
+  atomic<long> m_used;
+
+  // Guards m_members and m_victim, held while evicting
+  mutex m_lock;
+  vector<unique_ptr<Member>> m_members;
+  Member* m_victim;
+  long m_sinceRepick;
+
+  Sizer m_sizer;
+
+  /**
+   * Lowest ghost hits per byte among members holding data. Ties, such as members that have
+   * not been evicted from lately, go to the lower recent hit rate
+   * Called with m_lock held
+   *
+   */
+  Member* pickVictim() {
+    Member* victim = nullptr;
+    double victimScore = 0;
+    double victimHitRate = 0;
+    for (auto& member : m_members) {
+      long bytes = member->m_bytes.load(memory_order_relaxed);
+      long ghostHits = member->m_window[Member::GHOST_HITS].load(memory_order_relaxed);
+      long hits = member->m_window[Member::HITS].load(memory_order_relaxed);
+      long misses = member->m_window[Member::MISSES].load(memory_order_relaxed);
+      for (auto& count : member->m_window) {
+        count.store(count.load(memory_order_relaxed) / 2, memory_order_relaxed);
+      }
+
+      if (bytes <= 0) {
+        continue;
+      }
+
+      double score = (double) ghostHits / bytes;
+      double hitRate = (double) hits / (hits + misses + 1);
+      if (!victim || score < victimScore || (score == victimScore && hitRate < victimHitRate)) {
+        victim = member.get();
+        victimScore = score;
+        victimHitRate = hitRate;
+      }
+    }
+
+    return victim;
+  }
+
+  void charge(long delta) {
+    if (m_used.fetch_add(delta, memory_order_relaxed) + delta <= (long) m_budget) {
+      return;
+    }
+
+    scoped_lock<mutex> lock(m_lock);
+    while (m_used.load(memory_order_relaxed) > (long) m_budget) {
+      if (!m_victim || m_sinceRepick >= REPICK_EVICTIONS) {
+        m_victim = pickVictim();
+        m_sinceRepick = 0;
+      }
+
+      if (!m_victim) {
+        return;
+      }
+
+      if (!m_victim->evictOne()) {
+        // Emptied by concurrent removes - choose again
+        m_victim = nullptr;
+        continue;
+      }
+      m_sinceRepick++;
+    }
+  }
+
+public:
+  /**
+   * A cache in the group - use it like any other cache
+   *
+   */
+  class Member {
+    friend class CacheGroup;
+
+    static constexpr size_t GHOST_SLOTS = 64;
+
+    CacheGroup& m_group;
+    CompactCache<K, V, Storage, Eviction> m_cache;
+
+    atomic<long> m_bytes;
+    atomic<long> m_hits;
+    atomic<long> m_misses;
+
+    // Decaying counts the group picks victims by
+    enum { HITS, MISSES, GHOST_HITS, WINDOW_COUNTS };
+    atomic<long> m_window[WINDOW_COUNTS];
+
+    // Hashes of recently evicted keys, 0 marks an empty slot
+    atomic<size_t> m_ghosts[GHOST_SLOTS];
+
+    static size_t ghostHash(const K& key) {
+      return hash<K>()(key) | 1;
+    }
+
+    bool evictOne() {
+      K victim;
+      optional<V> evicted;
+      if (!m_cache.evict(victim, evicted)) {
+        return false;
+      }
+
+      size_t h = ghostHash(victim);
+      m_ghosts[h % GHOST_SLOTS].store(h, memory_order_relaxed);
+
+      long bytes = m_group.m_sizer(victim, *evicted);
+      m_bytes.fetch_sub(bytes, memory_order_relaxed);
+      m_group.m_used.fetch_sub(bytes, memory_order_relaxed);
+      return true;
+    }
+
+  public:
+    explicit Member(CacheGroup& group)
+        : m_group(group), m_cache(LONG_MAX), m_bytes(0), m_hits(0), m_misses(0) {
+      for (auto& count : m_window) {
+        count.store(0, memory_order_relaxed);
+      }
+      for (auto& ghost : m_ghosts) {
+        ghost.store(0, memory_order_relaxed);
+      }
+    }
+
+    bool get(const K& key, V& val) {
+      if (m_cache.get(key, val)) {
+        m_hits.fetch_add(1, memory_order_relaxed);
+        m_window[HITS].fetch_add(1, memory_order_relaxed);
+        return true;
+      }
+
+      m_misses.fetch_add(1, memory_order_relaxed);
+      m_window[MISSES].fetch_add(1, memory_order_relaxed);
+      size_t h = ghostHash(key);
+      if (m_ghosts[h % GHOST_SLOTS].load(memory_order_relaxed) == h) {
+        m_window[GHOST_HITS].fetch_add(1, memory_order_relaxed);
+      }
+      return false;
+    }
+
+    bool put(const K& key, const V& val) {
+      optional<V> displaced;
+      m_cache.put(key, val, displaced);
+
+      long delta = m_group.m_sizer(key, val);
+      if (displaced) {
+        delta -= m_group.m_sizer(key, *displaced);
+      }
+      m_bytes.fetch_add(delta, memory_order_relaxed);
+      m_group.charge(delta);
+      return true;
+    }
+
+    bool remove(const K& key) {
+      optional<V> displaced;
+      if (!m_cache.remove(key, displaced)) {
+        return false;
+      }
+
+      long bytes = m_group.m_sizer(key, *displaced);
+      m_bytes.fetch_sub(bytes, memory_order_relaxed);
+      m_group.m_used.fetch_sub(bytes, memory_order_relaxed);
+      return true;
+    }
+
+    long bytes() const {
+      return m_bytes.load(memory_order_relaxed);
+    }
+
+    long hits() const {
+      return m_hits.load(memory_order_relaxed);
+    }
+
+    long misses() const {
+      return m_misses.load(memory_order_relaxed);
+    }
+  };
+
+  explicit CacheGroup(size_t budgetBytes) : m_budget(budgetBytes), m_used(0), m_victim(nullptr), m_sinceRepick(0) {}
+
+  /**
+   * New member - it lives as long as the group
+   *
+   */
+  Member& addMember() {
+    scoped_lock<mutex> lock(m_lock);
+    m_members.emplace_back(new Member(*this));
+    return *m_members.back();
+  }
+
+  size_t usedBytes() const {
+    return max(0L, m_used.load(memory_order_relaxed));
+  }
+
+  size_t budgetBytes() const {
+    return m_budget;
+  }
+};
+
+/**
+ * Default hash for ValueTable - hash<V>, except that strings go through hashBytes
+ *
+ */
+template <typename V>
+struct ValueHash : hash<V> {};
+
+template <>
+struct ValueHash<string> {
+  size_t operator()(const string& val) const {
+    return hashBytes(val.data(), val.size());
+  }
+};
+
+/**
+ * Table of refcounted values, stored once per distinct content
+ * intern() hashes a value and returns a Ref to the table's copy - adding one if it is new.
+ * Use Ref as the value type of a cache to deduplicate entries:
+ *
+ *   ValueTable<string> table;
+ *   Cache<long, ValueTable<string>::Ref> cache;
+ *   cache.put(key, table.intern(fragment));
+ *
+ * The hash is taken before the stripe lock, which is then held for one bucket walk. A
+ * count only drops to 0 under the stripe lock, so intern() never revives a dying value
+ *
+ */
+template <typename V, typename ValueHasher = ValueHash<V>>
+class ValueTable {
+  static constexpr size_t STRIPES = 64;
+  static constexpr size_t MIN_BUCKETS = 16;
+
+  struct Node {
+    V m_val;
+    size_t m_hash;
+    long m_bytes;
+    atomic<long> m_refs;
+    ValueTable* m_table;
+    Node* m_next;
+
+    template <typename T>
+    Node(T&& val, size_t h, ValueTable* table)
+        : m_val(forward<T>(val)), m_hash(h), m_bytes(EntryBytes::of(m_val)), m_refs(1), m_table(table), m_next(nullptr) {}
+  };
+
+  struct alignas(64) Stripe {
+    mutex m_lock;
+    vector<Node*> m_buckets;
+    size_t m_count = 0;
+  };
+
+  unique_ptr<Stripe[]> m_stripes;
+  ValueHasher m_hasher;
+
+  // Only changed when a distinct value comes or goes - copying a Ref touches its node alone
+  atomic<long> m_unique;
+  atomic<long> m_storedBytes;
+
+  Stripe& stripeFor(size_t h) {
+    return m_stripes[h % STRIPES];
+  }
+
+  static size_t bucketFor(size_t h, size_t numBuckets) {
+    return (h / STRIPES) & (numBuckets - 1);
+  }
+
+  /**
+   * Doubles a stripe's buckets - O(n)
+   * Called with the stripe lock held
+   *
+   */
+  static void grow(Stripe& stripe) {
+    vector<Node*> grown(max(stripe.m_buckets.size() * 2, MIN_BUCKETS), nullptr);
+    for (Node* node : stripe.m_buckets) {
+      while (node) {
+        Node* next = node->m_next;
+        Node*& head = grown[bucketFor(node->m_hash, grown.size())];
+        node->m_next = head;
+        head = node;
+        node = next;
+      }
+    }
+    stripe.m_buckets.swap(grown);
+  }
+
+  /**
+   * Visits every stored value with its reference count, one stripe lock at a time
+   *
+   */
+  template <typename F>
+  void forEachNode(F&& func) const {
+    for (size_t i = 0; i < STRIPES; i++) {
+      scoped_lock<mutex> lock(m_stripes[i].m_lock);
+      for (const Node* node : m_stripes[i].m_buckets) {
+        for (; node; node = node->m_next) {
+          func(node, node->m_refs.load(memory_order_relaxed));
+        }
+      }
+    }
+  }
+
+  template <typename T>
+  Node* acquire(T&& val) {
+    size_t h = m_hasher(val);
+    Stripe& stripe = stripeFor(h);
+    scoped_lock<mutex> lock(stripe.m_lock);
+    if (!stripe.m_buckets.empty()) {
+      for (Node* node = stripe.m_buckets[bucketFor(h, stripe.m_buckets.size())]; node; node = node->m_next) {
+        if (node->m_hash == h && node->m_val == val) {
+          node->m_refs.fetch_add(1, memory_order_relaxed);
+          return node;
+        }
+      }
+    }
+
+    if (stripe.m_count >= stripe.m_buckets.size()) {
+      grow(stripe);
+    }
+    Node* node = new Node(forward<T>(val), h, this);
+    Node*& head = stripe.m_buckets[bucketFor(h, stripe.m_buckets.size())];
+    node->m_next = head;
+    head = node;
+    stripe.m_count++;
+
+    m_unique.fetch_add(1, memory_order_relaxed);
+    m_storedBytes.fetch_add(node->m_bytes, memory_order_relaxed);
+    return node;
+  }
+
+  void release(Node* node) {
+    // Drop a reference to a shared value without the lock
+    long refs = node->m_refs.load(memory_order_relaxed);
+    while (refs > 1) {
+      if (node->m_refs.compare_exchange_weak(refs, refs - 1, memory_order_release, memory_order_relaxed)) {
+        return;
+      }
+    }
+
+    Stripe& stripe = stripeFor(node->m_hash);
+    {
+      scoped_lock<mutex> lock(stripe.m_lock);
+      if (node->m_refs.fetch_sub(1, memory_order_acq_rel) > 1) {
+        // Interned again while we waited for the lock
+        return;
+      }
+
+      Node** link = &stripe.m_buckets[bucketFor(node->m_hash, stripe.m_buckets.size())];
+      while (*link != node) {
+        link = &(*link)->m_next;
+      }
+      *link = node->m_next;
+      stripe.m_count--;
+    }
+
+    m_unique.fetch_sub(1, memory_order_relaxed);
+    m_storedBytes.fetch_sub(node->m_bytes, memory_order_relaxed);
+    delete node;
+  }
+
+public:
+  /**
+   * Shared, immutable value - copies share the table's node
+   *
+   */
+  class Ref {
+    friend class ValueTable;
+
+    Node* m_node;
+
+    explicit Ref(Node* node) : m_node(node) {}
+
+  public:
+    Ref() : m_node(nullptr) {}
+
+    Ref(const Ref& other) : m_node(other.m_node) {
+      if (m_node) {
+        m_node->m_refs.fetch_add(1, memory_order_relaxed);
+      }
+    }
+
+    Ref(Ref&& other) noexcept : m_node(other.m_node) {
+      other.m_node = nullptr;
+    }
+
+    Ref& operator=(Ref other) noexcept {
+      swap(m_node, other.m_node);
+      return *this;
+    }
+
+    ~Ref() {
+      if (m_node) {
+        m_node->m_table->release(m_node);
+      }
+    }
+
+    const V& get() const {
+      return m_node->m_val;
+    }
+
+    const V& operator*() const {
+      return m_node->m_val;
+    }
+
+    const V* operator->() const {
+      return &m_node->m_val;
+    }
+
+    explicit operator bool() const {
+      return m_node != nullptr;
+    }
+  };
+
+  ValueTable() : m_stripes(new Stripe[STRIPES]), m_unique(0), m_storedBytes(0) {}
+
+  ValueTable(const ValueTable&) = delete;
+  ValueTable& operator=(const ValueTable&) = delete;
+
+  /**
+   * Every Ref must be gone by now
+   *
+   */
+  ~ValueTable() {
+    for (size_t i = 0; i < STRIPES; i++) {
+      for (Node* node : m_stripes[i].m_buckets) {
+        while (node) {
+          Node* next = node->m_next;
+          delete node;
+          node = next;
+        }
+      }
+    }
+  }
+
+  /**
+   * The value is only copied when the table has no equal one
+   *
+   */
+  Ref intern(const V& val) {
+    return Ref(acquire(val));
+  }
+
+  Ref intern(V&& val) {
+    return Ref(acquire(move(val)));
+  }
+
+  long uniqueValues() const {
+    return m_unique.load(memory_order_relaxed);
+  }
+
+  /**
+   * Refs alive - O(unique values), takes each stripe lock in turn
+   *
+   */
+  long references() const {
+    long refs = 0;
+    forEachNode([&](const Node* node, long nodeRefs) { refs += nodeRefs; });
+    return refs;
+  }
+
+  /**
+   * Bytes of the values the table holds, as EntryBytes counts them
+   *
+   */
+  long storedBytes() const {
+    return m_storedBytes.load(memory_order_relaxed);
+  }
+
+  /**
+   * Bytes a copy per reference would have taken on top of storedBytes()
+   * O(unique values), takes each stripe lock in turn
+   *
+   */
+  long savedBytes() const {
+    long saved = 0;
+    forEachNode([&](const Node* node, long nodeRefs) { saved += (nodeRefs - 1) * node->m_bytes; });
+    return saved;
+  }
+};
+
+/**
+ * Key bytes stored next to a slab value, so the mover can find an item's index entry
+ * Trivially copyable keys are stored as-is, strings as their characters
+ *
+ */
+template <typename K>
+struct SlabKey {
+  static_assert(is_trivially_copyable<K>::value, "slab keys must be trivially copyable or strings");
+
+  static size_t size(const K&) {
+    return sizeof(K);
+  }
+
+  static void write(char* dst, const K& key) {
+    memcpy(dst, &key, sizeof(K));
+  }
+
+  static K read(const char* src, size_t) {
+    K key;
+    memcpy(&key, src, sizeof(K));
+    return key;
+  }
+};
+
+template <>
+struct SlabKey<string> {
+  static size_t size(const string& key) {
+    return key.size();
+  }
+
+  static void write(char* dst, const string& key) {
+    memcpy(dst, key.data(), key.size());
+  }
+
+  static string read(const char* src, size_t len) {
+    return string(src, len);
+  }
+};
+
+/**
+ * Locked index of a byte-budgeted cache, mapping keys to where their bytes live
+ * One stripe - a mutex and a Storage bucket - per BYTES_PER_STRIPE of budget, at least
+ * MIN_STRIPES. Buckets that take an arena allocate nodes from the index's own, declared
+ * ahead of the stripes so it outlives them
+ *
+ */
+template <typename K, typename Ref, template <typename, typename> class Storage, typename Hasher>
+class StripedIndex {
+  static constexpr size_t BYTES_PER_STRIPE = 2048;
+  static constexpr size_t MIN_STRIPES = 64;
+
+public:
+  struct alignas(64) Stripe {
+    mutex m_lock;
+    Storage<K, Ref> m_bucket;
+  };
+
+private:
+  NodeArena m_arena;
+  size_t m_numStripes;
+  unique_ptr<Stripe[]> m_stripes;
+  Hasher m_hasher;
+
+public:
+  explicit StripedIndex(size_t budgetBytes)
+      : m_numStripes(max(budgetBytes / BYTES_PER_STRIPE, MIN_STRIPES)), m_stripes(new Stripe[m_numStripes]) {
+    if constexpr (TakesArena<Storage<K, Ref>>::value) {
+      for (size_t i = 0; i < m_numStripes; i++) {
+        m_stripes[i].m_bucket.setArena(&m_arena);
+      }
+    }
+  }
+
+  size_t size() const {
+    return m_numStripes;
+  }
+
+  Stripe& operator[](size_t i) {
+    return m_stripes[i];
+  }
+
+  Stripe& stripeFor(const K& key) {
+    return m_stripes[m_hasher(key, m_numStripes)];
+  }
+};
+
+/**
+ * Cache of variable size string values kept in size class slabs, memcached style
+ * Memory is a fixed set of PAGE_SIZE pages, each carved into equal slots for one size class.
+ * An item - lengths, key and value - goes in the smallest class it fits, so values never
+ * touch the heap. A class with no free slot takes a page from the pool, and once the pool
+ * is empty it evicts within the class by CLOCK
+ *
+ * maintain() - run every interval by a background mover after start(), or called directly -
+ * undoes what a shift in value sizes leaves behind:
+ *  - a page moves from the class with the fewest recent evictions per page to the class
+ *    with the most, migrating the page's live items to free slots of their class or evicting them
+ *  - a class with a page worth of free slots has its sparsest page emptied by migrating
+ *    items to its other pages, and the page goes back to the pool
+ *
+ * Lock order is stripe, size class, page pool. Whoever works from a slot rather than a key
+ * (eviction, the mover) reads the key under the class lock, drops it, takes the stripe and
+ * class locks and checks the index still points at the slot
+ *
+ */
+template <typename K,
+          template <typename, typename> class Storage = TreeBucket,
+          typename Hasher = StdHasher<K>>
+class SlabCache {
+public:
+  static constexpr size_t PAGE_SIZE = 64 << 10;
+
+  struct ClassStats {
+    size_t slotSize;
+    size_t pages;
+    size_t items;
+    size_t itemBytes;
+    long evictions;
+  };
+
+private:
+  static constexpr size_t MIN_SLOT = 64;
+  static constexpr double GROWTH = 1.25;
+  static constexpr uint32_t NO_PAGE = UINT32_MAX;
+  static constexpr int MAX_EVICT_ATTEMPTS = 8;
+
+  // Recent evictions a class needs before it is given a page
+  static constexpr long REBALANCE_EVICTIONS = 64;
+
+  // Slot states - a RESERVED slot is being written by a put and not yet in the index
+  enum : uint8_t { FREE = 0, LIVE = 1, REFERENCED = 2, RESERVED = 4 };
+
+  struct SlabItem {
+    uint32_t m_keyLen;
+    uint32_t m_valLen;
+  };
+
+  struct SlabRef {
+    uint32_t m_page;
+    uint32_t m_slot;
+  };
+
+  struct Page {
+    uint32_t m_class = 0;
+    uint32_t m_live = 0;
+    bool m_partial = false;     // listed in its class's m_partial
+    bool m_evacuating = false;  // being emptied, nothing is allocated from it
+    vector<uint16_t> m_free;
+    unique_ptr<atomic<uint8_t>[]> m_state;
+  };
+
+  struct SizeClass {
+    mutex m_lock;
+    size_t m_slotSize;
+    uint32_t m_slotsPerPage;
+    vector<uint32_t> m_pages;
+    vector<uint32_t> m_partial;  // pages with free slots
+    size_t m_items = 0;
+    size_t m_itemBytes = 0;
+    size_t m_hand = 0;           // CLOCK position over m_pages' slots
+    long m_evictions = 0;
+    atomic<long> m_recent{0};    // evictions and failed puts, halved by every maintain()
+  };
+
+  using Index = StripedIndex<K, SlabRef, Storage, Hasher>;
+  using Stripe = typename Index::Stripe;
+
+  char* m_memory;
+  uint32_t m_numPages;
+  unique_ptr<Page[]> m_pages;
+
+  mutex m_poolLock;
+  vector<uint32_t> m_freePages;
+  uint32_t m_untouched;  // pages from here on were never handed out
+
+  size_t m_numClasses;
+  unique_ptr<SizeClass[]> m_classes;
+
+  Index m_index;
+
+  mutex m_maintainLock;
+  atomic<long> m_migrated;
+
+  PeriodicWorker m_worker;
+
+  static size_t itemBytes(const char* slot) {
+    const SlabItem* item = (const SlabItem*) slot;
+    return sizeof(SlabItem) + item->m_keyLen + item->m_valLen;
+  }
+
+  static K keyAt(const char* slot) {
+    const SlabItem* item = (const SlabItem*) slot;
+    return SlabKey<K>::read(slot + sizeof(SlabItem), item->m_keyLen);
+  }
+
+  char* slotAddr(SlabRef ref, size_t slotSize) const {
+    return m_memory + (size_t) ref.m_page * PAGE_SIZE + ref.m_slot * slotSize;
+  }
+
+  Stripe& stripeFor(const K& key) {
+    return m_index.stripeFor(key);
+  }
+
+  long classFor(size_t bytes) const {
+    for (size_t i = 0; i < m_numClasses; i++) {
+      if (m_classes[i].m_slotSize >= bytes) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  bool linked(Stripe& stripe, const K& key, SlabRef ref) {
+    SlabRef* cur = stripe.m_bucket.find(key);
+    return cur && cur->m_page == ref.m_page && cur->m_slot == ref.m_slot;
+  }
+
+  uint32_t takePage() {
+    scoped_lock<mutex> lock(m_poolLock);
+    if (!m_freePages.empty()) {
+      uint32_t page = m_freePages.back();
+      m_freePages.pop_back();
+      return page;
+    }
+    return m_untouched < m_numPages ? m_untouched++ : NO_PAGE;
+  }
+
+  void releasePage(uint32_t page) {
+#ifdef __linux__
+    madvise(m_memory + (size_t) page * PAGE_SIZE, PAGE_SIZE, MADV_DONTNEED);
+#endif
+    scoped_lock<mutex> lock(m_poolLock);
+    m_freePages.push_back(page);
+  }
+
+  /**
+   * Carves page into slots of class idx
+   * Called with the class lock held
+   *
+   */
+  void assignPage(size_t idx, uint32_t page) {
+    SizeClass& cls = m_classes[idx];
+    Page& p = m_pages[page];
+    p.m_class = idx;
+    p.m_live = 0;
+    p.m_evacuating = false;
+    p.m_state.reset(new atomic<uint8_t>[cls.m_slotsPerPage]);
+    p.m_free.clear();
+    for (uint32_t slot = cls.m_slotsPerPage; slot-- > 0;) {
+      p.m_state[slot].store(FREE, memory_order_relaxed);
+      p.m_free.push_back(slot);
+    }
+
+    p.m_partial = true;
+    cls.m_partial.push_back(page);
+    cls.m_pages.push_back(page);
+  }
+
+  /**
+   * Takes an empty page away from its class
+   * Called with the class lock held
+   *
+   */
+  void detachPage(SizeClass& cls, uint32_t page) {
+    Page& p = m_pages[page];
+    cls.m_pages.erase(find(cls.m_pages.begin(), cls.m_pages.end(), page));
+    if (p.m_partial) {
+      cls.m_partial.erase(find(cls.m_partial.begin(), cls.m_partial.end(), page));
+    }
+    cls.m_hand = 0;
+
+    p.m_partial = false;
+    p.m_evacuating = false;
+    p.m_free = vector<uint16_t>();
+    p.m_state.reset();
+  }
+
+  /**
+   * Reserves a free slot for an item of bytes
+   * Called with the class lock held
+   *
+   */
+  bool allocSlot(SizeClass& cls, size_t bytes, SlabRef& ref) {
+    if (cls.m_partial.empty()) {
+      return false;
+    }
+
+    uint32_t page = cls.m_partial.back();
+    Page& p = m_pages[page];
+    ref.m_page = page;
+    ref.m_slot = p.m_free.back();
+    p.m_free.pop_back();
+    p.m_live++;
+    p.m_state[ref.m_slot].store(RESERVED, memory_order_relaxed);
+    if (p.m_free.empty()) {
+      p.m_partial = false;
+      cls.m_partial.pop_back();
+    }
+
+    cls.m_items++;
+    cls.m_itemBytes += bytes;
+    return true;
+  }
+
+  /**
+   * Called with the class lock held
+   *
+   */
+  void freeSlot(SizeClass& cls, SlabRef ref) {
+    Page& p = m_pages[ref.m_page];
+    cls.m_items--;
+    cls.m_itemBytes -= itemBytes(slotAddr(ref, cls.m_slotSize));
+    p.m_state[ref.m_slot].store(FREE, memory_order_relaxed);
+    p.m_free.push_back(ref.m_slot);
+    p.m_live--;
+    if (!p.m_partial && !p.m_evacuating) {
+      p.m_partial = true;
+      cls.m_partial.push_back(ref.m_page);
+    }
+  }
+
+  /**
+   * Frees an indexed item's slot
+   * Called with the item's stripe lock held, which keeps its page in its class
+   *
+   */
+  void release(SlabRef ref) {
+    SizeClass& cls = m_classes[m_pages[ref.m_page].m_class];
+    scoped_lock<mutex> lock(cls.m_lock);
+    freeSlot(cls, ref);
+  }
+
+  /**
+   * CLOCK over the class's slots - clears reference bits until it finds a live item without one
+   * Called with the class lock held
+   *
+   */
+  bool pickVictim(SizeClass& cls, SlabRef& victim) {
+    size_t total = cls.m_pages.size() * cls.m_slotsPerPage;
+    for (size_t step = 0; step < 2 * total; step++) {
+      if (cls.m_hand >= total) {
+        cls.m_hand = 0;
+      }
+      size_t pos = cls.m_hand++;
+      victim.m_page = cls.m_pages[pos / cls.m_slotsPerPage];
+      victim.m_slot = pos % cls.m_slotsPerPage;
+
+      Page& p = m_pages[victim.m_page];
+      if (p.m_evacuating) {
+        continue;
+      }
+      uint8_t state = p.m_state[victim.m_slot].fetch_and(~REFERENCED, memory_order_acquire);
+      if (state == LIVE) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Removes the item at ref if key is still indexed there
+   *
+   */
+  bool evictAt(SizeClass& cls, const K& key, SlabRef ref) {
+    Stripe& stripe = stripeFor(key);
+    scoped_lock<mutex> guard(stripe.m_lock);
+    scoped_lock<mutex> lock(cls.m_lock);
+    if (!linked(stripe, key, ref)) {
+      return false;
+    }
+
+    stripe.m_bucket.remove(key);
+    freeSlot(cls, ref);
+    cls.m_evictions++;
+    return true;
+  }
+
+  /**
+   * Free slot in class idx, taking a page from the pool or evicting if there is none
+   *
+   */
+  bool reserve(size_t idx, size_t bytes, SlabRef& ref) {
+    SizeClass& cls = m_classes[idx];
+    for (int attempt = 0; attempt < MAX_EVICT_ATTEMPTS; attempt++) {
+      SlabRef victim;
+      K victimKey;
+      {
+        scoped_lock<mutex> lock(cls.m_lock);
+        if (allocSlot(cls, bytes, ref)) {
+          return true;
+        }
+
+        uint32_t page = takePage();
+        if (page != NO_PAGE) {
+          assignPage(idx, page);
+          return allocSlot(cls, bytes, ref);
+        }
+
+        cls.m_recent.fetch_add(1, memory_order_relaxed);
+        if (!pickVictim(cls, victim)) {
+          // No page to evict from - the mover hands pages to classes under pressure
+          return false;
+        }
+        victimKey = keyAt(slotAddr(victim, cls.m_slotSize));
+      }
+      evictAt(cls, victimKey, victim);
+    }
+    return false;
+  }
+
+  /**
+   * Page of the class with the fewest live items
+   * Called with the class lock held
+   *
+   */
+  uint32_t sparsestPage(SizeClass& cls) {
+    uint32_t sparsest = NO_PAGE;
+    for (uint32_t page : cls.m_pages) {
+      if (!m_pages[page].m_evacuating && (sparsest == NO_PAGE || m_pages[page].m_live < m_pages[sparsest].m_live)) {
+        sparsest = page;
+      }
+    }
+    return sparsest;
+  }
+
+  /**
+   * Moves every item off page into other slots of its class, evicting those that do not
+   * fit when allowed. The page is detached once empty - false if it could not be emptied
+   *
+   */
+  bool evacuate(size_t idx, uint32_t page, bool allowEvict) {
+    SizeClass& cls = m_classes[idx];
+    vector<uint32_t> slots;
+    {
+      scoped_lock<mutex> lock(cls.m_lock);
+      Page& p = m_pages[page];
+      p.m_evacuating = true;
+      if (p.m_partial) {
+        p.m_partial = false;
+        cls.m_partial.erase(find(cls.m_partial.begin(), cls.m_partial.end(), page));
+      }
+      for (uint32_t slot = 0; slot < cls.m_slotsPerPage; slot++) {
+        if (p.m_state[slot].load(memory_order_relaxed) & LIVE) {
+          slots.push_back(slot);
+        }
+      }
+    }
+
+    for (uint32_t slot : slots) {
+      SlabRef from = {page, slot};
+      K key;
+      {
+        scoped_lock<mutex> lock(cls.m_lock);
+        if (!(m_pages[page].m_state[slot].load(memory_order_acquire) & LIVE)) {
+          continue;
+        }
+        key = keyAt(slotAddr(from, cls.m_slotSize));
+      }
+
+      Stripe& stripe = stripeFor(key);
+      scoped_lock<mutex> guard(stripe.m_lock);
+      scoped_lock<mutex> lock(cls.m_lock);
+      if (!linked(stripe, key, from)) {
+        continue;
+      }
+
+      char* src = slotAddr(from, cls.m_slotSize);
+      size_t bytes = itemBytes(src);
+      SlabRef to;
+      if (allocSlot(cls, bytes, to)) {
+        memcpy(slotAddr(to, cls.m_slotSize), src, bytes);
+        uint8_t referenced = m_pages[page].m_state[slot].load(memory_order_relaxed) & REFERENCED;
+        freeSlot(cls, from);
+        *stripe.m_bucket.find(key) = to;
+        m_pages[to.m_page].m_state[to.m_slot].store(LIVE | referenced, memory_order_release);
+        m_migrated.fetch_add(1, memory_order_relaxed);
+      } else if (allowEvict) {
+        stripe.m_bucket.remove(key);
+        freeSlot(cls, from);
+        cls.m_evictions++;
+      } else {
+        break;
+      }
+    }
+
+    scoped_lock<mutex> lock(cls.m_lock);
+    Page& p = m_pages[page];
+    if (p.m_live > 0) {
+      // Out of room, or a put is still writing a slot here
+      p.m_evacuating = false;
+      if (!p.m_free.empty()) {
+        p.m_partial = true;
+        cls.m_partial.push_back(page);
+      }
+      return false;
+    }
+
+    detachPage(cls, page);
+    return true;
+  }
+
+  /**
+   * Moves a page from the class with the fewest recent evictions per page to the one with the most
+   *
+   */
+  void rebalance() {
+    size_t to = m_numClasses;
+    size_t from = m_numClasses;
+    long most = 0;
+    long fewest = LONG_MAX;
+    for (size_t i = 0; i < m_numClasses; i++) {
+      SizeClass& cls = m_classes[i];
+      long recent = cls.m_recent.load(memory_order_relaxed);
+      cls.m_recent.store(recent / 2, memory_order_relaxed);
+
+      size_t pages;
+      {
+        scoped_lock<mutex> lock(cls.m_lock);
+        pages = cls.m_pages.size();
+      }
+
+      // Pressure is per page held, so a class is not robbed just for being small
+      long perPage = recent / (long) (pages + 1);
+      if (recent >= REBALANCE_EVICTIONS && perPage > most) {
+        most = perPage;
+        to = i;
+      }
+      if (pages > 0 && perPage < fewest) {
+        fewest = perPage;
+        from = i;
+      }
+    }
+
+    if (to == m_numClasses || from == m_numClasses || to == from || fewest * 4 > most) {
+      return;
+    }
+
+    uint32_t page;
+    {
+      scoped_lock<mutex> lock(m_classes[from].m_lock);
+      page = sparsestPage(m_classes[from]);
+    }
+    if (page == NO_PAGE || !evacuate(from, page, true)) {
+      return;
+    }
+
+    scoped_lock<mutex> lock(m_classes[to].m_lock);
+    assignPage(to, page);
+  }
+
+  /**
+   * Empties the sparsest page of class idx into its other pages if they have room for it,
+   * returning the page to the pool
+   *
+   */
+  bool compactClass(size_t idx) {
+    SizeClass& cls = m_classes[idx];
+    uint32_t page;
+    {
+      scoped_lock<mutex> lock(cls.m_lock);
+      size_t free = 0;
+      for (uint32_t owned : cls.m_pages) {
+        free += m_pages[owned].m_free.size();
+      }
+      if (free < cls.m_slotsPerPage) {
+        return false;
+      }
+      page = sparsestPage(cls);
+    }
+
+    if (page == NO_PAGE || !evacuate(idx, page, false)) {
+      return false;
+    }
+    releasePage(page);
+    return true;
+  }
+
+public:
+  /**
+   * budgetBytes of slab memory - the index is allocated on top of it
+   *
+   */
+  explicit SlabCache(size_t budgetBytes)
+      : m_numPages(max<size_t>(budgetBytes / PAGE_SIZE, 1)),
+        m_pages(new Page[m_numPages]),
+        m_untouched(0),
+        m_index(budgetBytes),
+        m_migrated(0) {
+#ifdef __linux__
+    void* mem = mmap(nullptr, (size_t) m_numPages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      throw bad_alloc();
+    }
+    m_memory = (char*) mem;
+#else
+    m_memory = new char[(size_t) m_numPages * PAGE_SIZE];
+#endif
+
+    // Slot sizes grow by GROWTH in 8 byte steps, the last class holds one item per page
+    vector<size_t> sizes;
+    for (double size = MIN_SLOT; size < PAGE_SIZE / 2; size *= GROWTH) {
+      size_t slotSize = ((size_t) size + 7) & ~(size_t) 7;
+      if (sizes.empty() || slotSize > sizes.back()) {
+        sizes.push_back(slotSize);
+      }
+    }
+    sizes.push_back(PAGE_SIZE);
+
+    m_numClasses = sizes.size();
+    m_classes.reset(new SizeClass[m_numClasses]);
+    for (size_t i = 0; i < m_numClasses; i++) {
+      m_classes[i].m_slotSize = sizes[i];
+      m_classes[i].m_slotsPerPage = PAGE_SIZE / sizes[i];
+    }
+  }
+
+  SlabCache(const SlabCache&) = delete;
+  SlabCache& operator=(const SlabCache&) = delete;
+
+  ~SlabCache() {
+    stop();
+#ifdef __linux__
+    munmap(m_memory, (size_t) m_numPages * PAGE_SIZE);
+#else
+    delete[] m_memory;
+#endif
+  }
+
+  bool get(const K& key, string& val) {
+    Stripe& stripe = stripeFor(key);
+    scoped_lock<mutex> guard(stripe.m_lock);
+    SlabRef* ref = stripe.m_bucket.find(key);
+    if (!ref) {
+      return false;
+    }
+
+    Page& page = m_pages[ref->m_page];
+    const char* slot = slotAddr(*ref, m_classes[page.m_class].m_slotSize);
+    const SlabItem* item = (const SlabItem*) slot;
+    val.assign(slot + sizeof(SlabItem) + item->m_keyLen, item->m_valLen);
+    page.m_state[ref->m_slot].fetch_or(REFERENCED, memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * False if the item is larger than a page or its class has no memory to evict from
+   *
+   */
+  bool put(const K& key, const string& val) {
+    size_t keyLen = SlabKey<K>::size(key);
+    size_t bytes = sizeof(SlabItem) + keyLen + val.size();
+    long idx = classFor(bytes);
+    SlabRef ref;
+    if (idx < 0 || !reserve(idx, bytes, ref)) {
+      return false;
+    }
+
+    // The slot is RESERVED, nobody else reads it until it is indexed
+    char* slot = slotAddr(ref, m_classes[idx].m_slotSize);
+    SlabItem* item = (SlabItem*) slot;
+    item->m_keyLen = keyLen;
+    item->m_valLen = val.size();
+    SlabKey<K>::write(slot + sizeof(SlabItem), key);
+    memcpy(slot + sizeof(SlabItem) + keyLen, val.data(), val.size());
+
+    Stripe& stripe = stripeFor(key);
+    scoped_lock<mutex> guard(stripe.m_lock);
+    SlabRef* old = stripe.m_bucket.find(key);
+    if (old) {
+      release(*old);
+      *old = ref;
+    } else {
+      stripe.m_bucket.insert(key, ref);
+    }
+    m_pages[ref.m_page].m_state[ref.m_slot].store(LIVE, memory_order_release);
+    return true;
+  }
+
+  bool remove(const K& key) {
+    Stripe& stripe = stripeFor(key);
+    scoped_lock<mutex> guard(stripe.m_lock);
+    SlabRef* ref = stripe.m_bucket.find(key);
+    if (!ref) {
+      return false;
+    }
+
+    release(*ref);
+    stripe.m_bucket.remove(key);
+    return true;
+  }
+
+  /**
+   * One mover pass - rebalance pages between classes, then compact every class
+   *
+   */
+  void maintain() {
+    scoped_lock<mutex> guard(m_maintainLock);
+    rebalance();
+    for (size_t i = 0; i < m_numClasses; i++) {
+      while (compactClass(i)) {
+      }
+    }
+  }
+
+  /**
+   * Runs maintain() every interval on a background thread until stop()
+   *
+   */
+  void start(milliseconds interval = milliseconds(1000)) {
+    m_worker.start(interval, [this]() { maintain(); });
+  }
+
+  void stop() {
+    m_worker.stop();
+  }
+
+  /**
+   * Per class usage for classes holding pages or items
+   *
+   */
+  vector<ClassStats> classStats() {
+    vector<ClassStats> stats;
+    for (size_t i = 0; i < m_numClasses; i++) {
+      SizeClass& cls = m_classes[i];
+      scoped_lock<mutex> lock(cls.m_lock);
+      if (!cls.m_pages.empty() || cls.m_evictions) {
+        stats.push_back({cls.m_slotSize, cls.m_pages.size(), cls.m_items, cls.m_itemBytes, cls.m_evictions});
+      }
+    }
+    return stats;
+  }
+
+  /**
+   * Share of the pages held by classes that is not item bytes - slot rounding plus free slots
+   *
+   */
+  double fragmentation() {
+    size_t held = 0;
+    size_t used = 0;
+    for (auto& stats : classStats()) {
+      held += stats.pages * PAGE_SIZE;
+      used += stats.itemBytes;
+    }
+    return held ? 1 - (double) used / held : 0;
+  }
+
+  size_t freePages() {
+    scoped_lock<mutex> lock(m_poolLock);
+    return m_freePages.size() + (m_numPages - m_untouched);
+  }
+
+  long migratedCount() const {
+    return m_migrated.load(memory_order_relaxed);
+  }
+};
+
+/**
+ * Cache of variable size string values appended to a log of large segments, RAMCloud style
+ * A put bumps a pointer in the head segment and writes its record - lengths, key, value -
+ * there, so entries cost their bytes rounded to 8 and a put never allocates. Overwrites and
+ * removes only leave dead bytes behind in the record's segment
+ *
+ * clean() - run every interval by a background cleaner after start(), or called directly -
+ * keeps free segments around by copying the live records out of the segments with the least
+ * live data into a survivor segment and freeing them. When a put finds no free segment it
+ * evicts the oldest segment whole
+ *
+ * Writers count themselves pending on a segment before reserving space in it, so a segment
+ * is only walked once it is sealed and nobody is still writing. Lock order is log, stripe,
+ * pool - records are relocated or dropped under their stripe lock, after checking the index
+ * still points at them
+ *
+ */
+template <typename K,
+          template <typename, typename> class Storage = TreeBucket,
+          typename Hasher = StdHasher<K>>
+class LogCache {
+public:
+  static constexpr size_t SEGMENT_SIZE = 256 << 10;
+
+private:
+  static constexpr uint32_t NO_SEGMENT = UINT32_MAX;
+
+  // Bump pointer of a segment that takes no more records
+  static constexpr uint64_t CLOSED = UINT64_MAX / 2;
+
+  // Free segments only the cleaner may take, so it can always make progress
+  static constexpr size_t CLEANER_RESERVE = 2;
+
+  // Free segments the cleaner keeps on top of its reserve
+  static constexpr size_t FREE_TARGET = 2;
+
+  // The cleaner leaves segments fuller than this alone
+  static constexpr double MAX_CLEAN_UTILIZATION = 0.9;
+
+  enum : uint8_t { FREE, HEAD, SURVIVOR, SEALED, CLEANING };
+
+  struct LogRecord {
+    uint32_t m_keyLen;
+    uint32_t m_valLen;
+  };
+
+  struct LogRef {
+    uint32_t m_segment;
+    uint32_t m_offset;
+  };
+
+  struct Segment {
+    atomic<uint64_t> m_used{CLOSED};
+    uint64_t m_end = 0;           // bytes of records, set when sealed
+    atomic<long> m_pending{0};    // puts that reserved space here and have not indexed it yet
+    atomic<long> m_live{0};
+    atomic<uint8_t> m_state{FREE};
+  };
+
+  using Index = StripedIndex<K, LogRef, Storage, Hasher>;
+  using Stripe = typename Index::Stripe;
+
+  char* m_memory;
+  uint32_t m_numSegments;
+  unique_ptr<Segment[]> m_segments;
+  atomic<uint32_t> m_head;
+
+  // Serializes moving the head
+  mutex m_logLock;
+
+  // Guards the free and sealed lists and m_survivor
+  mutex m_poolLock;
+  vector<uint32_t> m_free;
+  deque<uint32_t> m_sealed;  // oldest first
+  uint32_t m_survivor;
+
+  Index m_index;
+
+  mutex m_cleanLock;
+  atomic<long> m_cleaned;
+  atomic<long> m_evicted;
+
+  PeriodicWorker m_worker;
+
+  static size_t recordBytes(size_t keyLen, size_t valLen) {
+    return (sizeof(LogRecord) + keyLen + valLen + 7) & ~(size_t) 7;
+  }
+
+  static size_t recordBytes(const char* rec) {
+    const LogRecord* record = (const LogRecord*) rec;
+    return recordBytes(record->m_keyLen, record->m_valLen);
+  }
+
+  char* recordAddr(LogRef ref) const {
+    return m_memory + (size_t) ref.m_segment * SEGMENT_SIZE + ref.m_offset;
+  }
+
+  Stripe& stripeFor(const K& key) {
+    return m_index.stripeFor(key);
+  }
+
+  bool linked(Stripe& stripe, const K& key, LogRef ref) {
+    LogRef* cur = stripe.m_bucket.find(key);
+    return cur && cur->m_segment == ref.m_segment && cur->m_offset == ref.m_offset;
+  }
+
+  /**
+   * Bump allocation in segment - fails once the segment is full or closed
+   *
+   */
+  bool append(uint32_t segment, size_t bytes, LogRef& ref) {
+    Segment& seg = m_segments[segment];
+    uint64_t used = seg.m_used.load(memory_order_relaxed);
+    do {
+      if (used + bytes > SEGMENT_SIZE) {
+        return false;
+      }
+    } while (!seg.m_used.compare_exchange_weak(used, used + bytes));
+
+    ref.m_segment = segment;
+    ref.m_offset = used;
+    return true;
+  }
+
+  /**
+   * Called with m_poolLock held
+   *
+   */
+  uint32_t takeFree(bool cleaner) {
+    if (m_free.size() <= (cleaner ? 0 : CLEANER_RESERVE)) {
+      return NO_SEGMENT;
+    }
+    uint32_t segment = m_free.back();
+    m_free.pop_back();
+    return segment;
+  }
+
+  void open(uint32_t segment, uint8_t state) {
+    Segment& seg = m_segments[segment];
+    seg.m_live.store(0, memory_order_relaxed);
+    seg.m_state.store(state, memory_order_relaxed);
+    seg.m_used.store(0, memory_order_release);
+  }
+
+  /**
+   * Closes segment to new records and queues it for cleaning and eviction
+   * Called with m_poolLock held
+   *
+   */
+  void seal(uint32_t segment) {
+    Segment& seg = m_segments[segment];
+    seg.m_end = seg.m_used.exchange(CLOSED);
+    m_sealed.push_back(segment);
+    seg.m_state.store(SEALED, memory_order_release);
+  }
+
+  void release(uint32_t segment) {
+#ifdef __linux__
+    madvise(m_memory + (size_t) segment * SEGMENT_SIZE, SEGMENT_SIZE, MADV_DONTNEED);
+#endif
+    m_segments[segment].m_live.store(0, memory_order_relaxed);
+    m_segments[segment].m_state.store(FREE, memory_order_relaxed);
+    scoped_lock<mutex> lock(m_poolLock);
+    m_free.push_back(segment);
+  }
+
+  /**
+   * Claims a sealed segment for the caller to walk - false if the cleaner or an evicting
+   * put has it already
+   * Called with m_poolLock held
+   *
+   */
+  bool claim(uint32_t segment) {
+    uint8_t sealed = SEALED;
+    return m_segments[segment].m_state.compare_exchange_strong(sealed, CLEANING);
+  }
+
+  /**
+   * Visits every record of a claimed segment still in the index, with its stripe lock held
+   * Waits first for puts still writing into the segment
+   *
+   */
+  template <typename F>
+  void forEachLive(uint32_t segment, F&& func) {
+    Segment& seg = m_segments[segment];
+    while (seg.m_pending.load() > 0) {
+      this_thread::yield();
+    }
+
+    for (uint64_t offset = 0; offset < seg.m_end;) {
+      LogRef ref = {segment, (uint32_t) offset};
+      const char* rec = recordAddr(ref);
+      const LogRecord* record = (const LogRecord*) rec;
+      K key = SlabKey<K>::read(rec + sizeof(LogRecord), record->m_keyLen);
+      size_t bytes = recordBytes(rec);
+      offset += bytes;
+
+      Stripe& stripe = stripeFor(key);
+      scoped_lock<mutex> guard(stripe.m_lock);
+      if (linked(stripe, key, ref)) {
+        func(stripe, key, ref, bytes);
+      }
+    }
+  }
+
+  /**
+   * Drops the oldest sealed segment's records and hands the segment back
+   * Called with m_logLock held
+   *
+   */
+  uint32_t evictOldest() {
+    uint32_t victim = NO_SEGMENT;
+    {
+      scoped_lock<mutex> lock(m_poolLock);
+      for (auto it = m_sealed.begin(); it != m_sealed.end(); it++) {
+        if (claim(*it)) {
+          victim = *it;
+          m_sealed.erase(it);
+          break;
+        }
+      }
+    }
+    if (victim == NO_SEGMENT) {
+      return NO_SEGMENT;
+    }
+
+    forEachLive(victim, [&](Stripe& stripe, const K& key, LogRef, size_t) {
+      stripe.m_bucket.remove(key);
+    });
+    m_evicted.fetch_add(1, memory_order_relaxed);
+    return victim;
+  }
+
+  /**
+   * Replaces head with a fresh segment unless another put already did
+   *
+   */
+  bool roll(uint32_t head) {
+    scoped_lock<mutex> lock(m_logLock);
+    if (m_head.load(memory_order_relaxed) != head) {
+      return true;
+    }
+
+    uint32_t fresh;
+    {
+      scoped_lock<mutex> pool(m_poolLock);
+      fresh = takeFree(false);
+    }
+    if (fresh == NO_SEGMENT) {
+      fresh = evictOldest();
+    }
+    if (fresh == NO_SEGMENT) {
+      return false;
+    }
+
+    open(fresh, HEAD);
+    m_head.store(fresh, memory_order_release);
+    if (head != NO_SEGMENT) {
+      scoped_lock<mutex> pool(m_poolLock);
+      seal(head);
+    }
+    return true;
+  }
+
+  /**
+   * Space for a survivor record, sealing the survivor segment when it fills up
+   * Called by the cleaner with a stripe lock held
+   *
+   */
+  bool appendSurvivor(size_t bytes, LogRef& ref) {
+    scoped_lock<mutex> lock(m_poolLock);
+    if (m_survivor != NO_SEGMENT && append(m_survivor, bytes, ref)) {
+      return true;
+    }
+
+    uint32_t fresh = takeFree(true);
+    if (fresh == NO_SEGMENT) {
+      return false;
+    }
+    if (m_survivor != NO_SEGMENT) {
+      seal(m_survivor);
+    }
+    m_survivor = fresh;
+    open(fresh, SURVIVOR);
+    return append(fresh, bytes, ref);
+  }
+
+  /**
+   * Sealed segment with the least live data, claimed for cleaning, if it is worth cleaning
+   *
+   */
+  uint32_t pickVictim() {
+    scoped_lock<mutex> lock(m_poolLock);
+    auto victim = m_sealed.end();
+    long fewest = LONG_MAX;
+    for (auto it = m_sealed.begin(); it != m_sealed.end(); it++) {
+      long live = m_segments[*it].m_live.load(memory_order_relaxed);
+      if (live < fewest && m_segments[*it].m_state.load(memory_order_relaxed) == SEALED) {
+        fewest = live;
+        victim = it;
+      }
+    }
+
+    if (victim == m_sealed.end() || fewest > MAX_CLEAN_UTILIZATION * SEGMENT_SIZE || !claim(*victim)) {
+      return NO_SEGMENT;
+    }
+    uint32_t segment = *victim;
+    m_sealed.erase(victim);
+    return segment;
+  }
+
+  /**
+   * Copies victim's live records into the survivor segment - records that find no room
+   * are dropped - and frees it
+   *
+   */
+  void cleanSegment(uint32_t victim) {
+    forEachLive(victim, [&](Stripe& stripe, const K& key, LogRef from, size_t bytes) {
+      LogRef to;
+      if (appendSurvivor(bytes, to)) {
+        memcpy(recordAddr(to), recordAddr(from), bytes);
+        m_segments[to.m_segment].m_live.fetch_add(bytes, memory_order_relaxed);
+        *stripe.m_bucket.find(key) = to;
+      } else {
+        stripe.m_bucket.remove(key);
+      }
+    });
+    release(victim);
+    m_cleaned.fetch_add(1, memory_order_relaxed);
+  }
+
+public:
+  /**
+   * budgetBytes of log memory, at least CLEANER_RESERVE + 2 segments - the index is
+   * allocated on top of it
+   *
+   */
+  explicit LogCache(size_t budgetBytes)
+      : m_numSegments(max<size_t>(budgetBytes / SEGMENT_SIZE, CLEANER_RESERVE + 2)),
+        m_segments(new Segment[m_numSegments]),
+        m_head(NO_SEGMENT),
+        m_survivor(NO_SEGMENT),
+        m_index(budgetBytes),
+        m_cleaned(0),
+        m_evicted(0) {
+#ifdef __linux__
+    void* mem = mmap(nullptr, (size_t) m_numSegments * SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      throw bad_alloc();
+    }
+    m_memory = (char*) mem;
+#else
+    m_memory = new char[(size_t) m_numSegments * SEGMENT_SIZE];
+#endif
+
+    for (uint32_t segment = m_numSegments; segment-- > 0;) {
+      m_free.push_back(segment);
+    }
+  }
+
+  LogCache(const LogCache&) = delete;
+  LogCache& operator=(const LogCache&) = delete;
+
+  ~LogCache() {
+    stop();
+#ifdef __linux__
+    munmap(m_memory, (size_t) m_numSegments * SEGMENT_SIZE);
+#else
+    delete[] m_memory;
+#endif
+  }
+
+  bool get(const K& key, string& val) {
+    Stripe& stripe = stripeFor(key);
+    scoped_lock<mutex> guard(stripe.m_lock);
+    LogRef* ref = stripe.m_bucket.find(key);
+    if (!ref) {
+      return false;
+    }
+
+    const char* rec = recordAddr(*ref);
+    const LogRecord* record = (const LogRecord*) rec;
+    val.assign(rec + sizeof(LogRecord) + record->m_keyLen, record->m_valLen);
+    return true;
+  }
+
+  /**
+   * False if the record is larger than a segment or every segment is busy
+   *
+   */
+  bool put(const K& key, const string& val) {
+    size_t keyLen = SlabKey<K>::size(key);
+    size_t bytes = recordBytes(keyLen, val.size());
+    if (bytes > SEGMENT_SIZE) {
+      return false;
+    }
+
+    LogRef ref;
+    for (;;) {
+      uint32_t head = m_head.load(memory_order_acquire);
+      if (head != NO_SEGMENT) {
+        m_segments[head].m_pending.fetch_add(1);
+        if (append(head, bytes, ref)) {
+          break;
+        }
+        m_segments[head].m_pending.fetch_sub(1);
+      }
+      if (!roll(head)) {
+        return false;
+      }
+    }
+
+    char* rec = recordAddr(ref);
+    LogRecord* record = (LogRecord*) rec;
+    record->m_keyLen = keyLen;
+    record->m_valLen = val.size();
+    SlabKey<K>::write(rec + sizeof(LogRecord), key);
+    memcpy(rec + sizeof(LogRecord) + keyLen, val.data(), val.size());
+
+    {
+      Stripe& stripe = stripeFor(key);
+      scoped_lock<mutex> guard(stripe.m_lock);
+      LogRef* old = stripe.m_bucket.find(key);
+      if (old) {
+        m_segments[old->m_segment].m_live.fetch_sub(recordBytes(recordAddr(*old)), memory_order_relaxed);
+        *old = ref;
+      } else {
+        stripe.m_bucket.insert(key, ref);
+      }
+      m_segments[ref.m_segment].m_live.fetch_add(bytes, memory_order_relaxed);
+    }
+    m_segments[ref.m_segment].m_pending.fetch_sub(1);
+    return true;
+  }
+
+  bool remove(const K& key) {
+    Stripe& stripe = stripeFor(key);
+    scoped_lock<mutex> guard(stripe.m_lock);
+    LogRef* ref = stripe.m_bucket.find(key);
+    if (!ref) {
+      return false;
+    }
+
+    m_segments[ref->m_segment].m_live.fetch_sub(recordBytes(recordAddr(*ref)), memory_order_relaxed);
+    stripe.m_bucket.remove(key);
+    return true;
+  }
+
+  /**
+   * One cleaner pass - cleans the emptiest segments until FREE_TARGET segments are free
+   * or the rest are too full to be worth it
+   *
+   */
+  void clean() {
+    scoped_lock<mutex> guard(m_cleanLock);
+    for (;;) {
+      {
+        scoped_lock<mutex> lock(m_poolLock);
+        if (m_free.size() >= CLEANER_RESERVE + FREE_TARGET) {
+          return;
+        }
+      }
+
+      uint32_t victim = pickVictim();
+      if (victim == NO_SEGMENT) {
+        return;
+      }
+      cleanSegment(victim);
+    }
+  }
+
+  /**
+   * Runs clean() every interval on a background thread until stop()
+   *
+   */
+  void start(milliseconds interval = milliseconds(10)) {
+    m_worker.start(interval, [this]() { clean(); });
+  }
+
+  void stop() {
+    m_worker.stop();
+  }
+
+  /**
+   * Live record bytes over the bytes of segments in use
+   *
+   */
+  double utilization() {
+    scoped_lock<mutex> lock(m_poolLock);
+    size_t inUse = m_numSegments - m_free.size();
+    long live = 0;
+    for (uint32_t segment = 0; segment < m_numSegments; segment++) {
+      live += m_segments[segment].m_live.load(memory_order_relaxed);
+    }
+    return inUse ? (double) live / (inUse * SEGMENT_SIZE) : 0;
+  }
+
+  size_t freeSegments() {
+    scoped_lock<mutex> lock(m_poolLock);
+    return m_free.size();
+  }
+
+  long cleanedCount() const {
+    return m_cleaned.load(memory_order_relaxed);
+  }
+
+  long evictedCount() const {
+    return m_evicted.load(memory_order_relaxed);
+  }
+};
+
+/**
+ * Cache of string values with TTLs, kept in segments of entries with similar expiry -
+ * Segcache style
+ * TTLs are rounded down to one of TTL_BUCKETS bounds, four per doubling from MIN_TTL, and a
+ * put appends its record to the active segment of its TTL bucket. A record expires with the
+ * segment it was written to - at the segment's creation plus the bucket's TTL, so never late
+ * and at most about a fifth early - and keeps that expiry when a merge copies it. Segments
+ * in a bucket's chain expire oldest first
+ *
+ * Expired segments are dropped whole - the index is not walked. Index entries carry the
+ * segment's generation, which a drop bumps, so an entry left pointing at a dropped segment
+ * is recognized as stale, removed when it is next looked up or by the incremental sweep in
+ * expire(). Before dropped memory is reused every stripe lock is taken once, which waits
+ * out readers still copying from it
+ *
+ * A put that finds no free segment after expiring merges the oldest MERGE_SEGMENTS
+ * segments of a TTL bucket, chosen round robin, into one: entries read since they were
+ * written or last merged are copied while there is room, the rest are evicted. The merged
+ * segment is dropped when its youngest source would have been, and lookups check each
+ * record's own expiry until then
+ *
+ * Lock order is chain, stripe, pool
+ *
+ */
+template <typename K,
+          template <typename, typename> class Storage = TreeBucket,
+          typename Hasher = StdHasher<K>,
+          typename Clock = steady_clock>
+class SegCache {
+public:
+  static constexpr size_t SEGMENT_SIZE = 256 << 10;
+  static constexpr milliseconds MIN_TTL = milliseconds(64);
+
+private:
+  static constexpr size_t TTL_BUCKETS = 96;
+  static constexpr size_t NO_TTL = TTL_BUCKETS;
+  static constexpr uint32_t NO_SEGMENT = UINT32_MAX;
+  static constexpr uint64_t CLOSED = UINT64_MAX / 2;
+  static constexpr size_t MERGE_SEGMENTS = 4;
+
+  // Free segments only a merge may take
+  static constexpr size_t MERGE_RESERVE = 1;
+
+  // A bucket's active segment is replaced once it is this fraction of the bucket's TTL old
+  static constexpr long MAX_AGE_DIVISOR = 8;
+
+  // expire() sweeps this fraction of the stripes for stale index entries per call
+  static constexpr size_t SWEEP_DIVISOR = 16;
+
+  struct SegRecord {
+    uint16_t m_keyLen;
+    uint8_t m_freq;   // reads since written or merged - guarded by the key's stripe lock
+    uint8_t m_dead;   // space reserved by a put that lost its segment, skipped by merges
+    uint32_t m_valLen;
+    long m_expiry;    // Clock ticks - its segment's when written, kept through merges
+  };
+
+  struct SegRef {
+    uint64_t m_segment : 22;
+    uint64_t m_offset : 15;      // in 8 byte units
+    uint64_t m_generation : 27;
+  };
+
+  static constexpr uint32_t GENERATION_MASK = (1 << 27) - 1;
+
+  struct Segment {
+    atomic<uint64_t> m_used{CLOSED};
+    uint64_t m_end = 0;           // bytes of records, set when closed
+    atomic<long> m_pending{0};    // puts that reserved space here and have not indexed it yet
+    atomic<uint32_t> m_generation{0};
+    atomic<long> m_created{0};    // Clock ticks
+    atomic<long> m_expiry{0};
+  };
+
+  using Index = StripedIndex<K, SegRef, Storage, Hasher>;
+  using Stripe = typename Index::Stripe;
+
+  char* m_memory;
+  uint32_t m_numSegments;
+  unique_ptr<Segment[]> m_segments;
+
+  // TTL bound of every bucket, in Clock ticks
+  vector<long> m_bounds;
+
+  // Segments of each TTL bucket oldest first - the active one, if any, is last
+  mutex m_chainLock;
+  vector<deque<uint32_t>> m_chains;
+  unique_ptr<atomic<uint32_t>[]> m_active;
+  size_t m_mergeCursor;
+
+  mutex m_poolLock;
+  vector<uint32_t> m_free;
+
+  Index m_index;
+
+  atomic<size_t> m_sweepCursor;
+  atomic<long> m_expired;
+  atomic<long> m_merged;
+  atomic<long> m_evicted;
+  atomic<long> m_dropped;
+
+  PeriodicWorker m_worker;
+
+  static long ticks(typename Clock::time_point time) {
+    return time.time_since_epoch().count();
+  }
+
+  static size_t recordBytes(size_t keyLen, size_t valLen) {
+    return (sizeof(SegRecord) + keyLen + valLen + 7) & ~(size_t) 7;
+  }
+
+  static size_t recordBytes(const char* rec) {
+    const SegRecord* record = (const SegRecord*) rec;
+    return recordBytes(record->m_keyLen, record->m_valLen);
+  }
+
+  char* recordAddr(uint32_t segment, uint64_t offset) const {
+    return m_memory + (size_t) segment * SEGMENT_SIZE + offset;
+  }
+
+  char* recordAddr(SegRef ref) const {
+    return recordAddr(ref.m_segment, (uint64_t) ref.m_offset * 8);
+  }
+
+  SegRef makeRef(uint32_t segment, uint64_t offset) const {
+    SegRef ref;
+    ref.m_segment = segment;
+    ref.m_offset = offset / 8;
+    ref.m_generation = m_segments[segment].m_generation.load(memory_order_acquire) & GENERATION_MASK;
+    return ref;
+  }
+
+  Stripe& stripeFor(const K& key) {
+    return m_index.stripeFor(key);
+  }
+
+  /**
+   * Whether an index entry still points at a live record
+   * Called with the entry's stripe lock held
+   *
+   */
+  bool current(SegRef ref, long now) const {
+    const Segment& seg = m_segments[ref.m_segment];
+    return (seg.m_generation.load(memory_order_acquire) & GENERATION_MASK) == ref.m_generation &&
+           now < seg.m_expiry.load(memory_order_relaxed) && now < ((const SegRecord*) recordAddr(ref))->m_expiry;
+  }
+
+  bool linked(Stripe& stripe, const K& key, SegRef ref) {
+    SegRef* cur = stripe.m_bucket.find(key);
+    return cur && cur->m_segment == ref.m_segment && cur->m_offset == ref.m_offset &&
+           cur->m_generation == ref.m_generation;
+  }
+
+  long bucketFor(milliseconds ttl) const {
+    if (ttl.count() == 0) {
+      return NO_TTL;
+    }
+    long length = duration_cast<typename Clock::duration>(ttl).count();
+    auto above = upper_bound(m_bounds.begin(), m_bounds.end(), length);
+    return above == m_bounds.begin() ? -1 : above - m_bounds.begin() - 1;
+  }
+
+  long maxAge(size_t bucket) const {
+    return bucket == NO_TTL ? LONG_MAX : m_bounds[bucket] / MAX_AGE_DIVISOR;
+  }
+
+  bool append(uint32_t segment, size_t bytes, uint64_t& offset) {
+    Segment& seg = m_segments[segment];
+    uint64_t used = seg.m_used.load(memory_order_relaxed);
+    do {
+      if (used + bytes > SEGMENT_SIZE) {
+        return false;
+      }
+    } while (!seg.m_used.compare_exchange_weak(used, used + bytes));
+    offset = used;
+    return true;
+  }
+
+  uint32_t takeFree(bool merge) {
+    scoped_lock<mutex> lock(m_poolLock);
+    if (m_free.size() <= (merge ? 0 : MERGE_RESERVE)) {
+      return NO_SEGMENT;
+    }
+    uint32_t segment = m_free.back();
+    m_free.pop_back();
+    return segment;
+  }
+
+  void open(uint32_t segment, long created, long expiry) {
+    Segment& seg = m_segments[segment];
+    seg.m_created.store(created, memory_order_relaxed);
+    seg.m_expiry.store(expiry, memory_order_relaxed);
+    seg.m_used.store(0, memory_order_release);
+  }
+
+  void close(uint32_t segment) {
+    Segment& seg = m_segments[segment];
+    seg.m_end = seg.m_used.exchange(CLOSED);
+  }
+
+  void waitWriters(uint32_t segment) {
+    while (m_segments[segment].m_pending.load() > 0) {
+      this_thread::yield();
+    }
+  }
+
+  /**
+   * Frees closed segments whose entries may still be indexed - O(stripes), not O(entries)
+   * Called with m_chainLock held
+   *
+   */
+  void drop(const vector<uint32_t>& segments) {
+    if (segments.empty()) {
+      return;
+    }
+
+    for (uint32_t segment : segments) {
+      waitWriters(segment);
+      m_segments[segment].m_generation.fetch_add(1, memory_order_release);
+    }
+
+    // Readers that matched an old generation are done once each stripe has been released
+    for (size_t i = 0; i < m_index.size(); i++) {
+      scoped_lock<mutex> guard(m_index[i].m_lock);
+    }
+
+    for (uint32_t segment : segments) {
+#ifdef __linux__
+      madvise(m_memory + (size_t) segment * SEGMENT_SIZE, SEGMENT_SIZE, MADV_DONTNEED);
+#endif
+      scoped_lock<mutex> lock(m_poolLock);
+      m_free.push_back(segment);
+    }
+  }
+
+  /**
+   * Unlinks segments that have expired from their chains
+   * Called with m_chainLock held
+   *
+   */
+  void collectExpired(long now, vector<uint32_t>& expired) {
+    for (size_t bucket = 0; bucket <= NO_TTL; bucket++) {
+      auto& chain = m_chains[bucket];
+      while (!chain.empty() && m_segments[chain.front()].m_expiry.load(memory_order_relaxed) <= now) {
+        uint32_t segment = chain.front();
+        chain.pop_front();
+        uint32_t active = segment;
+        if (m_active[bucket].compare_exchange_strong(active, NO_SEGMENT)) {
+          close(segment);
+        }
+        expired.push_back(segment);
+      }
+    }
+  }
+
+  /**
+   * Merges the oldest closed segments of the next TTL bucket that has at least two, so at
+   * least one segment is freed. Without one, drops the oldest segment outright
+   * Called with m_chainLock held
+   *
+   */
+  void evictLocked() {
+    for (size_t step = 0; step <= NO_TTL; step++) {
+      size_t bucket = (m_mergeCursor + step) % (NO_TTL + 1);
+      auto& chain = m_chains[bucket];
+      size_t closed = chain.size() - (m_active[bucket].load(memory_order_relaxed) != NO_SEGMENT);
+      if (closed >= 2) {
+        m_mergeCursor = bucket + 1;
+        merge(bucket, min(closed, MERGE_SEGMENTS));
+        return;
+      }
+    }
+
+    size_t oldest = NO_TTL + 1;
+    for (size_t bucket = 0; bucket <= NO_TTL; bucket++) {
+      if (!m_chains[bucket].empty() &&
+          (oldest > NO_TTL || m_segments[m_chains[bucket].front()].m_created.load(memory_order_relaxed) <
+                                  m_segments[m_chains[oldest].front()].m_created.load(memory_order_relaxed))) {
+        oldest = bucket;
+      }
+    }
+    if (oldest > NO_TTL) {
+      return;
+    }
+
+    uint32_t segment = m_chains[oldest].front();
+    m_chains[oldest].pop_front();
+    uint32_t active = segment;
+    if (m_active[oldest].compare_exchange_strong(active, NO_SEGMENT)) {
+      close(segment);
+    }
+    m_dropped.fetch_add(1, memory_order_relaxed);
+    drop({segment});
+  }
+
+  /**
+   * Merges the count oldest segments of bucket into one that expires with the youngest
+   * Called with m_chainLock held
+   *
+   */
+  void merge(size_t bucket, size_t count) {
+    auto& chain = m_chains[bucket];
+    uint32_t dest = takeFree(true);
+    if (dest == NO_SEGMENT) {
+      return;
+    }
+    vector<uint32_t> sources(chain.begin(), chain.begin() + count);
+    long expiry = 0;
+    for (uint32_t segment : sources) {
+      expiry = max(expiry, m_segments[segment].m_expiry.load(memory_order_relaxed));
+    }
+    open(dest, m_segments[sources.front()].m_created.load(memory_order_relaxed), expiry);
+
+    for (uint32_t segment : sources) {
+      waitWriters(segment);
+      for (uint64_t offset = 0; offset < m_segments[segment].m_end;) {
+        char* src = recordAddr(segment, offset);
+        const SegRecord* record = (const SegRecord*) src;
+        size_t bytes = recordBytes(src);
+        SegRef from = makeRef(segment, offset);
+        offset += bytes;
+        if (record->m_dead) {
+          continue;
+        }
+
+        K key = SlabKey<K>::read(src + sizeof(SegRecord), record->m_keyLen);
+        Stripe& stripe = stripeFor(key);
+        scoped_lock<mutex> guard(stripe.m_lock);
+        if (!linked(stripe, key, from)) {
+          continue;
+        }
+
+        uint64_t to;
+        if (record->m_freq > 0 && append(dest, bytes, to)) {
+          memcpy(recordAddr(dest, to), src, bytes);
+          ((SegRecord*) recordAddr(dest, to))->m_freq = 0;
+          *stripe.m_bucket.find(key) = makeRef(dest, to);
+        } else {
+          stripe.m_bucket.remove(key);
+          m_evicted.fetch_add(1, memory_order_relaxed);
+        }
+      }
+    }
+    close(dest);
+
+    // Every source entry was moved or removed, nothing can read the sources any more
+    for (size_t i = 0; i < count; i++) {
+      chain.pop_front();
+    }
+    chain.push_front(dest);
+    for (uint32_t segment : sources) {
+      m_segments[segment].m_generation.fetch_add(1, memory_order_release);
+      scoped_lock<mutex> lock(m_poolLock);
+      m_free.push_back(segment);
+    }
+    m_merged.fetch_add(count - 1, memory_order_relaxed);
+  }
+
+  /**
+   * Replaces bucket's active segment unless another put already did
+   *
+   */
+  bool roll(size_t bucket, uint32_t head, long now) {
+    scoped_lock<mutex> lock(m_chainLock);
+    if (m_active[bucket].load(memory_order_relaxed) != head) {
+      return true;
+    }
+
+    uint32_t fresh = takeFree(false);
+    if (fresh == NO_SEGMENT) {
+      vector<uint32_t> expired;
+      collectExpired(now, expired);
+      m_expired.fetch_add(expired.size(), memory_order_relaxed);
+      drop(expired);
+      fresh = takeFree(false);
+    }
+    if (fresh == NO_SEGMENT) {
+      evictLocked();
+      fresh = takeFree(false);
+    }
+    if (fresh == NO_SEGMENT) {
+      return false;
+    }
+
+    long ttl = bucket == NO_TTL ? LONG_MAX - now : m_bounds[bucket];
+    open(fresh, now, now + ttl);
+    m_chains[bucket].push_back(fresh);
+    uint32_t old = m_active[bucket].exchange(fresh, memory_order_acq_rel);
+    if (old != NO_SEGMENT) {
+      close(old);
+    }
+    return true;
+  }
+
+public:
+  /**
+   * budgetBytes of segment memory, at least MERGE_RESERVE + 2 segments - the index is
+   * allocated on top of it
+   *
+   */
+  explicit SegCache(size_t budgetBytes)
+      : m_numSegments(max<size_t>(budgetBytes / SEGMENT_SIZE, MERGE_RESERVE + 2)),
+        m_segments(new Segment[m_numSegments]),
+        m_chains(NO_TTL + 1),
+        m_active(new atomic<uint32_t>[NO_TTL + 1]),
+        m_mergeCursor(0),
+        m_index(budgetBytes),
+        m_sweepCursor(0),
+        m_expired(0),
+        m_merged(0),
+        m_evicted(0),
+        m_dropped(0) {
+#ifdef __linux__
+    void* mem = mmap(nullptr, (size_t) m_numSegments * SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED) {
+      throw bad_alloc();
+    }
+    m_memory = (char*) mem;
+#else
+    m_memory = new char[(size_t) m_numSegments * SEGMENT_SIZE];
+#endif
+
+    long minTtl = duration_cast<typename Clock::duration>(MIN_TTL).count();
+    for (size_t i = 0; i < TTL_BUCKETS; i++) {
+      m_bounds.push_back((long) (minTtl * pow(2.0, i / 4.0)));
+    }
+
+    for (size_t bucket = 0; bucket <= NO_TTL; bucket++) {
+      m_active[bucket].store(NO_SEGMENT, memory_order_relaxed);
+    }
+    for (uint32_t segment = m_numSegments; segment-- > 0;) {
+      m_free.push_back(segment);
+    }
+  }
+
+  SegCache(const SegCache&) = delete;
+  SegCache& operator=(const SegCache&) = delete;
+
+  ~SegCache() {
+    stop();
+#ifdef __linux__
+    munmap(m_memory, (size_t) m_numSegments * SEGMENT_SIZE);
+#else
+    delete[] m_memory;
+#endif
+  }
+
+  bool get(const K& key, string& val) {
+    long now = ticks(Clock::now());
+    Stripe& stripe = stripeFor(key);
+    scoped_lock<mutex> guard(stripe.m_lock);
+    SegRef* ref = stripe.m_bucket.find(key);
+    if (!ref) {
+      return false;
+    }
+    if (!current(*ref, now)) {
+      stripe.m_bucket.remove(key);
+      return false;
+    }
+
+    char* rec = recordAddr(*ref);
+    SegRecord* record = (SegRecord*) rec;
+    val.assign(rec + sizeof(SegRecord) + record->m_keyLen, record->m_valLen);
+    if (record->m_freq < UINT8_MAX) {
+      record->m_freq++;
+    }
+    return true;
+  }
+
+  /**
+   * ttl of 0 never expires. False for TTLs under MIN_TTL, records larger than a segment
+   * and when nothing could be evicted
+   *
+   */
+  bool put(const K& key, const string& val, milliseconds ttl = milliseconds(0)) {
+    long bucket = bucketFor(ttl);
+    size_t keyLen = SlabKey<K>::size(key);
+    size_t bytes = recordBytes(keyLen, val.size());
+    if (bucket < 0 || keyLen > UINT16_MAX || bytes > SEGMENT_SIZE) {
+      return false;
+    }
+
+    long now = ticks(Clock::now());
+    uint32_t head;
+    uint64_t offset;
+    for (;;) {
+      head = m_active[bucket].load(memory_order_acquire);
+      if (head != NO_SEGMENT && now - m_segments[head].m_created.load(memory_order_relaxed) < maxAge(bucket)) {
+        Segment& seg = m_segments[head];
+        seg.m_pending.fetch_add(1);
+        if (append(head, bytes, offset)) {
+          if (m_active[bucket].load() == head) {
+            break;
+          }
+
+          // The segment was replaced and may now belong elsewhere - leave a dead record
+          SegRecord* dead = (SegRecord*) recordAddr(head, offset);
+          dead->m_keyLen = 0;
+          dead->m_dead = 1;
+          dead->m_valLen = bytes - sizeof(SegRecord);
+          seg.m_pending.fetch_sub(1);
+          continue;
+        }
+        seg.m_pending.fetch_sub(1);
+      }
+      if (!roll(bucket, head, now)) {
+        return false;
+      }
+    }
+
+    char* rec = recordAddr(head, offset);
+    SegRecord* record = (SegRecord*) rec;
+    record->m_keyLen = keyLen;
+    record->m_freq = 0;
+    record->m_dead = 0;
+    record->m_valLen = val.size();
+    record->m_expiry = m_segments[head].m_expiry.load(memory_order_relaxed);
+    SlabKey<K>::write(rec + sizeof(SegRecord), key);
+    memcpy(rec + sizeof(SegRecord) + keyLen, val.data(), val.size());
+
+    {
+      SegRef ref = makeRef(head, offset);
+      Stripe& stripe = stripeFor(key);
+      scoped_lock<mutex> guard(stripe.m_lock);
+      SegRef* old = stripe.m_bucket.find(key);
+      if (old) {
+        *old = ref;
+      } else {
+        stripe.m_bucket.insert(key, ref);
+      }
+    }
+    m_segments[head].m_pending.fetch_sub(1);
+    return true;
+  }
+
+  bool remove(const K& key) {
+    long now = ticks(Clock::now());
+    Stripe& stripe = stripeFor(key);
+    scoped_lock<mutex> guard(stripe.m_lock);
+    SegRef* ref = stripe.m_bucket.find(key);
+    if (!ref) {
+      return false;
+    }
+
+    bool live = current(*ref, now);
+    stripe.m_bucket.remove(key);
+    return live;
+  }
+
+  /**
+   * Drops expired segments and sweeps the next 1/SWEEP_DIVISOR of the stripes for stale index
+   * entries - returns the number of segments dropped
+   *
+   */
+  long expire() {
+    long now = ticks(Clock::now());
+    vector<uint32_t> expired;
+    {
+      scoped_lock<mutex> lock(m_chainLock);
+      collectExpired(now, expired);
+      drop(expired);
+    }
+    m_expired.fetch_add(expired.size(), memory_order_relaxed);
+
+    vector<K> stale;
+    for (size_t i = 0; i < m_index.size() / SWEEP_DIVISOR; i++) {
+      Stripe& stripe = m_index[m_sweepCursor.fetch_add(1, memory_order_relaxed) % m_index.size()];
+      scoped_lock<mutex> guard(stripe.m_lock);
+      stripe.m_bucket.forEach([&](const K& key, SegRef& ref) {
+        if (!current(ref, now)) {
+          stale.push_back(key);
+        }
+      });
+      for (auto& key : stale) {
+        stripe.m_bucket.remove(key);
+      }
+      stale.clear();
+    }
+    return expired.size();
+  }
+
+  /**
+   * Runs expire() every interval on a background thread until stop()
+   *
+   */
+  void start(milliseconds interval = milliseconds(1000)) {
+    m_worker.start(interval, [this]() { expire(); });
+  }
+
+  void stop() {
+    m_worker.stop();
+  }
+
+  size_t freeSegments() {
+    scoped_lock<mutex> lock(m_poolLock);
+    return m_free.size();
+  }
+
+  long expiredCount() const {
+    return m_expired.load(memory_order_relaxed);
+  }
+
+  /**
+   * Segments freed by merging
+   *
+   */
+  long mergedCount() const {
+    return m_merged.load(memory_order_relaxed);
+  }
+
+  /**
+   * Entries dropped by merges
+   *
+   */
+  long evictedCount() const {
+    return m_evicted.load(memory_order_relaxed);
+  }
+
+  /**
+   * Segments dropped whole for space when no TTL bucket had two to merge
+   *
+   */
+  long droppedCount() const {
+    return m_dropped.load(memory_order_relaxed);
+  }
+};
+
+/**
+ * Bounded single producer single consumer ring buffer
+ * Head and tail live on separate cache lines, each side caches the other's index
+ *
+ */
+template <typename T>
+class SpscQueue {
+  static constexpr size_t CACHE_LINE = 64;
+
+  vector<T> m_ring;
+  size_t m_mask;
+
+  // Consumer side
+  alignas(CACHE_LINE) atomic<size_t> m_head;
+  size_t m_cachedTail;
+
+  // Producer side
+  alignas(CACHE_LINE) atomic<size_t> m_tail;
+  size_t m_cachedHead;
+
+public:
+  /**
+   * Capacity is rounded up to a power of two
+   *
+   */
+  explicit SpscQueue(size_t capacity) : m_head(0), m_cachedTail(0), m_tail(0), m_cachedHead(0) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    m_ring.resize(size);
+    m_mask = size - 1;
+  }
+
+  bool tryPush(T&& item) {
+    size_t tail = m_tail.load(memory_order_relaxed);
+    if (tail - m_cachedHead == m_ring.size()) {
+      m_cachedHead = m_head.load(memory_order_acquire);
+      if (tail - m_cachedHead == m_ring.size()) {
+        return false;
+      }
+    }
+
+    m_ring[tail & m_mask] = move(item);
+    m_tail.store(tail + 1, memory_order_release);
+    return true;
+  }
+
+  /**
+   * Consumer side only
+   *
+   */
+  bool empty() const {
+    return m_head.load(memory_order_relaxed) == m_tail.load(memory_order_acquire);
+  }
+
+  bool tryPop(T& item) {
+    size_t head = m_head.load(memory_order_relaxed);
+    if (head == m_cachedTail) {
+      m_cachedTail = m_tail.load(memory_order_acquire);
+      if (head == m_cachedTail) {
+        return false;
+      }
+    }
+
+    item = move(m_ring[head & m_mask]);
+    m_head.store(head + 1, memory_order_release);
+    return true;
+  }
+};
+
+/**
+ * Shard per core router over LocalCache instances
+ * Shard i is owned by core i. Operations on a local key run directly, operations on a
+ * remote key are sent through the SPSC queue for (caller, owner) and complete a Ticket
+ * the caller owns. Callers keep several tickets in flight and only wait when they need
+ * a result, so owners drain requests in batches instead of one round trip per op
+ *
+ * Every participating core must call poll() from its event loop
+ *
+ */
+template <typename K,
+          typename V,
+          template <typename, typename> class Storage = TreeBucket,
+          typename Eviction = TimestampLRU,
+          typename Hasher = StdHasher<K>>
+class ShardRouter {
+  typedef LocalCache<K, V, Storage, Eviction, Hasher> Shard;
+
+  enum Op { GET, PUT, REMOVE };
+
+public:
+  /**
+   * Completion of one routed operation - owned by the caller, must stay in place until
+   * ready(). value() is the result of a get that returned true
+   *
+   */
+  class Ticket {
+    atomic<bool> m_done;
+    bool m_result;
+    V m_val;
+
+    friend class ShardRouter;
+
+  public:
+    Ticket() : m_done(true), m_result(false), m_val() {}
+
+    Ticket(const Ticket&) = delete;
+    Ticket& operator=(const Ticket&) = delete;
+
+    bool ready() const {
+      return m_done.load(memory_order_acquire);
+    }
+
+    bool result() const {
+      return m_result;
+    }
+
+    const V& value() const {
+      return m_val;
+    }
+  };
+
+private:
+  struct Message {
+    Op m_op;
+    K m_key;
+    V m_val;
+    Ticket* m_ticket;
+  };
+
+  static constexpr size_t QUEUE_CAPACITY = 1024;
+
+  /**
+   * Range the Hasher maps keys into before the shard is picked - a power of two so every
+   * hashing policy accepts it
+   *
+   */
+  static constexpr size_t SHARD_HASH_RANGE = size_t(1) << 32;
+
+  int numCores;
+  vector<unique_ptr<Shard>> shards;
+
+  /**
+   * queues[from * numCores + to] carries requests from core from to the owner core to
+   *
+   */
+  vector<unique_ptr<SpscQueue<Message>>> queues;
+
+  static bool apply(Shard& shard, Message& msg) {
+    switch (msg.m_op) {
+      case GET:
+        return shard.get(msg.m_key, msg.m_ticket->m_val);
+      case PUT:
+        return shard.put(msg.m_key, msg.m_val);
+      default:
+        return shard.remove(msg.m_key);
+    }
+  }
+
+  void route(int core, Op op, const K& key, const V* val, Ticket& ticket) {
+    Message msg{op, key, val ? *val : V(), &ticket};
+    int owner = shardFor(key);
+    if (owner == core) {
+      ticket.m_result = apply(*shards[core], msg);
+      ticket.m_done.store(true, memory_order_relaxed);
+      return;
+    }
+
+    ticket.m_done.store(false, memory_order_relaxed);
+    SpscQueue<Message>& queue = *queues[core * numCores + owner];
+
+    // Keep serving our own shard while the queue is full, two cores may be waiting on each other
+    while (!queue.tryPush(move(msg))) {
+      if (poll(core) == 0) {
+        this_thread::yield();
+      }
+    }
+  }
+
+public:
+  explicit ShardRouter(int cores) : numCores(cores) {
+    for (int i = 0; i < numCores; i++) {
+      shards.emplace_back(new Shard());
+    }
+
+    for (int i = 0; i < numCores * numCores; i++) {
+      queues.emplace_back(new SpscQueue<Message>(QUEUE_CAPACITY));
+    }
+  }
+
+  /**
+   * Owner core of a key - remixed so it stays independent of the shard's bucket hash
+   *
+   */
+  int shardFor(const K& key) const {
+    return mix64(Hasher()(key, SHARD_HASH_RANGE)) % numCores;
+  }
+
+  /**
+   * Asynchronous flavours - start the operation and return, ticket is ready once the
+   * owner core has applied it, which is immediately for a local key
+   *
+   */
+  void get(int core, const K& key, Ticket& ticket) {
+    route(core, GET, key, nullptr, ticket);
+  }
+
+  void put(int core, const K& key, const V& val, Ticket& ticket) {
+    route(core, PUT, key, &val, ticket);
+  }
+
+  void remove(int core, const K& key, Ticket& ticket) {
+    route(core, REMOVE, key, nullptr, ticket);
+  }
+
+  /**
+   * Serves core's shard until ticket is ready, returns its result
+   *
+   */
+  bool wait(int core, const Ticket& ticket) {
+    while (!ticket.ready()) {
+      if (poll(core) == 0) {
+        this_thread::yield();
+      }
+    }
+
+    return ticket.result();
+  }
+
+  bool get(int core, const K& key, V& val) {
+    Ticket ticket;
+    get(core, key, ticket);
+    if (!wait(core, ticket)) {
+      return false;
+    }
+
+    val = ticket.value();
+    return true;
+  }
+
+  bool put(int core, const K& key, const V& val) {
+    Ticket ticket;
+    put(core, key, val, ticket);
+    return wait(core, ticket);
+  }
+
+  bool remove(int core, const K& key) {
+    Ticket ticket;
+    remove(core, key, ticket);
+    return wait(core, ticket);
+  }
+
+  /**
+   * Serves requests sent to core's shard, returns the number handled
+   *
+   */
+  size_t poll(int core) {
+    size_t handled = 0;
+    Message msg;
+
+    for (int from = 0; from < numCores; from++) {
+      if (from == core) {
+        continue;
+      }
+
+      SpscQueue<Message>& queue = *queues[from * numCores + core];
+      while (queue.tryPop(msg)) {
+        msg.m_ticket->m_result = apply(*shards[core], msg);
+        msg.m_ticket->m_done.store(true, memory_order_release);
+        handled++;
+      }
+    }
+
+    return handled;
+  }
+};
+
+/**
+ * Delegation mode - every shard is owned by one thread and never locked
+ * Client threads connect() to get a handle with one SPSC ring per shard, submit
+ * get/put/remove into the ring of the owning shard, and are completed through a
+ * callback or a future. Owners drain their rings in batches, so a shard's data
+ * stays in its owner's cache instead of bouncing between every caller. An owner
+ * that finds its rings empty for a while parks until a client rings its doorbell
+ *
+ */
+template <typename K,
+          typename V,
+          template <typename, typename> class Storage = TreeBucket,
+          typename Eviction = TimestampLRU,
+          typename Hasher = StdHasher<K>>
+class DelegatedCache {
+  typedef LocalCache<K, V, Storage, Eviction, Hasher> Shard;
+
+public:
+  /**
+   * Completion - runs on the owner thread with the result and, for get, the value
+   *
+   */
+  typedef function<void(bool, const V&)> Callback;
+
+private:
+  enum Op { GET, PUT, REMOVE };
+
+  struct Message {
+    Op m_op;
+    K m_key;
+    V m_val;
+    Callback m_done;
+  };
+
+  static constexpr size_t QUEUE_CAPACITY = 1024;
+  static constexpr size_t BATCH_SIZE = 32;
+
+  // Empty passes an owner yields through before it parks
+  static constexpr int IDLE_PASSES = 64;
+
+  // Range the Hasher maps keys into before the shard is picked, see ShardRouter
+  static constexpr size_t SHARD_HASH_RANGE = size_t(1) << 32;
+
+  int numShards;
+  int maxClients;
+  vector<unique_ptr<Shard>> shards;
+  unique_ptr<Doorbell[]> doorbells;
+
+  /**
+   * rings[client * numShards + shard] - allocated by connect() before the client is published
+   * and kept when the client disconnects, the next client given that id reuses them
+   *
+   */
+  vector<unique_ptr<SpscQueue<Message>>> rings;
+  atomic<int> numClients;
+  vector<int> freeIds;
+  mutex connectLock;
+
+  vector<thread> owners;
+  atomic<bool> stopping;
+
+  static bool apply(Shard& shard, Message& msg) {
+    switch (msg.m_op) {
+      case GET:
+        return shard.get(msg.m_key, msg.m_val);
+      case PUT:
+        return shard.put(msg.m_key, msg.m_val);
+      default:
+        return shard.remove(msg.m_key);
+    }
+  }
+
+  bool idle(int shard) const {
+    int clients = numClients.load(memory_order_acquire);
+    for (int client = 0; client < clients; client++) {
+      if (!rings[client * numShards + shard]->empty()) {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /**
+   * Owner loop - drains up to BATCH_SIZE requests per client ring, applies them back to
+   * back, then runs their completions. Once stopping, keeps going until a pass finds
+   * every ring empty, so no queued request is dropped
+   *
+   */
+  void serve(int shard) {
+    Message batch[BATCH_SIZE];
+    bool results[BATCH_SIZE];
+    int idlePasses = 0;
+
+    while (true) {
+      bool stop = stopping.load(memory_order_acquire);
+      size_t handled = 0;
+      int clients = numClients.load(memory_order_acquire);
+
+      for (int client = 0; client < clients; client++) {
+        SpscQueue<Message>& ring = *rings[client * numShards + shard];
+        size_t count = 0;
+        while (count < BATCH_SIZE && ring.tryPop(batch[count])) {
+          count++;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+          results[i] = apply(*shards[shard], batch[i]);
+        }
+
+        for (size_t i = 0; i < count; i++) {
+          if (batch[i].m_done) {
+            batch[i].m_done(results[i], batch[i].m_val);
+          }
+          batch[i].m_done = nullptr;
+        }
+
+        handled += count;
+      }
+
+      if (handled > 0) {
+        idlePasses = 0;
+      } else if (stop) {
+        return;
+      } else if (++idlePasses < IDLE_PASSES) {
+        this_thread::yield();
+      } else {
+        doorbells[shard].park([&]() { return idle(shard); }, [&]() { return stopping.load(memory_order_relaxed); });
+        idlePasses = 0;
+      }
+    }
+  }
+
+  void disconnect(int id) {
+    scoped_lock<mutex> lock(connectLock);
+    freeIds.push_back(id);
+  }
+
+public:
+  /**
+   * Submission handle - must only be used by the thread that called connect() and must
+   * not outlive the cache. Destroying it gives its id back for the next connect()
+   *
+   */
+  class Client {
+    DelegatedCache* cache;
+    int id;
+
+    friend class DelegatedCache;
+
+    Client(DelegatedCache* owner, int clientId) : cache(owner), id(clientId) {}
+
+    void submit(Message&& msg) {
+      int shard = cache->shardFor(msg.m_key);
+      SpscQueue<Message>& ring = *cache->rings[id * cache->numShards + shard];
+      while (!ring.tryPush(move(msg))) {
+        cache->doorbells[shard].ring();
+        this_thread::yield();
+      }
+      cache->doorbells[shard].ring();
+    }
+
+  public:
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    ~Client() {
+      cache->disconnect(id);
+    }
+
+    void get(const K& key, Callback done) {
+      submit(Message{GET, key, V(), move(done)});
+    }
+
+    void put(const K& key, const V& val, Callback done = nullptr) {
+      submit(Message{PUT, key, val, move(done)});
+    }
+
+    void remove(const K& key, Callback done = nullptr) {
+      submit(Message{REMOVE, key, V(), move(done)});
+    }
+
+    /**
+     * Future flavours - the value is only meaningful when the flag is true
+     *
+     */
+    future<pair<bool, V>> getAsync(const K& key) {
+      auto result = make_shared<promise<pair<bool, V>>>();
+      future<pair<bool, V>> reply = result->get_future();
+      get(key, [result](bool found, const V& val) {
+        result->set_value(pair<bool, V>(found, val));
+      });
+      return reply;
+    }
+
+    future<bool> putAsync(const K& key, const V& val) {
+      auto result = make_shared<promise<bool>>();
+      future<bool> reply = result->get_future();
+      put(key, val, [result](bool done, const V&) {
+        result->set_value(done);
+      });
+      return reply;
+    }
+
+    future<bool> removeAsync(const K& key) {
+      auto result = make_shared<promise<bool>>();
+      future<bool> reply = result->get_future();
+      remove(key, [result](bool done, const V&) {
+        result->set_value(done);
+      });
+      return reply;
+    }
+  };
+
+  DelegatedCache(int shardCount, int clientLimit)
+      : numShards(shardCount), maxClients(clientLimit), doorbells(new Doorbell[shardCount]), numClients(0), stopping(false) {
+    for (int i = 0; i < numShards; i++) {
+      shards.emplace_back(new Shard());
+    }
+
+    rings.resize(maxClients * numShards);
+
+    for (int i = 0; i < numShards; i++) {
+      owners.emplace_back(&DelegatedCache::serve, this, i);
+    }
+  }
+
+  /**
+   * Owners finish every request already queued, so pending futures are fulfilled
+   * Clients must not submit once destruction has started
+   *
+   */
+  ~DelegatedCache() {
+    stopping.store(true, memory_order_release);
+    for (int i = 0; i < numShards; i++) {
+      doorbells[i].wake();
+    }
+
+    for (auto& owner : owners) {
+      owner.join();
+    }
+  }
+
+  /**
+   * Registers a client thread, returns nullptr while clientLimit handles are out
+   *
+   */
+  unique_ptr<Client> connect() {
+    scoped_lock<mutex> lock(connectLock);
+    if (!freeIds.empty()) {
+      int id = freeIds.back();
+      freeIds.pop_back();
+      return unique_ptr<Client>(new Client(this, id));
+    }
+
+    int id = numClients.load(memory_order_relaxed);
+    if (id >= maxClients) {
+      return nullptr;
+    }
+
+    for (int shard = 0; shard < numShards; shard++) {
+      rings[id * numShards + shard].reset(new SpscQueue<Message>(QUEUE_CAPACITY));
+    }
+
+    numClients.store(id + 1, memory_order_release);
+    return unique_ptr<Client>(new Client(this, id));
+  }
+
+  int shardFor(const K& key) const {
+    return mix64(Hasher()(key, SHARD_HASH_RANGE)) % numShards;
+  }
+};
+
+// TEST PROGRAM
+
+#define MAX_ELEMENTS        1024
+#define MAX_THREADS         4
+#define ELEMENTS_PER_THREAD MAX_ELEMENTS/MAX_THREADS
+
+struct Element {
+  int val1;
+  char val2;
+  int val3;
+
+  Element () : val1(0), val2('\0'), val3(0) {}
+  Element (int in_val1, char in_val2, int in_val3) : val1(in_val1), val2(in_val2), val3(in_val3) {}
+};
+
+// BENCHMARKS - run with ./hashcache bench
+
+#define BENCH_OPS  2000000
+#define BENCH_KEYS 768
+
+/**
+ * xorshift64 - keeps rand() and its lock out of the timed loops
+ *
+ */
+static inline uint64_t benchRand(uint64_t& state) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+/**
+ * Delete-heavy mix - 40% get, 30% put, 30% remove
+ * Key range stays below CACHE_SIZE so eviction does not dominate the timing
+ *
+ */
+template <template <typename, typename> class Bucket>
+void benchDeleteHeavy(const char* name) {
+  unique_ptr<Cache<long, long, Bucket>> cache(new Cache<long, long, Bucket>());
+  uint64_t state = 88172645463325252ULL;
+
+  for (long i = 0; i < BENCH_KEYS; i += 2) {
+    cache->put(i, i);
+  }
+
+  long hits = 0;
+  auto start = steady_clock::now();
+  for (long i = 0; i < BENCH_OPS; i++) {
+    uint64_t r = benchRand(state);
+    long key = (r >> 8) % BENCH_KEYS;
+    long val;
+    switch (r % 10) {
+      case 0: case 1: case 2: case 3:
+        hits += cache->get(key, val);
+        break;
+      case 4: case 5: case 6:
+        cache->put(key, i);
+        break;
+      default:
+        cache->remove(key);
+        break;
+    }
+  }
+  auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  cout << name << ": " << (double) elapsed / BENCH_OPS << " ns/op, " << hits << " hits" << endl;
+}
+
+/**
+ * Ordered scans of SCAN_KEYS keys - ArtBuckets behind a hash, merged on every scan, versus
+ * a single ArtBucket tree walked in place
+ *
+ */
+#define SCAN_KEYS 1000
+
+template <typename Hasher>
+void benchScan(const char* name, long bucketCount) {
+  typedef Cache<long, long, ArtBucket, ClockEviction, MutexLocking, Hasher> CacheType;
+  unique_ptr<CacheType> cache(new CacheType(bucketCount));
+  for (long i = 0; i < SCAN_KEYS; i++) {
+    cache->put(i, i);
+  }
+
+  long rounds = BENCH_OPS / SCAN_KEYS;
+  long sum = 0;
+  auto start = steady_clock::now();
+  for (long r = 0; r < rounds; r++) {
+    cache->scan(0, SCAN_KEYS - 1, [&](const long&, const long& val) { sum += val; });
+  }
+  auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  cout << name << ": " << (double) elapsed / rounds << " ns/scan, " << (double) elapsed / (rounds * SCAN_KEYS)
+       << " ns/key, sum " << sum << endl;
+}
+
+/**
+ * Read-mostly mix with eviction - 90% get, 10% put over twice CACHE_SIZE keys
+ *
+ */
+template <typename CacheType>
+void benchReadMostly(const char* name) {
+  unique_ptr<CacheType> cache(new CacheType());
+  uint64_t state = 88172645463325252ULL;
+  long ops = BENCH_OPS / 10;
+
+  long hits = 0;
+  auto start = steady_clock::now();
+  for (long i = 0; i < ops; i++) {
+    uint64_t r = benchRand(state);
+    long key = (r >> 8) % 2048;
+    long val;
+    if (r % 10 == 0 || !cache->get(key, val)) {
+      cache->put(key, i);
+    } else {
+      hits++;
+    }
+  }
+  auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  cout << name << ": " << (double) elapsed / ops << " ns/op, " << hits << " hits" << endl;
+}
+
+/**
+ * Thread per core - MAX_THREADS cores, 90% get / 10% put, through a ShardRouter with
+ * pipelined tickets versus every thread sharing one locked Cache
+ *
+ */
+void benchThreadPerCore() {
+  long ops = BENCH_OPS / 10;
+  auto mix = [&](int tid, long count, auto&& get, auto&& put) {
+    uint64_t state = 88172645463325252ULL + tid;
+    for (long i = 0; i < count; i++) {
+      uint64_t r = benchRand(state);
+      long key = (r >> 8) % BENCH_KEYS;
+      long val;
+      if (r % 10 == 0) {
+        put(key, i);
+      } else {
+        get(key, val);
+      }
+    }
+  };
+
+  // Each core keeps up to ROUTER_WINDOW operations in flight, reusing the oldest ticket
+  typedef ShardRouter<long, long> Router;
+  static constexpr int ROUTER_WINDOW = 256;
+  Router router(MAX_THREADS);
+  atomic<int> finished(0);
+  vector<thread> threads;
+  auto start = steady_clock::now();
+  for (int tid = 0; tid < MAX_THREADS; tid++) {
+    threads.emplace_back([&, tid]() {
+      unique_ptr<Router::Ticket[]> tickets(new Router::Ticket[ROUTER_WINDOW]);
+      long issued = 0;
+      auto next = [&]() -> Router::Ticket& {
+        Router::Ticket& ticket = tickets[issued++ % ROUTER_WINDOW];
+        router.wait(tid, ticket);
+        return ticket;
+      };
+      mix(tid, ops / MAX_THREADS,
+          [&](long key, long&) { router.get(tid, key, next()); },
+          [&](long key, long val) { router.put(tid, key, val, next()); });
+
+      for (int i = 0; i < ROUTER_WINDOW; i++) {
+        router.wait(tid, tickets[i]);
+      }
+
+      // Keep serving our shard until every core is done
+      finished++;
+      while (finished.load() < MAX_THREADS) {
+        if (router.poll(tid) == 0) {
+          this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+  cout << "  ShardRouter  : " << (double) elapsed / ops << " ns/op" << endl;
+
+  unique_ptr<Cache<long, long>> shared(new Cache<long, long>());
+  threads.clear();
+  start = steady_clock::now();
+  for (int tid = 0; tid < MAX_THREADS; tid++) {
+    threads.emplace_back([&, tid]() {
+      mix(tid, ops / MAX_THREADS,
+          [&](long key, long& val) { shared->get(key, val); },
+          [&](long key, long val) { shared->put(key, val); });
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+  cout << "  Shared Cache : " << (double) elapsed / ops << " ns/op" << endl;
+
+  // Same thread count as above - half the threads own shards, the other half submit
+  unique_ptr<DelegatedCache<long, long>> delegated(new DelegatedCache<long, long>(MAX_THREADS / 2, MAX_THREADS / 2));
+  threads.clear();
+  start = steady_clock::now();
+  for (int tid = 0; tid < MAX_THREADS / 2; tid++) {
+    threads.emplace_back([&, tid]() {
+      auto client = delegated->connect();
+      atomic<long> completed(0);
+      long submitted = 0;
+      auto done = [&](bool, const long&) { completed.fetch_add(1, memory_order_relaxed); };
+      mix(tid, ops / (MAX_THREADS / 2),
+          [&](long key, long&) { client->get(key, done); submitted++; },
+          [&](long key, long val) { client->put(key, val, done); submitted++; });
+
+      while (completed.load() < submitted) {
+        this_thread::yield();
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+  cout << "  Delegated    : " << (double) elapsed / ops << " ns/op" << endl;
+}
+
+/**
+ * False sharing - every thread reads its own key, so the threads hit adjacent buckets and
+ * adjacent lock stripes but never the same one. A get writes nothing shared except its
+ * stripe lock (CLOCK only sets the reference bit once), so lock placement is the only
+ * difference between the two runs. Needs one core per thread to show anything
+ *
+ */
+template <typename Locking>
+void benchAdjacentStripes(const char* name) {
+  typedef Cache<long, long, TreeBucket, ClockEviction, Locking> CacheType;
+  unique_ptr<CacheType> cache(new CacheType());
+  long ops = BENCH_OPS * 2;
+  for (long key = 0; key < MAX_THREADS; key++) {
+    cache->put(key, key);
+  }
+
+  vector<thread> threads;
+  atomic<long> found(0);
+  auto start = steady_clock::now();
+  for (int tid = 0; tid < MAX_THREADS; tid++) {
+    threads.emplace_back([&, tid]() {
+      long hits = 0;
+      long val;
+      for (long i = 0; i < ops / MAX_THREADS; i++) {
+        hits += cache->get(tid, val);
+      }
+      found += hits;
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  cout << name << ": " << (double) elapsed / ops << " ns/op, " << sizeof(typename Locking::Lock) << " bytes per lock, "
+       << found << " hits" << endl;
+}
+
+/**
+ * Contention - every thread works on the same few keys of a single bucket
+ *
+ */
+template <typename Locking>
+void benchContention(const char* name) {
+  typedef Cache<long, long, TreeBucket, ClockEviction, Locking> CacheType;
+  unique_ptr<CacheType> cache(new CacheType());
+  long ops = BENCH_OPS / 10;
+
+  vector<thread> threads;
+  auto start = steady_clock::now();
+  for (int tid = 0; tid < MAX_THREADS; tid++) {
+    threads.emplace_back([&, tid]() {
+      uint64_t state = 88172645463325252ULL + tid;
+      for (long i = 0; i < ops / MAX_THREADS; i++) {
+        uint64_t r = benchRand(state);
+        // Multiples of the bucket count all hash to bucket 0
+        long key = ((r >> 8) % 4) * 1024;
+        long val;
+        if (r % 4 == 0) {
+          cache->put(key, i);
+        } else {
+          cache->get(key, val);
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  cout << name << ": " << (double) elapsed / ops << " ns/op" << endl;
+}
+
+/**
+ * Hot bucket writes - every thread puts to the same few keys of a single bucket
+ *
+ */
+template <typename CacheType>
+void benchHotBucketWrites(const char* name) {
+  unique_ptr<CacheType> cache(new CacheType());
+  long ops = BENCH_OPS / 10;
+
+  vector<thread> threads;
+  auto start = steady_clock::now();
+  for (int tid = 0; tid < MAX_THREADS; tid++) {
+    threads.emplace_back([&, tid]() {
+      uint64_t state = 88172645463325252ULL + tid;
+      for (long i = 0; i < ops / MAX_THREADS; i++) {
+        uint64_t r = benchRand(state);
+        long key = ((r >> 8) % 8) * 1024;
+        if (r % 4 == 0) {
+          cache->remove(key);
+        } else {
+          cache->put(key, i);
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  cout << name << ": " << (double) elapsed / ops << " ns/op" << endl;
+}
+
+/**
+ * Skewed lookups - 95% get / 5% update of ZIPF_KEYS keys drawn with a Zipf exponent,
+ * spread over ZIPF_BUCKETS buckets so each bucket is a deep tree. Exponent 0 is uniform
+ *
+ */
+#define ZIPF_KEYS    1000
+#define ZIPF_BUCKETS 4
+
+template <template <typename, typename> class Bucket>
+void benchZipf(const char* name, double exponent) {
+  typedef Cache<long, long, Bucket, ClockEviction> CacheType;
+  unique_ptr<CacheType> cache(new CacheType(ZIPF_BUCKETS));
+  uint64_t state = 88172645463325252ULL;
+
+  // Hot ranks map to scattered key values, not to the smallest keys
+  vector<long> keys(ZIPF_KEYS);
+  vector<double> cdf(ZIPF_KEYS);
+  double total = 0;
+  for (int rank = 0; rank < ZIPF_KEYS; rank++) {
+    keys[rank] = benchRand(state) % 1000000;
+    total += 1.0 / pow(rank + 1, exponent);
+    cdf[rank] = total;
+  }
+  for (auto& key : keys) {
+    cache->put(key, key);
+  }
+
+  long ops = BENCH_OPS / 2;
+  long hits = 0;
+  auto start = steady_clock::now();
+  for (long i = 0; i < ops; i++) {
+    uint64_t r = benchRand(state);
+    double u = (double) (r >> 11) / (1ULL << 53) * total;
+    long key = keys[lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin()];
+    long val;
+    if (r % 20 == 0) {
+      cache->put(key, i);
+    } else {
+      hits += cache->get(key, val);
+    }
+  }
+  auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  cout << name << ": " << (double) elapsed / ops << " ns/op, " << hits << " hits" << endl;
+}
+
+/**
+ * Bulk hashing of 64 bit keys to bucket indices, one key at a time versus hashBatch, over
+ * a block that stays in L1 so the kernels are timed rather than memory bandwidth.
+ * Then keyed lookups through get versus getBatch, on a table that fits in cache and on
+ * one of BENCH_OPS keys probed in random order, where the prefetches have misses to hide
+ *
+ */
+void benchBatchHashing() {
+  const long HASH_BLOCK = 1024;
+  vector<long> keys(BENCH_OPS);
+  vector<long> bucketOf(BENCH_OPS);
+  uint64_t state = 88172645463325252ULL;
+  for (auto& key : keys) {
+    key = benchRand(state);
+  }
+
+  auto timeHash = [&](const char* name, auto&& hashBlock) {
+    auto start = steady_clock::now();
+    for (long base = 0; base < BENCH_OPS; base += HASH_BLOCK) {
+      hashBlock();
+      // Keep the compiler from hoisting the loop invariant block out of the loop
+      asm volatile("" ::: "memory");
+    }
+    auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+    long sum = 0;
+    for (long i = 0; i < HASH_BLOCK; i++) {
+      sum += bucketOf[i];
+    }
+    cout << name << ": " << (double) elapsed / BENCH_OPS << " ns/key, checksum " << sum << endl;
+  };
+
+  StdHasher<long> stdHasher;
+  MultiplyShiftHasher<long> mulShift;
+  timeHash("  StdHasher          ", [&]() {
+    for (long i = 0; i < HASH_BLOCK; i++) {
+      bucketOf[i] = stdHasher(keys[i], 1000);
+    }
+  });
+  timeHash("  MultiplyShift      ", [&]() {
+    for (long i = 0; i < HASH_BLOCK; i++) {
+      bucketOf[i] = mulShift(keys[i], 1000);
+    }
+  });
+  timeHash("  MultiplyShift batch", [&]() {
+    mulShift.hashBatch(keys.data(), HASH_BLOCK, 1000, bucketOf.data());
+  });
+
+  typedef Cache<long, long, TreeBucket, ClockEviction, MutexLocking, MultiplyShiftHasher<long>> CacheType;
+  unique_ptr<long[]> vals(new long[BENCH_OPS]);
+  unique_ptr<bool[]> found(new bool[BENCH_OPS]);
+
+  auto timeLookups = [&](const char* name, CacheType& cache, long numKeys) {
+    // Every key is looked up BENCH_OPS / numKeys times either way
+    long rounds = BENCH_OPS / numKeys;
+    long hits = 0;
+    auto start = steady_clock::now();
+    for (long r = 0; r < rounds; r++) {
+      for (long i = 0; i < numKeys; i++) {
+        hits += cache.get(keys[i], vals[i]);
+      }
+    }
+    auto elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    cout << "  get      " << name << ": " << (double) elapsed / (rounds * numKeys) << " ns/op, " << hits << " hits" << endl;
+
+    hits = 0;
+    start = steady_clock::now();
+    for (long r = 0; r < rounds; r++) {
+      hits += cache.getBatch(keys.data(), numKeys, vals.get(), found.get());
+    }
+    elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    cout << "  getBatch " << name << ": " << (double) elapsed / (rounds * numKeys) << " ns/op, " << hits << " hits" << endl;
+  };
+
+  unique_ptr<CacheType> cache(new CacheType(BENCH_OPS));
+  cache->setCapacity(BENCH_OPS);
+  cache->putBatch(keys.data(), keys.data(), BENCH_OPS);
+  // Probe in an order unrelated to insertion
+  for (long i = BENCH_OPS - 1; i > 0; i--) {
+    swap(keys[i], keys[benchRand(state) % (i + 1)]);
+  }
+  timeLookups("large", *cache, BENCH_OPS);
+
+  cache.reset(new CacheType());
+  for (long i = 0; i < BENCH_KEYS; i++) {
+    keys[i] = i * 0x10001;
+  }
+  cache->putBatch(keys.data(), keys.data(), BENCH_KEYS);
+  timeLookups("small", *cache, BENCH_KEYS);
+}
+
+/**
+ * Puts with eviction where every value owns 256 allocations - value destruction in the
+ * putting thread versus on a Reclaimer. The worst case includes any time the putting
+ * thread was descheduled, so the 99th percentile is reported next to it
+ *
+ */
+void benchDeferredDestruction(const char* name, bool deferred) {
+  typedef shared_ptr<vector<unique_ptr<long>>> Value;
+  typedef Cache<long, Value, TreeBucket, ClockEviction> CacheType;
+  unique_ptr<CacheType> cache(new CacheType());
+  unique_ptr<Reclaimer<Value>> reclaimer(deferred ? new Reclaimer<Value>() : nullptr);
+  if (deferred) {
+    cache->setReclaimer(reclaimer.get());
+  }
+
+  uint64_t state = 88172645463325252ULL;
+  long ops = BENCH_OPS / 100;
+  long total = 0;
+  vector<long> latencies;
+  latencies.reserve(ops);
+  for (long i = 0; i < ops; i++) {
+    Value val = make_shared<vector<unique_ptr<long>>>();
+    for (long j = 0; j < 256; j++) {
+      val->emplace_back(new long(j));
+    }
+
+    long key = (benchRand(state) >> 8) % 2048;
+    auto start = steady_clock::now();
+    cache->put(key, val);
+    val.reset();
+    long elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+    total += elapsed;
+    latencies.push_back(elapsed);
+  }
+
+  sort(latencies.begin(), latencies.end());
+  cout << name << ": " << (double) total / ops << " ns/put, p99 " << latencies[ops * 99 / 100] << " ns, worst "
+       << latencies.back() << " ns";
+  if (deferred) {
+    cout << ", " << reclaimer->deferredCount() << " deferred, " << reclaimer->inlineCount() << " inline";
+  }
+  cout << endl;
+}
+
+/**
+ * Per-tenant caches - create TENANTS instances and put 16 keys in each
+ *
+ */
+template <typename CacheType>
+void benchTenants(const char* name) {
+  const long TENANTS = 1000;
+  auto start = steady_clock::now();
+  vector<unique_ptr<CacheType>> tenants;
+  for (long t = 0; t < TENANTS; t++) {
+    tenants.emplace_back(new CacheType());
+  }
+  auto created = steady_clock::now();
+
+  for (auto& tenant : tenants) {
+    for (long key = 0; key < 16; key++) {
+      tenant->put(key, key);
+    }
+  }
+  auto filled = steady_clock::now();
+
+  cout << name << ": " << duration_cast<nanoseconds>(created - start).count() / TENANTS << " ns/create, "
+       << duration_cast<nanoseconds>(filled - created).count() / TENANTS << " ns/fill, sizeof " << sizeof(CacheType)
+       << endl;
+}
+
+/**
+ * Two tenants under one budget of 1024 entries - one re-reads 900 keys, the other scans
+ * and never hits. A static split gives each half, a CacheGroup moves memory to the re-reader
+ *
+ */
+void benchCacheGroup() {
+  const long BUDGET = 1024;
+  long ops = BENCH_OPS / 10;
+
+  auto mix = [&](auto&& reread, auto&& scan) {
+    uint64_t state = 88172645463325252ULL;
+    long hits = 0;
+    for (long i = 0; i < ops; i++) {
+      long val;
+      long key = (benchRand(state) >> 8) % 900;
+      if (reread.get(key, val)) {
+        hits++;
+      } else {
+        reread.put(key, i);
+      }
+
+      // Scan keys never repeat
+      if (scan.get(-i, val)) {
+        hits++;
+      } else {
+        scan.put(-i, i);
+      }
+    }
+    return hits;
+  };
+
+  typedef CompactCache<long, long, TreeBucket, ClockEviction> Tenant;
+  Tenant left(BUDGET / 2);
+  Tenant right(BUDGET / 2);
+  long staticHits = mix(left, right);
+
+  CacheGroup<long, long, TreeBucket, ClockEviction> group(BUDGET * EntryBytes()(0L, 0L));
+  auto& reread = group.addMember();
+  auto& scan = group.addMember();
+  long groupHits = mix(reread, scan);
+
+  cout << "  Static split: " << staticHits << " hits" << endl;
+  cout << "  CacheGroup  : " << groupHits << " hits, re-reader holds " << reread.bytes() / EntryBytes()(0L, 0L)
+       << " entries" << endl;
+}
+
+/**
+ * Value sizes shift from 100 to 1000 bytes - a slab cache full of small values re-reads 2000
+ * large ones. Without the mover every page stays with the small class, with it pages move to
+ * the large class. Then every other key is removed and compaction returns the sparse pages
+ *
+ */
+void benchSlabRebalance(const char* name, bool mover) {
+  const size_t BUDGET = 4 << 20;
+  const long KEYS = 2000;
+  long ops = BENCH_OPS / 10;
+
+  SlabCache<long> cache(BUDGET);
+  string small(100, 's');
+  string large(1000, 'l');
+  for (long key = 0; key < (long) (BUDGET / small.size()); key++) {
+    cache.put(-key - 1, small);
+  }
+
+  uint64_t state = 88172645463325252ULL;
+  long hits = 0;
+  string val;
+  for (long i = 0; i < ops; i++) {
+    if (mover && i % 1024 == 0) {
+      cache.maintain();
+    }
+    long key = (benchRand(state) >> 8) % KEYS;
+    if (cache.get(key, val)) {
+      hits++;
+    } else {
+      cache.put(key, large);
+    }
+  }
+
+  double fragmented = cache.fragmentation();
+  for (long key = 0; key < KEYS; key += 2) {
+    cache.remove(key);
+  }
+  double sparse = cache.fragmentation();
+  if (mover) {
+    cache.maintain();
+  }
+
+  cout << name << ": " << hits << " hits, fragmentation " << fragmented << ", " << sparse << " after removes, "
+       << cache.fragmentation() << " after compaction, " << cache.migratedCount() << " migrated, "
+       << cache.freePages() << " free pages" << endl;
+}
+
+/**
+ * Values of 100 to 4000 bytes, sized per key, in 8MB - reads that put on a miss, plus 10%
+ * overwrites, with and without the background pass run every 1024 ops. Slab classes round
+ * every value up to its slot, the log packs them and the cleaner reclaims what overwrites
+ * leave behind
+ *
+ */
+template <typename CacheType>
+void benchVariableSize(const char* name, bool background) {
+  const size_t BUDGET = 8 << 20;
+  const long KEYS = 3500;
+  long ops = BENCH_OPS / 10;
+
+  CacheType cache(BUDGET);
+  string large(4000, 'v');
+  uint64_t state = 88172645463325252ULL;
+  long hits = 0;
+  string val;
+  auto start = steady_clock::now();
+  for (long i = 0; i < ops; i++) {
+    if (background && i % 1024 == 0) {
+      if constexpr (is_same<CacheType, SlabCache<long>>::value) {
+        cache.maintain();
+      } else {
+        cache.clean();
+      }
+    }
+    uint64_t r = benchRand(state);
+    long key = (r >> 8) % KEYS;
+    size_t size = 100 + (key * 2654435761UL) % 3900;
+    if (r % 10 == 0) {
+      cache.put(key, large.substr(0, size));
+    } else if (cache.get(key, val)) {
+      hits++;
+    } else {
+      cache.put(key, large.substr(0, size));
+    }
+  }
+  long elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  cout << name << ": " << (double) elapsed / ops << " ns/op, " << hits << " hits";
+  if constexpr (is_same<CacheType, SlabCache<long>>::value) {
+    cout << ", utilization " << 1 - cache.fragmentation() << endl;
+  } else {
+    cout << ", utilization " << cache.utilization() << ", " << cache.cleanedCount() << " cleaned, "
+         << cache.evictedCount() << " evicted segments" << endl;
+  }
+}
+
+/**
+ * Clock the benchmarks advance by hand
+ *
+ */
+struct BenchClock {
+  typedef milliseconds duration;
+  typedef duration::rep rep;
+  typedef duration::period period;
+  typedef chrono::time_point<BenchClock> time_point;
+  static constexpr bool is_steady = true;
+
+  static inline atomic<long> s_now{0};
+
+  static time_point now() {
+    return time_point(duration(s_now.load(memory_order_relaxed)));
+  }
+};
+
+/**
+ * Sessions with TTLs of 30s (60%), 5m (30%) and 1h (10%) in 16MB - a put of a new key and a
+ * read of one of the last 20000 every simulated millisecond. With no TTLs every entry stays
+ * until it is merged away
+ *
+ */
+void benchTtlSegments(const char* name, bool ttls) {
+  const long RECENT = 20000;
+  const uint64_t SCRAMBLE = 0x9E3779B97F4A7C15ULL;
+  long ops = BENCH_OPS / 10;
+
+  SegCache<long, TreeBucket, StdHasher<long>, BenchClock> cache(16 << 20);
+  string val(200, 'v');
+  string out;
+  uint64_t state = 88172645463325252ULL;
+  long hits = 0;
+  auto start = steady_clock::now();
+  for (long i = 0; i < ops; i++) {
+    BenchClock::s_now.store(i, memory_order_relaxed);
+    if (i % 1024 == 0) {
+      cache.expire();
+    }
+
+    uint64_t r = benchRand(state);
+    milliseconds ttl = !ttls ? milliseconds(0) : r % 10 < 6 ? seconds(30) : r % 10 < 9 ? minutes(5) : hours(1);
+    // Scrambled so the sequential session ids do not degenerate the index trees
+    cache.put((long) (i * SCRAMBLE), val, ttl);
+    if (cache.get((long) ((i - 1 - (long) ((r >> 8) % RECENT)) * SCRAMBLE), out)) {
+      hits++;
+    }
+  }
+  long elapsed = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  cout << name << ": " << (double) elapsed / ops << " ns/op, " << hits << " hits, " << cache.expiredCount()
+       << " expired, " << cache.mergedCount() << " merged, " << cache.droppedCount() << " dropped segments, "
+       << cache.evictedCount() << " evicted" << endl;
+}
+
+/**
+ * Rendered fragments - 100000 user keys share 500 distinct 1KB values. Plain strings keep a
+ * copy per key, a ValueTable keeps one per value
+ *
+ */
+void benchDedup() {
+  const long KEYS = 100000;
+  const long FRAGMENTS = 500;
+
+  vector<string> fragments;
+  for (long f = 0; f < FRAGMENTS; f++) {
+    fragments.push_back(string(1000, 'a' + f % 26) + to_string(f));
+  }
+
+  uint64_t state = 88172645463325252ULL;
+  vector<long> picks;
+  for (long key = 0; key < KEYS; key++) {
+    picks.push_back((benchRand(state) >> 8) % FRAGMENTS);
+  }
+
+  long plainBytes = 0;
+  for (long pick : picks) {
+    plainBytes += sizeof(string) + fragments[pick].size();
+  }
+
+  auto plain = new Cache<long, string, TreeBucket, ClockEviction>(KEYS);
+  plain->setCapacity(KEYS);
+  auto start = steady_clock::now();
+  for (long key = 0; key < KEYS; key++) {
+    plain->put(key, fragments[picks[key]]);
+  }
+  long plainNs = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+  delete plain;
+
+  ValueTable<string> table;
+  auto deduped = new Cache<long, ValueTable<string>::Ref, TreeBucket, ClockEviction>(KEYS);
+  deduped->setCapacity(KEYS);
+  start = steady_clock::now();
+  for (long key = 0; key < KEYS; key++) {
+    deduped->put(key, table.intern(fragments[picks[key]]));
+  }
+  long dedupNs = duration_cast<nanoseconds>(steady_clock::now() - start).count();
+
+  cout << "  Plain  : " << (double) plainNs / KEYS << " ns/put, " << plainBytes / 1024 << " KB of values" << endl;
+  cout << "  Deduped: " << (double) dedupNs / KEYS << " ns/put, " << table.storedBytes() / 1024 << " KB of values, "
+       << table.savedBytes() / 1024 << " KB saved, " << table.uniqueValues() << " unique" << endl;
+  delete deduped;
+}
+
+/**
+ * 1KB JSON documents, 2% of them hot - ArtBucket so they can be scanned to size them
+ * After a compressing pass the cold ones are held compressed, the hot ones raw. A cold
+ * lookup pays for expanding the value once
+ *
+ */
+void benchColdCompression() {
+  const long KEYS = 20000;
+  const long HOT = KEYS / 50;
+  const long LOOKUPS = 100000;
+
+  auto cache = new Cache<long, TieredValue, ArtBucket, ClockEviction>(KEYS);
+  cache->setCapacity(KEYS);
+  uint64_t state = 88172645463325252ULL;
+  for (long key = 0; key < KEYS; key++) {
+    string doc = "{\"id\":" + to_string(key) + ",\"items\":[";
+    while (doc.size() < 1000) {
+      uint64_t r = benchRand(state);
+      doc += "{\"sku\":\"SKU-" + to_string(r % 100000) + "\",\"qty\":" + to_string((r >> 20) % 10) +
+             ",\"status\":\"" + ((r >> 30) % 2 ? "shipped" : "pending") + "\"},";
+    }
+    cache->put(key, TieredValue(doc + "]}"));
+  }
+
+  auto storedBytes = [&]() {
+    long bytes = 0;
+    cache->scan(0, KEYS, [&](const long&, const TieredValue& val) { bytes += EntryBytes::of(val); });
+    return bytes;
+  };
+
+  TieredValue out;
+  long before = storedBytes();
+  for (long key = 0; key < HOT; key++) {
+    cache->get(key, out);
+  }
+  // Reference bits are the CLOCK notion of recent, so age is unused
+  long compressed = cache->compressCold(milliseconds(0));
+  long after = storedBytes();
+
+  auto timeLookups = [&](long from, long count) {
+    auto start = steady_clock::now();
+    for (long i = 0; i < LOOKUPS; i++) {
+      cache->get(from + (long) ((benchRand(state) >> 8) % count), out);
+    }
+    return (double) duration_cast<nanoseconds>(steady_clock::now() - start).count() / LOOKUPS;
+  };
+  double hotNs = timeLookups(0, HOT);
+  // Distinct keys, so each one is expanded on its lookup
+  auto start = steady_clock::now();
+  for (long key = HOT; key < HOT + LOOKUPS / 10 && key < KEYS; key++) {
+    cache->get(key, out);
+  }
+  double coldNs = (double) duration_cast<nanoseconds>(steady_clock::now() - start).count() / min(LOOKUPS / 10, KEYS - HOT);
+
+  cout << "  " << compressed << " compressed, " << before / 1024 << " KB -> " << after / 1024 << " KB" << endl;
+  cout << "  Hot lookup : " << hotNs << " ns" << endl;
+  cout << "  Cold lookup: " << coldNs << " ns" << endl;
+  delete cache;
+}
+
+/**
+ * Shared values - threads replace BENCH_KEYS Elements, then look them up. Each hit copies
+ * the handle out: an atomic increment of a separate control block for shared_ptr, of the
+ * count beside the value for Counted, a plain one for Counted with NoLocking
+ *
+ */
+template <typename Value, typename Locking>
+void benchHandles(const char* name, int numThreads) {
+  typedef Cache<long, Value, TreeBucket, ClockEviction, Locking> CacheType;
+  unique_ptr<CacheType> cache(new CacheType());
+  long ops = BENCH_OPS / 2;
+
+  // Replacing values frees the old ones, so allocations are mostly reuse
+  auto run = [&](bool puts, long count) {
+    vector<thread> threads;
+    auto start = steady_clock::now();
+    for (int tid = 0; tid < numThreads; tid++) {
+      threads.emplace_back([&, tid]() {
+        uint64_t state = 88172645463325252ULL + tid;
+        Value element;
+        for (long i = 0; i < count / numThreads; i++) {
+          long key = (benchRand(state) >> 8) % BENCH_KEYS;
+          if (!puts) {
+            cache->get(key, element);
+          } else if constexpr (is_same<Value, shared_ptr<Element>>::value) {
+            cache->put(key, make_shared<Element>(key, 'e', i));
+          } else {
+            cache->put(key, cache->make(key, 'e', i));
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    return (double) duration_cast<nanoseconds>(steady_clock::now() - start).count() / count;
+  };
+  double putNs = run(true, ops / 10);
+  double getNs = run(false, ops);
+
+  cout << name << ": " << putNs << " ns/put, " << getNs << " ns/get, " << sizeof(Value) << " byte handle" << endl;
+}
+
+void runBenchmarks() {
+  cout << "Delete-heavy mix (" << BENCH_OPS << " ops)" << endl;
+  benchDeleteHeavy<TreeBucket>("  TreeBucket     ");
+  benchDeleteHeavy<RobinHoodBucket>("  RobinHoodBucket");
+  benchDeleteHeavy<SplitBucket>("  SplitBucket    ");
+  benchDeleteHeavy<ArtBucket>("  ArtBucket      ");
+  benchDeleteHeavy<AvlBucket>("  AvlBucket      ");
+  benchDeleteHeavy<HybridBucket>("  HybridBucket   ");
+
+  cout << "Ordered scans of " << SCAN_KEYS << " keys (" << BENCH_OPS / SCAN_KEYS << " scans)" << endl;
+  benchScan<StdHasher<long>>("  1024 hashed buckets", 1024);
+  benchScan<SingleBucketHasher<long>>("  Single tree        ", 1);
+
+  cout << "Zipf 0.99 lookups, " << ZIPF_KEYS << " keys in " << ZIPF_BUCKETS << " buckets (" << BENCH_OPS / 2 << " ops)" << endl;
+  benchZipf<TreeBucket>("  TreeBucket  ", 0.99);
+  benchZipf<AvlBucket>("  AvlBucket   ", 0.99);
+  benchZipf<SplayBucket>("  SplayBucket ", 0.99);
+  benchZipf<FrozenBucket>("  FrozenBucket", 0.99);
+
+  cout << "Uniform lookups, " << ZIPF_KEYS << " keys in " << ZIPF_BUCKETS << " buckets (" << BENCH_OPS / 2 << " ops)" << endl;
+  benchZipf<TreeBucket>("  TreeBucket  ", 0);
+  benchZipf<AvlBucket>("  AvlBucket   ", 0);
+  benchZipf<FrozenBucket>("  FrozenBucket", 0);
+  benchZipf<RobinHoodBucket>("  RobinHood   ", 0);
+  benchZipf<SplitBucket>("  SplitBucket ", 0);
+
+  cout << "Read-mostly mix with eviction (" << BENCH_OPS / 10 << " ops)" << endl;
+  benchReadMostly<Cache<long, long>>("  Mutex + LRU          ");
+  benchReadMostly<Cache<long, long, TreeBucket, ClockEviction>>("  Mutex + CLOCK        ");
+  benchReadMostly<Cache<long, long, TreeBucket, SoaEviction<long>>>("  Mutex + SoA LRU      ");
+  benchReadMostly<Cache<long, long, TreeBucket, ClockEviction, NoLocking, FibonacciHasher<long>>>("  NoLocking + CLOCK    ");
+
+  cout << "Batch hashing, " << BENCH_OPS << " keys" << endl;
+  benchBatchHashing();
+
+  cout << "Value destruction on put (" << BENCH_OPS / 100 << " ops)" << endl;
+  benchDeferredDestruction("  Inline   ", false);
+  benchDeferredDestruction("  Reclaimer", true);
+
+  cout << "Per-tenant caches, 1000 instances of 16 entries" << endl;
+  benchTenants<Cache<long, long, TreeBucket, ClockEviction>>("  Cache       ");
+  benchTenants<CompactCache<long, long, TreeBucket, ClockEviction>>("  CompactCache");
+
+  cout << "Shared budget, 2 tenants (" << BENCH_OPS / 10 << " ops each)" << endl;
+  benchCacheGroup();
+
+  cout << "Slab classes after a value size shift (" << BENCH_OPS / 10 << " ops)" << endl;
+  benchSlabRebalance("  No mover", false);
+  benchSlabRebalance("  Mover   ", true);
+
+  cout << "Variable size values in 8MB (" << BENCH_OPS / 10 << " ops)" << endl;
+  benchVariableSize<SlabCache<long>>("  Slab, no mover   ", false);
+  benchVariableSize<SlabCache<long>>("  Slab with mover  ", true);
+  benchVariableSize<LogCache<long>>("  Log, no cleaner  ", false);
+  benchVariableSize<LogCache<long>>("  Log with cleaner ", true);
+
+  cout << "TTL segments, " << BENCH_OPS / 10 << " simulated ms" << endl;
+  benchTtlSegments("  No TTLs", false);
+  benchTtlSegments("  TTLs   ", true);
+
+  cout << "Duplicate values, 100000 keys over 500 values" << endl;
+  benchDedup();
+
+  cout << "Cold value compression, 20000 1KB documents" << endl;
+  benchColdCompression();
+
+  cout << "Value handles, " << BENCH_KEYS << " Elements, 1 thread (" << BENCH_OPS / 20 << " puts, " << BENCH_OPS / 2 << " gets)" << endl;
+  benchHandles<shared_ptr<Element>, MutexLocking>("  shared_ptr         ", 1);
+  benchHandles<Counted<Element>, MutexLocking>("  Counted            ", 1);
+  benchHandles<Counted<Element, NoLocking>, NoLocking>("  Counted + NoLocking", 1);
+
+  cout << "Value handles, " << BENCH_KEYS << " Elements, " << MAX_THREADS << " threads (" << BENCH_OPS / 20 << " puts, " << BENCH_OPS / 2 << " gets)" << endl;
+  benchHandles<shared_ptr<Element>, MutexLocking>("  shared_ptr         ", MAX_THREADS);
+  benchHandles<Counted<Element>, MutexLocking>("  Counted            ", MAX_THREADS);
+
+  cout << "Adjacent stripes, " << MAX_THREADS << " threads on " << thread::hardware_concurrency() << " cpus ("
+       << BENCH_OPS * 2 << " gets)" << endl;
+  benchAdjacentStripes<PackedMutexLocking>("  Packed locks");
+  benchAdjacentStripes<MutexLocking>("  Padded locks");
+
+  cout << "Single bucket contention, " << MAX_THREADS << " threads (" << BENCH_OPS / 10 << " ops)" << endl;
+  benchContention<MutexLocking>("  std::mutex  ");
+  benchContention<StripedLocking<SpinParkLock>>("  SpinParkLock");
+  benchContention<StripedLocking<McsLock>>("  McsLock     ");
+
+  cout << "Hot bucket writes, " << MAX_THREADS << " threads (" << BENCH_OPS / 10 << " ops)" << endl;
+  benchHotBucketWrites<Cache<long, long, TreeBucket, ClockEviction>>("  Locked        ");
+  benchHotBucketWrites<FlatCombiningCache<long, long, TreeBucket, ClockEviction>>("  Flat combining");
+
+  cout << "Thread per core, " << MAX_THREADS << " threads (" << BENCH_OPS / 10 << " ops)" << endl;
+  benchThreadPerCore();
+}
+
+int main (int argc, char** argv) {
+  if (argc > 1 && string(argv[1]) == "bench") {
+    runBenchmarks();
+    return 0;
+  }
+
+  Cache<long, Counted<Element>>* cache = new Cache<long, Counted<Element>>();
+  vector<int> keys(MAX_ELEMENTS);
+
+  /**
+   * Populates cache with MAX_ELEMENTS
+   *
+   */
+  auto insertFunc = [&](int tid) {
+    for (int i = (tid * ELEMENTS_PER_THREAD); i < ((tid * ELEMENTS_PER_THREAD) + ELEMENTS_PER_THREAD); i++) {
+      if (i >= MAX_ELEMENTS) {
+        break;
+      }
+      int randKey = rand();
+      keys[i] = randKey;
+      if (!cache->put(randKey, cache->make(i, '\0', randKey))) {
+        cout << "Cache full! ERROR!" << endl;
+        break;
+      }
+    }
+  };
+
+  /**
+   * Multi-threaded insert into the cache
+   *
+   */
+  vector<future<void>> futures;
+
+  for (int i = 0; i < MAX_THREADS; i++) {
+    futures.push_back(async(insertFunc, i));
+  }
+
+  for (auto& future : futures) {
+    future.get();
+  }
+
+  futures.clear();
+
+  /**
+   * Retrieves from cache and updates element field
+   *
+   */
+  auto updateFunc = [&](int tid) {
+    for (const auto& key : keys) {
+      Counted<Element> element;
+      if (cache->get(key, element)) {
+        element->val3 = rand();
+      } else {
+        cout << "[UPDATE] ERROR! Element " << key << " not found in cache. Possibly evicted?" << endl;
+      }
+    }
+  };
+
+  for (int i = 0; i < MAX_THREADS; i++) {
+    futures.push_back(async(updateFunc, i));
+  }
+
+  for (auto& future : futures) {
+    future.get();
+  }
+
+  futures.clear();
+
+  /**
+   * Removes element from cache
+   *
+   */
+  auto deleteFunc = [&](int tid) {
+    for (const auto& key : keys) {
+      if (!cache->remove(key)) {
+        cout << "[DELETE] ERROR! Element " << key << " not found in cache. Possibly evicted?" << endl;
+      }
+    }
+  };
+
+  // UNCOMMENT BELOW TO TEST SIMULTANEOUS UPDATES & DELETES  
+  /*for (int i = 0; i < MAX_THREADS; i++) {
+    futures.push_back(async(deleteFunc, i));
+  }
+
+  for (int i = 0; i < MAX_THREADS; i++) {
+    futures.push_back(async(updateFunc, i));
+  }
+
+  for (auto& future : futures) {
+    future.get();
+  }
+
+  futures.clear();*/
+
+  delete cache;
 
   return 0;
 }